@@ -86,7 +86,7 @@ gcc -m32 -O2 -std=gnu99 -shared \
  -I./ \
  -I$luapath/src \
  -Iluasocket \
- -Wl,--whole-archive $outpath/x86/$lualibname.a -Wl,--no-whole-archive -static-libgcc -static-libstdc++
+ -Wl,--whole-archive $outpath/x86/$lualibname.a -Wl,--no-whole-archive -static-libgcc -static-libstdc++ -lpthread
 
 if [ "$?" = "0" ]; then
 	echo -e "\n[MAINTAINCE] build libtolua.so success"
@@ -53,7 +53,7 @@ echo -e "\n[MAINTAINCE] build $lualibname.a done\n"
 
 cd ..
 
-gcc -m64 -O2 -std=gnu99 -shared \
+gcc -m64 -O2 -std=gnu99 -shared -DLUAJIT_ENABLE_GC64 \
  tolua.c \
  int64.c \
  uint64.c \
@@ -86,7 +86,7 @@ gcc -m64 -O2 -std=gnu99 -shared \
  -I./ \
  -I$luapath/src \
  -Iluasocket \
- -Wl,--whole-archive $outpath/x86_64/$lualibname.a -Wl,--no-whole-archive -static-libgcc -static-libstdc++
+ -Wl,--whole-archive $outpath/x86_64/$lualibname.a -Wl,--no-whole-archive -static-libgcc -static-libstdc++ -lpthread
 
 if [ "$?" = "0" ]; then
 	echo -e "\n[MAINTAINCE] build libtolua.so success"
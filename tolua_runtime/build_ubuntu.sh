@@ -14,7 +14,7 @@ echo -e "\n[MAINTAINCE] build libluajit.a done\n"
 
 cd ..
 
-gcc -m64 -O2 -std=gnu99 -shared \
+gcc -m64 -O2 -std=gnu99 -shared -DLUAJIT_ENABLE_GC64 \
  tolua.c \
  int64.c \
  uint64.c \
@@ -42,7 +42,7 @@ gcc -m64 -O2 -std=gnu99 -shared \
  -I./ \
  -Iluajit-2.1/src \
  -Iluasocket \
- -Wl,--whole-archive ubuntu/libluajit.a -Wl,--no-whole-archive -static-libgcc -static-libstdc++
+ -Wl,--whole-archive ubuntu/libluajit.a -Wl,--no-whole-archive -static-libgcc -static-libstdc++ -lpthread
 
 if [ "$?" = "0" ]; then
 	echo -e "\n[MAINTAINCE] build libtolua.so success"
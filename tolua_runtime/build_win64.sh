@@ -63,7 +63,7 @@ mingw32-make clean
 
 cd ..
 
-gcc -m64 -O2 -std=gnu99 -shared \
+gcc -m64 -O2 -std=gnu99 -shared -DLUAJIT_ENABLE_GC64 \
     tolua.c \
     int64.c \
     uint64.c \
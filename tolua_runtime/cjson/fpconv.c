@@ -35,12 +35,9 @@
 
 #include "fpconv.h"
 
-/* Lua CJSON assumes the locale is the same for all threads within a
- * process and doesn't change after initialisation.
- *
- * This avoids the need for per thread storage or expensive checks
- * for call. */
-static char locale_decimal_point = '.';
+/* The decimal point is detected once per cjson instance and kept in its
+ * config, so states on different threads never share mutable data.
+ * Assumes the locale doesn't change after initialisation. */
 
 /* In theory multibyte decimal_points are possible, but
  * Lua CJSON only supports UTF-8 and known locales only have
@@ -49,7 +46,7 @@ static char locale_decimal_point = '.';
  * localconv() may not be thread safe (=>crash), and nl_langinfo() is
  * not supported on some platforms. Use sprintf() instead - if the
  * locale does change, at least Lua CJSON won't crash. */
-static void fpconv_update_locale()
+static char fpconv_update_locale()
 {
     char buf[8];
 
@@ -62,7 +59,7 @@ static void fpconv_update_locale()
         abort();
     }
 
-    locale_decimal_point = buf[1];
+    return buf[1];
 }
 
 /* Check for a valid number character: [-+0-9a-yA-Y.]
@@ -103,7 +100,7 @@ static int strtod_buffer_size(const char *s)
 
 /* Similar to strtod(), but must be passed the current locale's decimal point
  * character. Guaranteed to be called at the start of any valid number in a string */
-double fpconv_strtod(const char *nptr, char **endptr)
+double fpconv_strtod(const char *nptr, char **endptr, char locale_decimal_point)
 {
     char localbuf[FPCONV_G_FMT_BUFSIZE];
     char *buf, *endbuf, *dp;
@@ -171,7 +168,7 @@ static void set_number_format(char *fmt, int precision)
 }
 
 /* Assumes there is always at least 32 characters available in the target buffer */
-int fpconv_g_fmt(char *str, double num, int precision)
+int fpconv_g_fmt(char *str, double num, int precision, char locale_decimal_point)
 {
     char buf[FPCONV_G_FMT_BUFSIZE];
     char fmt[6];
@@ -196,9 +193,9 @@ int fpconv_g_fmt(char *str, double num, int precision)
     return len;
 }
 
-void fpconv_init()
+char fpconv_init()
 {
-    fpconv_update_locale();
+    return fpconv_update_locale();
 }
 
 /* vi:ai et sw=4 ts=4:
@@ -7,16 +7,18 @@
 # define FPCONV_G_FMT_BUFSIZE   32
 
 #ifdef USE_INTERNAL_FPCONV
-static inline void fpconv_init()
+static inline char fpconv_init()
 {
-    /* Do nothing - not required */
+    /* Not required, the internal routines always use '.' */
+    return '.';
 }
 #else
-extern void fpconv_init();
+/* Returns the decimal point of the current locale */
+extern char fpconv_init();
 #endif
 
-extern int fpconv_g_fmt(char*, double, int);
-extern double fpconv_strtod(const char*, char**);
+extern int fpconv_g_fmt(char*, double, int, char);
+extern double fpconv_strtod(const char*, char**, char);
 
 /* vi:ai et sw=4 ts=4:
  */
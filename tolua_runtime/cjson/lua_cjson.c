@@ -43,6 +43,8 @@
 #include "lua.h"
 #include "lualib.h"
 #include "lauxlib.h"
+#include <stdint.h>
+#include "../tolua.h"
 
 #include "strbuf.h"
 #include "fpconv.h"
@@ -128,11 +130,14 @@ typedef struct {
 
     int decode_invalid_numbers;
     int decode_max_depth;
+
+    char decimal_point;             /* Locale decimal point for fpconv */
 } json_config_t;
 
 typedef struct {
     const char *data;
     const char *ptr;
+    const char *end;  /* Input need not be '\0' terminated (tolua.bytes) */
     strbuf_t *tmp;    /* Temporary storage for strings */
     json_config_t *cfg;
     int current_depth;
@@ -391,6 +396,7 @@ static void json_create_config(lua_State *l)
     cfg->decode_invalid_numbers = DEFAULT_DECODE_INVALID_NUMBERS;
     cfg->encode_keep_buffer = DEFAULT_ENCODE_KEEP_BUFFER;
     cfg->encode_number_precision = DEFAULT_ENCODE_NUMBER_PRECISION;
+    cfg->decimal_point = fpconv_init();
 
 #if DEFAULT_ENCODE_KEEP_BUFFER > 0
     strbuf_init(&cfg->encode_buf, 0);
@@ -610,7 +616,7 @@ static void json_append_number(lua_State *l, json_config_t *cfg,
     }
 
     strbuf_ensure_empty_length(json, FPCONV_G_FMT_BUFSIZE);
-    len = fpconv_g_fmt(strbuf_empty_ptr(json), num, cfg->encode_number_precision);
+    len = fpconv_g_fmt(strbuf_empty_ptr(json), num, cfg->encode_number_precision, cfg->decimal_point);
     strbuf_extend_length(json, len);
 }
 
@@ -807,6 +813,19 @@ static int codepoint_to_utf8(char *utf8, int codepoint)
 }
 
 
+/* Returns the character at ptr + offset, or '\0' past the end of the input.
+ * The lexer uses '\0' as its end marker, so a length bounded buffer reads
+ * the same as a terminated string. */
+static inline char json_peek(json_parse_t *json, int offset)
+{
+    return json->end - json->ptr > offset ? json->ptr[offset] : '\0';
+}
+
+static inline int json_match(json_parse_t *json, const char *s, int len)
+{
+    return json->end - json->ptr >= len && !memcmp(json->ptr, s, len);
+}
+
 /* Called when index pointing to beginning of UTF-16 code escape: \uXXXX
  * \u is guaranteed to exist, but the remaining hex characters may be
  * missing.
@@ -824,6 +843,8 @@ static int json_append_unicode_escape(json_parse_t *json)
     int escape_len = 6;
 
     /* Fetch UTF-16 code unit */
+    if (json->end - json->ptr < escape_len)
+        return -1;
     codepoint = decode_hex4(json->ptr + 2);
     if (codepoint < 0)
         return -1;
@@ -840,7 +861,8 @@ static int json_append_unicode_escape(json_parse_t *json)
             return -1;
 
         /* Ensure the next code is a unicode escape */
-        if (*(json->ptr + escape_len) != '\\' ||
+        if (json->end - json->ptr < escape_len * 2 ||
+            *(json->ptr + escape_len) != '\\' ||
             *(json->ptr + escape_len + 1) != 'u') {
             return -1;
         }
@@ -898,7 +920,7 @@ static void json_next_string_token(json_parse_t *json, json_token_t *token)
      */
     strbuf_reset(json->tmp);
 
-    while ((ch = *json->ptr) != '"') {
+    while ((ch = json_peek(json, 0)) != '"') {
         if (!ch) {
             /* Premature end of the string */
             json_set_token_error(token, json, "unexpected end of string");
@@ -908,7 +930,7 @@ static void json_next_string_token(json_parse_t *json, json_token_t *token)
         /* Handle escapes */
         if (ch == '\\') {
             /* Fetch escape character */
-            ch = *(json->ptr + 1);
+            ch = json_peek(json, 1);
 
             /* Translate escape code and append to tmp string */
             ch = escape2char[(unsigned char)ch];
@@ -958,33 +980,36 @@ static void json_next_string_token(json_parse_t *json, json_token_t *token)
  */
 static int json_is_invalid_number(json_parse_t *json)
 {
-    const char *p = json->ptr;
+    int i = 0;
+    char ch = json_peek(json, 0);
 
     /* Reject numbers starting with + */
-    if (*p == '+')
+    if (ch == '+')
         return 1;
 
     /* Skip minus sign if it exists */
-    if (*p == '-')
-        p++;
+    if (ch == '-')
+        ch = json_peek(json, ++i);
 
     /* Reject numbers starting with 0x, or leading zeros */
-    if (*p == '0') {
-        int ch2 = *(p + 1);
+    if (ch == '0') {
+        int ch2 = json_peek(json, i + 1);
 
         if ((ch2 | 0x20) == 'x' ||          /* Hex */
             ('0' <= ch2 && ch2 <= '9'))     /* Leading zero */
             return 1;
 
         return 0;
-    } else if (*p <= '9') {
+    } else if (ch <= '9') {
         return 0;                           /* Ordinary number */
     }
 
     /* Reject inf/nan */
-    if (!strncasecmp(p, "inf", 3))
+    if (json->end - json->ptr - i < 3)
+        return 0;
+    if (!strncasecmp(json->ptr + i, "inf", 3))
         return 1;
-    if (!strncasecmp(p, "nan", 3))
+    if (!strncasecmp(json->ptr + i, "nan", 3))
         return 1;
 
     /* Pass all other numbers which may still be invalid, but
@@ -992,12 +1017,37 @@ static int json_is_invalid_number(json_parse_t *json)
     return 0;
 }
 
+/* Superset of the characters strtod() may consume, including "nan(...)" */
+static inline int json_number_char(char ch)
+{
+    char lower_ch = ch | 0x20;
+
+    return ('0' <= ch && ch <= '9') || ('a' <= lower_ch && lower_ch <= 'z') ||
+           ch == '-' || ch == '+' || ch == '.' || ch == '_' ||
+           ch == '(' || ch == ')';
+}
+
 static void json_next_number_token(json_parse_t *json, json_token_t *token)
 {
+    const char *p = json->ptr;
     char *endptr;
 
+    while (p < json->end && json_number_char(*p))
+        p++;
+
     token->type = T_NUMBER;
-    token->value.number = fpconv_strtod(json->ptr, &endptr);
+    if (p == json->end) {
+        /* The number runs to the end of the input, strtod() needs a
+         * terminator. json->tmp is at least as large as the input. */
+        strbuf_reset(json->tmp);
+        strbuf_append_mem_unsafe(json->tmp, json->ptr, p - json->ptr);
+        strbuf_ensure_null(json->tmp);
+        p = strbuf_string(json->tmp, NULL);
+        token->value.number = fpconv_strtod(p, &endptr, json->cfg->decimal_point);
+        endptr = (char *)json->ptr + (endptr - p);
+    } else {
+        token->value.number = fpconv_strtod(json->ptr, &endptr, json->cfg->decimal_point);
+    }
     if (json->ptr == endptr)
         json_set_token_error(token, json, "invalid number");
     else
@@ -1017,7 +1067,7 @@ static void json_next_token(json_parse_t *json, json_token_t *token)
 
     /* Eat whitespace. */
     while (1) {
-        ch = (unsigned char)*(json->ptr);
+        ch = (unsigned char)json_peek(json, 0);
         token->type = ch2token[ch];
         if (token->type != T_WHITESPACE)
             break;
@@ -1060,17 +1110,17 @@ static void json_next_token(json_parse_t *json, json_token_t *token)
         }
         json_next_number_token(json, token);
         return;
-    } else if (!strncmp(json->ptr, "true", 4)) {
+    } else if (json_match(json, "true", 4)) {
         token->type = T_BOOLEAN;
         token->value.boolean = 1;
         json->ptr += 4;
         return;
-    } else if (!strncmp(json->ptr, "false", 5)) {
+    } else if (json_match(json, "false", 5)) {
         token->type = T_BOOLEAN;
         token->value.boolean = 0;
         json->ptr += 5;
         return;
-    } else if (!strncmp(json->ptr, "null", 4)) {
+    } else if (json_match(json, "null", 4)) {
         token->type = T_NULL;
         json->ptr += 4;
         return;
@@ -1258,9 +1308,13 @@ static int json_decode(lua_State *l)
     luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
 
     json.cfg = json_fetch_config(l);
-    json.data = luaL_checklstring(l, 1, &json_len);
+    json.data = tolua_checklbytes(l, 1, &json_len);
+
+    /* Strings and tolua.bytes are both parsed in place, every read is
+     * bounded by json.end */
     json.current_depth = 0;
     json.ptr = json.data;
+    json.end = json.data + json_len;
 
     /* Detect Unicode other than UTF-8 (see RFC 4627, Sec 3)
      *
@@ -1357,9 +1411,6 @@ static int lua_cjson_new(lua_State *l)
         { NULL, NULL }
     };
 
-    /* Initialise number conversions */
-    fpconv_init();
-
     /* cjson module table */
     lua_newtable(l);
 
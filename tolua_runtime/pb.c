@@ -28,6 +28,7 @@
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
+#include "tolua.h"
 
 #ifdef _WIN32_WCE
 #define PACKED_DECL 
@@ -421,7 +422,7 @@ static uint64_t unpack_varint(const char* buffer, size_t len)
 static int varint_decoder(lua_State *L)
 {
     size_t len;
-    const char* buffer = luaL_checklstring(L, 1, &len);
+    const char* buffer = tolua_checklbytes(L, 1, &len);
     size_t pos = luaL_checkinteger(L, 2);
     
     buffer += pos;
@@ -445,7 +446,7 @@ static int varint_decoder(lua_State *L)
 static int varint_decoder64(lua_State *L)
 {
     size_t len;
-    const char* buffer = luaL_checklstring(L, 1, &len);
+    const char* buffer = tolua_checklbytes(L, 1, &len);
     size_t pos = luaL_checkinteger(L, 2);
     
     buffer += pos;
@@ -467,7 +468,7 @@ static int varint_decoder64(lua_State *L)
 static int signed_varint_decoder(lua_State *L)
 {
     size_t len;
-    const char* buffer = luaL_checklstring(L, 1, &len);
+    const char* buffer = tolua_checklbytes(L, 1, &len);
     size_t pos = luaL_checkinteger(L, 2);
     buffer += pos;
     len = size_varint(buffer, len);
@@ -491,7 +492,7 @@ static int signed_varint_decoder(lua_State *L)
 static int signed_varint_decoder64(lua_State *L)
 {
     size_t len;
-    const char* buffer = luaL_checklstring(L, 1, &len);
+    const char* buffer = tolua_checklbytes(L, 1, &len);
     size_t pos = luaL_checkinteger(L, 2);
     buffer += pos;
     len = size_varint(buffer, len);
@@ -578,7 +579,7 @@ static int zig_zag_decode64(lua_State *L)
 static int read_tag(lua_State *L)
 {
     size_t len;
-    const char* buffer = luaL_checklstring(L, 1, &len);
+    const char* buffer = tolua_checklbytes(L, 1, &len);
     size_t pos = luaL_checkinteger(L, 2);
     
     buffer += pos;
@@ -620,7 +621,7 @@ static int struct_unpack(lua_State *L)
 {        
     uint8_t format = luaL_checkinteger(L, 1);
     size_t len;
-    const uint8_t* buffer = (uint8_t*)luaL_checklstring(L, 2, &len);
+    const uint8_t* buffer = (uint8_t*)tolua_checklbytes(L, 2, &len);
     size_t pos = luaL_checkinteger(L, 3);
     uint8_t out[8];
     buffer += pos;
@@ -701,7 +702,7 @@ static int iostring_write(lua_State* L)
 {
     IOString *io = checkiostring(L);
     size_t size;
-    const char* str = luaL_checklstring(L, 2, &size);
+    const char* str = tolua_checklbytes(L, 2, &size);
 
     if(io->size + size > IOSTRING_BUF_LEN)
     {
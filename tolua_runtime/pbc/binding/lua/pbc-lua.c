@@ -71,7 +71,7 @@ static int
 _env_register(lua_State *L) {
 	struct pbc_env * env = (struct pbc_env *)checkuserdata(L,1);
 	size_t sz = 0;
-	const char * buffer = luaL_checklstring(L, 2 , &sz);
+	const char * buffer = tolua_checklbytes(L, 2 , &sz);
 	struct pbc_slice slice;
 	slice.buffer = (void *)buffer;
 	slice.len = (int)sz;
@@ -101,9 +101,8 @@ _rmessage_new(lua_State *L) {
 	struct pbc_env * env = (struct pbc_env *)checkuserdata(L,1);
 	const char * type_name = luaL_checkstring(L,2);
 	struct pbc_slice slice;
-	if (lua_isstring(L,3)) {
-		size_t sz = 0;
-		slice.buffer = (void *)lua_tolstring(L,3,&sz);
+	size_t sz = 0;
+	if ((slice.buffer = (void *)tolua_tolbytes(L,3,&sz)) != NULL) {
 		slice.len = (int)sz;
 	} else {
 		slice.buffer = lua_touserdata(L,3);
@@ -160,7 +159,7 @@ _rmessage_int64(lua_State *L) {
 	uint32_t hi, low;
 	low = pbc_rmessage_integer(m, key, index, &hi);
 	int64_t v64 = (int64_t)((uint64_t)hi << 32 | (uint64_t)low);
-	if (toluaflags & FLAG_INT64)
+	if (tolua_stateflags(L) & FLAG_INT64)
 	{
 		lua_pushinteger(L, (lua_Integer)v64);
 	}
@@ -184,7 +183,7 @@ _rmessage_uint64(lua_State* L) {
 	uint32_t hi, low;
 	low = pbc_rmessage_integer(m, key, index, &hi);
 	uint64_t v64 = (uint64_t)((uint64_t)hi << 32 | (uint64_t)low);
-	if (toluaflags & FLAG_INT64)
+	if (tolua_stateflags(L) & FLAG_INT64)
 	{
 		lua_pushinteger(L, (lua_Integer)v64);
 	}
@@ -673,9 +672,9 @@ _pattern_unpack(lua_State *L) {
 	const char * format = lua_tolstring(L,2,&format_sz);
 	int size = lua_tointeger(L,3);
 	struct pbc_slice slice;
-	if (lua_isstring(L,4)) {
-		size_t buffer_len = 0;
-		const char *buffer = luaL_checklstring(L,4,&buffer_len);
+	size_t buffer_len = 0;
+	const char *buffer = tolua_tolbytes(L,4,&buffer_len);
+	if (buffer != NULL) {
 		slice.buffer = (void *)buffer;
 		slice.len = buffer_len;
 	} else {
@@ -1014,7 +1013,7 @@ push_value(lua_State *L, int type, const char * type_name, union pbc_value *v) {
 	case PBC_INT64: {
 		int64_t v64 = (int64_t)(v->i.hi) << 32 | (int64_t)(v->i.low);
 		//lua_pushnumber(L,(lua_Number)(int64_t)v64);
-		if (toluaflags & FLAG_INT64)
+		if (tolua_stateflags(L) & FLAG_INT64)
 		{
 			lua_pushinteger(L, (lua_Integer)v64);
 		}
@@ -1035,7 +1034,7 @@ push_value(lua_State *L, int type, const char * type_name, union pbc_value *v) {
 	case PBC_UINT64: {
 		uint64_t v64 = (uint64_t)(v->i.hi) << 32 | (uint64_t)(v->i.low);
 		//lua_pushnumber(L, (lua_Number)(int64_t)v64);
-		if (toluaflags & FLAG_INT64)
+		if (tolua_stateflags(L) & FLAG_INT64)
 		{
 			lua_pushinteger(L, (lua_Integer)v64);
 		}
@@ -1097,9 +1096,8 @@ _decode(lua_State *L) {
 	luaL_checktype(L, 3 , LUA_TTABLE);
 	const char * type = luaL_checkstring(L,4);
 	struct pbc_slice slice;
-	if (lua_type(L,5) == LUA_TSTRING) {
-		size_t len;
-		slice.buffer = (void *)luaL_checklstring(L,5,&len);
+	size_t len;
+	if ((slice.buffer = (void *)tolua_tolbytes(L,5,&len)) != NULL) {
 		slice.len = (int)len;
 	} else {
 		slice.buffer = checkuserdata(L,5);
@@ -35,6 +35,8 @@
 
 #include "lua.h"
 #include "lauxlib.h"
+#include <stdint.h>
+#include "tolua.h"
 
 
 /* basic integer type */
@@ -285,7 +287,7 @@ static int b_unpack (lua_State *L) {
   Header h;
   const char *fmt = luaL_checkstring(L, 1);
   size_t ld;
-  const char *data = luaL_checklstring(L, 2, &ld);
+  const char *data = tolua_checklbytes(L, 2, &ld);
   size_t pos = luaL_optinteger(L, 3, 1) - 1;
   defaultoptions(&h);
   lua_settop(L, 2);
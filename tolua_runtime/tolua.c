@@ -22,6 +22,10 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
 
+#if defined(_WIN32) && !defined(_WIN32_WINNT)
+#define _WIN32_WINNT 0x0600             //SRWLOCK, CONDITION_VARIABLE
+#endif
+
 #include <string.h>
 #if !defined __APPLE__
 #include <malloc.h>
@@ -30,6 +34,7 @@ SOFTWARE.
 #include <math.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <stdio.h>
 
 #include "lualib.h"
 #include "lauxlib.h"
@@ -40,6 +45,37 @@ SOFTWARE.
 #else
 #include <time.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#endif
+
+/*ubox 需要从对象指针压栈, 只能用虚拟机内部结构. luajit x64 编译tolua.c时要和libluajit.a一致定义LUAJIT_ENABLE_GC64,
+  不一致时tolua_openubox自检失败, 退回弱表*/
+#if defined(LUA_JITLIBNAME)
+#include "luajit.h"
+#include "lj_obj.h"
+#include "lj_gc.h"
+#define TOLUA_NATIVE_UBOX
+typedef GCudata ubox_obj;
+#define ubox_toobj(p)               ((GCudata*)(p) - 1)
+#define ubox_checkobj(o, sz)        ((o)->gct == (uint8_t)~LJ_TUDATA && (o)->udtype == UDTYPE_USERDATA && (o)->len == (sz))
+#define ubox_pushobj(L, o)          do { lua_pushnil(L); setudataV(L, L->top - 1, (o)); } while (0)
+#define ubox_finalizing(L, box, i)   (((box)->slots[i].obj->marked & LJ_GC_FINALIZED) != 0)
+#define intern_toobj(s)             ((GCstr*)(s) - 1)
+#define intern_pushobj(L, o)        do { lua_pushnil(L); setstrV(L, L->top - 1, (GCstr*)(o)); } while (0)
+#elif LUA_VERSION_NUM == 504
+#include "lstate.h"
+#include "lgc.h"
+#define TOLUA_NATIVE_UBOX
+typedef Udata ubox_obj;
+#define ubox_toobj(p)               ((Udata*)((char*)(p) - udatamemoffset(1)))
+#define ubox_checkobj(o, sz)        ((o)->tt == LUA_VUSERDATA && (o)->nuvalue == 1 && (o)->len == (sz))
+#define ubox_pushobj(L, o)          do { lua_pushnil(L); setuvalue(L, s2v(L->top - 1), (o)); } while (0)
+#define intern_toobj(s)             ((TString*)((char*)(s) - offsetof(TString, contents)))
+#define intern_pushobj(L, o)        do { lua_pushnil(L); setsvalue(L, s2v(L->top - 1), (TString*)(o)); } while (0)
 #endif
 
 int toluaflags = FLAG_INDEX_ERROR;
@@ -47,6 +83,55 @@ static int tag = 0;
 static int gettag = 0;
 static int settag = 0;
 static int vptr = 1;
+static int cachetag = 0;
+static int getitag = 0;
+
+typedef struct stringbuffer 
+{        
+  const char *buffer;
+  size_t len;
+} stringbuffer;
+
+#define TOLUA_MAXVALUETYPES     32
+#define BYTECODE_PATHMAX        1024
+
+/*每个 lua_State 一份的可变状态, 多个虚拟机可以放在不同线程并行跑. tolua_openlibs 时建在注册表里,
+  5.4 另把指针放进 extraspace, lua_newthread 会从主线程复制, 取的时候不用查表.
+  仍是进程级的: 绑定统计(加锁和原子计数), 预编译缓存(加锁), channel, luajit 的 jit.profile(同一时间只采样一个 lua_State)*/
+typedef struct tolua_context
+{
+    int flags;
+    int flagmask;                   //tolua_setstateflag 设置过的位, 其余位跟随全局 toluaflags
+    stringbuffer sb;                //正在注册的模块全名
+    luaL_Buffer buffers[4];         //tolua_buffinit 轮换使用
+    int bufferindex;
+    int classversion;               //类结构变化时递增, 类查找缓存整体失效
+    int preloadversion;             //tolua_addpreload 时递增
+    int coidle;                     //协程池里空闲的线程数
+    int cohits;
+    int comisses;
+    int interncount;                //tolua_internstring 登记的字符串数
+    int internsize;
+    void **interned;                //字符串对象指针, 数组本身是 LUA_RIDX_INTERN[0] 的 userdata
+    bool nativeobj;                 //ubox_selftest 通过, 可以直接按对象指针压栈
+    int valuetypes;                 //tolua_openvaluetype 登记的值类型元表, 为 0 时回退到 GetLuaValueType
+    const void *valuetypemeta[TOLUA_MAXVALUETYPES];
+    int valuetypeid[TOLUA_MAXVALUETYPES];
+    char bytecodedir[BYTECODE_PATHMAX - 32];    //tolua_setbytecodecache, 空串为关闭
+    struct profiler *prof;          //tolua_profiler_start 时分配, 随 context 释放
+} tolua_context;
+
+#if LUA_VERSION_NUM == 504
+#define getcontext(L)   (*(tolua_context**)lua_getextraspace(L))
+#else
+static tolua_context *getcontext(lua_State *L)
+{
+    lua_getref(L, LUA_RIDX_CONTEXT);
+    tolua_context *ctx = (tolua_context*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    return ctx;
+}
+#endif
 
 #if LUA_VERSION_NUM == 501
 #define lua_pushglobaltable(L)  \
@@ -113,8 +198,93 @@ LUALIB_API void tolua_freebuffer(void* buffer)
   free(buffer);
 }
 
+/*x y z w r g b a, indices match LUA_RIDX_VALUEFIELDS*/
+#define VALUE_XYZW 1
+#define VALUE_RGBA 5
+
+//读取默认布局的值类型, 元表不符或者字段不是number时返回false走lua Get
+static bool _getvaluetype(lua_State *L, int pos, int meta, int field, int n, float *v)
+{
+    pos = abs_index(L, pos);
+
+    if (lua_getmetatable(L, pos) == 0)
+    {
+        return false;
+    }
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, meta);            //stack: mt meta
+    bool flag = lua_rawequal(L, -1, -2) ? true : false;
+    lua_pop(L, 2);
+
+    if (!flag)
+    {
+        return false;
+    }
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_VALUEFIELDS);
+
+    for (int i = 0; i < n; i++)
+    {
+        lua_rawgeti(L, -1, field + i);                  //stack: fields name
+        lua_rawget(L, pos);                             //stack: fields value
+
+        if (lua_type(L, -1) != LUA_TNUMBER)
+        {
+            lua_pop(L, 2);
+            return false;
+        }
+
+        v[i] = (float)lua_tonumber(L, -1);
+        lua_pop(L, 1);
+    }
+
+    lua_pop(L, 1);
+    return true;
+}
+
+static void _setvaluefields(lua_State *L, int t, int fields, int field, int n, const float *v)
+{
+    t = abs_index(L, t);
+    fields = abs_index(L, fields);
+
+    for (int i = 0; i < n; i++)
+    {
+        lua_rawgeti(L, fields, field + i);
+        lua_pushnumber(L, v[i]);
+        lua_rawset(L, t);
+    }
+}
+
+static bool _pushvaluetype(lua_State *L, int meta, int field, int n, const float *v)
+{
+    lua_rawgeti(L, LUA_REGISTRYINDEX, meta);            //stack: mt
+
+    if (!lua_istable(L, -1))
+    {
+        lua_pop(L, 1);
+        return false;
+    }
+
+    lua_createtable(L, 0, n);                           //stack: mt t
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_VALUEFIELDS);
+    _setvaluefields(L, -2, -1, field, n, v);
+    lua_pop(L, 1);                                      //stack: mt t
+    lua_insert(L, -2);                                  //stack: t mt
+    lua_setmetatable(L, -2);
+    return true;
+}
+
 LUALIB_API void tolua_getvec2(lua_State *L, int pos, float* x, float* y)
 {
+    float v[2];
+
+    if (_getvaluetype(L, pos, LUA_RIDX_VEC2META, VALUE_XYZW, 2, v))
+    {
+        *x = v[0];
+        *y = v[1];
+        return;
+    }
+
 	lua_getref(L, LUA_RIDX_UNPACKVEC2);
 	lua_pushvalue(L, pos);
 	lua_call(L, 1, 2);
@@ -125,6 +295,16 @@ LUALIB_API void tolua_getvec2(lua_State *L, int pos, float* x, float* y)
 
 LUALIB_API void tolua_getvec3(lua_State *L, int pos, float* x, float* y, float* z)
 {
+    float v[3];
+
+    if (_getvaluetype(L, pos, LUA_RIDX_VEC3META, VALUE_XYZW, 3, v))
+    {
+        *x = v[0];
+        *y = v[1];
+        *z = v[2];
+        return;
+    }
+
 	lua_getref(L, LUA_RIDX_UNPACKVEC3);
 	lua_pushvalue(L, pos);
 	lua_call(L, 1, 3);
@@ -136,6 +316,17 @@ LUALIB_API void tolua_getvec3(lua_State *L, int pos, float* x, float* y, float*
 
 LUALIB_API void tolua_getvec4(lua_State *L, int pos, float* x, float* y, float* z, float* w)
 {
+    float v[4];
+
+    if (_getvaluetype(L, pos, LUA_RIDX_VEC4META, VALUE_XYZW, 4, v))
+    {
+        *x = v[0];
+        *y = v[1];
+        *z = v[2];
+        *w = v[3];
+        return;
+    }
+
 	lua_getref(L, LUA_RIDX_UNPACKVEC4);
 	lua_pushvalue(L, pos);
 	lua_call(L, 1, 4);
@@ -148,6 +339,17 @@ LUALIB_API void tolua_getvec4(lua_State *L, int pos, float* x, float* y, float*
 
 LUALIB_API void tolua_getquat(lua_State *L, int pos, float* x, float* y, float* z, float* w)
 {
+    float v[4];
+
+    if (_getvaluetype(L, pos, LUA_RIDX_QUATMETA, VALUE_XYZW, 4, v))
+    {
+        *x = v[0];
+        *y = v[1];
+        *z = v[2];
+        *w = v[3];
+        return;
+    }
+
 	lua_getref(L, LUA_RIDX_UNPACKQUAT);
 	lua_pushvalue(L, pos);
 	lua_call(L, 1, 4);
@@ -160,6 +362,17 @@ LUALIB_API void tolua_getquat(lua_State *L, int pos, float* x, float* y, float*
 
 LUALIB_API void tolua_getclr(lua_State *L, int pos, float* r, float* g, float* b, float* a)
 {
+    float v[4];
+
+    if (_getvaluetype(L, pos, LUA_RIDX_CLRMETA, VALUE_RGBA, 4, v))
+    {
+        *r = v[0];
+        *g = v[1];
+        *b = v[2];
+        *a = v[3];
+        return;
+    }
+
 	lua_getref(L, LUA_RIDX_UNPACKCLR);
 	lua_pushvalue(L, pos);
 	lua_call(L, 1, 4);
@@ -187,6 +400,13 @@ LUALIB_API int tolua_getlayermask(lua_State *L, int pos)
 
 LUALIB_API void tolua_pushvec2(lua_State *L, float x, float y)
 {
+    float v[2] = {x, y};
+
+    if (_pushvaluetype(L, LUA_RIDX_VEC2META, VALUE_XYZW, 2, v))
+    {
+        return;
+    }
+
 	lua_getref(L, LUA_RIDX_PACKVEC2);
 	lua_pushnumber(L, x);
 	lua_pushnumber(L, y);
@@ -195,6 +415,13 @@ LUALIB_API void tolua_pushvec2(lua_State *L, float x, float y)
 
 LUALIB_API void tolua_pushvec3(lua_State *L, float x, float y, float z)
 {
+    float v[3] = {x, y, z};
+
+    if (_pushvaluetype(L, LUA_RIDX_VEC3META, VALUE_XYZW, 3, v))
+    {
+        return;
+    }
+
 	lua_getref(L, LUA_RIDX_PACKVEC3);
 	lua_pushnumber(L, x);
 	lua_pushnumber(L, y);
@@ -204,6 +431,13 @@ LUALIB_API void tolua_pushvec3(lua_State *L, float x, float y, float z)
 
 LUALIB_API void tolua_pushvec4(lua_State *L, float x, float y, float z, float w)
 {
+    float v[4] = {x, y, z, w};
+
+    if (_pushvaluetype(L, LUA_RIDX_VEC4META, VALUE_XYZW, 4, v))
+    {
+        return;
+    }
+
 	lua_getref(L, LUA_RIDX_PACKVEC4);
 	lua_pushnumber(L, x);
 	lua_pushnumber(L, y);
@@ -214,6 +448,13 @@ LUALIB_API void tolua_pushvec4(lua_State *L, float x, float y, float z, float w)
 
 LUALIB_API void tolua_pushquat(lua_State *L, float x, float y, float z, float w)
 {
+    float v[4] = {x, y, z, w};
+
+    if (_pushvaluetype(L, LUA_RIDX_QUATMETA, VALUE_XYZW, 4, v))
+    {
+        return;
+    }
+
 	lua_getref(L, LUA_RIDX_PACKQUAT);
 	lua_pushnumber(L, x);
 	lua_pushnumber(L, y);
@@ -224,6 +465,13 @@ LUALIB_API void tolua_pushquat(lua_State *L, float x, float y, float z, float w)
 
 LUALIB_API void tolua_pushclr(lua_State *L, float r, float g, float b, float a)
 {
+    float v[4] = {r, g, b, a};
+
+    if (_pushvaluetype(L, LUA_RIDX_CLRMETA, VALUE_RGBA, 4, v))
+    {
+        return;
+    }
+
 	lua_getref(L, LUA_RIDX_PACKCLR);
 	lua_pushnumber(L, r);
 	lua_pushnumber(L, g);
@@ -239,2057 +487,8655 @@ LUALIB_API void tolua_pushlayermask(lua_State *L, int mask)
     lua_call(L, 1, 1);
 }
 
+//批量填充lua数组, 已有的同类型表原地复用, 多出的元素置nil
+static void _setvaluearray(lua_State *L, int pos, int pack, int meta, int field, int n, const float *data, int count)
+{
+    pos = abs_index(L, pos);
+    int len = (int)lua_objlen(L, pos);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, meta);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_VALUEFIELDS);   //stack: meta fields
+    int top = lua_gettop(L);
+    bool native = lua_istable(L, top - 1) ? true : false;
 
-LUA_API const char* tolua_tolstring(lua_State *L, int index, int* len) 
+    for (int i = 1; i <= count; i++, data += n)
+    {
+        if (native)
+        {
+            lua_rawgeti(L, pos, i);                             //stack: meta fields v
+
+            if (lua_getmetatable(L, -1) != 0)                   //stack: meta fields v mt
+            {
+                bool same = lua_rawequal(L, -1, top - 1) ? true : false;
+                lua_pop(L, 1);
+
+                if (same)
+                {
+                    _setvaluefields(L, -1, top, field, n, data);
+                    lua_settop(L, top);
+                    continue;
+                }
+            }
+
+            lua_settop(L, top);
+            lua_createtable(L, 0, n);
+            _setvaluefields(L, -1, top, field, n, data);
+            lua_pushvalue(L, top - 1);
+            lua_setmetatable(L, -2);
+        }
+        else
+        {
+            lua_getref(L, pack);
+
+            for (int j = 0; j < n; j++)
+            {
+                lua_pushnumber(L, data[j]);
+            }
+
+            lua_call(L, n, 1);
+        }
+
+        lua_rawseti(L, pos, i);
+    }
+
+    for (int i = count + 1; i <= len; i++)
+    {
+        lua_pushnil(L);
+        lua_rawseti(L, pos, i);
+    }
+
+    lua_settop(L, top - 2);
+}
+
+static int _getvaluearray(lua_State *L, int pos, int unpack, int meta, int field, int n, float *data, int count)
 {
-    size_t sz;
-    const char *ret = lua_tolstring(L, index, &sz);
-    *len = (int)sz;
-    return ret;
+    pos = abs_index(L, pos);
+    int len = (int)lua_objlen(L, pos);
+    count = len < count ? len : count;
+
+    for (int i = 1; i <= count; i++, data += n)
+    {
+        lua_rawgeti(L, pos, i);
+
+        if (!_getvaluetype(L, -1, meta, field, n, data))
+        {
+            lua_getref(L, unpack);
+            lua_pushvalue(L, -2);
+            lua_call(L, 1, n);
+
+            for (int j = 0; j < n; j++)
+            {
+                data[j] = (float)lua_tonumber(L, j - n);
+            }
+
+            lua_pop(L, n);
+        }
+
+        lua_pop(L, 1);
+    }
+
+    return count;
 }
 
-LUA_API void tolua_pushlstring(lua_State *L, const char *s, int l)
+LUALIB_API void tolua_setvec2array(lua_State *L, int pos, const float* data, int count)
 {
-    lua_pushlstring(L, s, (size_t)l);
+    _setvaluearray(L, pos, LUA_RIDX_PACKVEC2, LUA_RIDX_VEC2META, VALUE_XYZW, 2, data, count);
 }
 
-LUA_API void* tolua_newuserdata(lua_State *L, int sz)
+LUALIB_API void tolua_setvec3array(lua_State *L, int pos, const float* data, int count)
 {
-    return lua_newuserdata(L, (size_t)sz);    
+    _setvaluearray(L, pos, LUA_RIDX_PACKVEC3, LUA_RIDX_VEC3META, VALUE_XYZW, 3, data, count);
 }
 
-LUA_API int tolua_objlen(lua_State *L, int idx)
+LUALIB_API void tolua_setvec4array(lua_State *L, int pos, const float* data, int count)
 {
-    size_t len = lua_objlen(L, idx);
-    return (int)len;
+    _setvaluearray(L, pos, LUA_RIDX_PACKVEC4, LUA_RIDX_VEC4META, VALUE_XYZW, 4, data, count);
 }
 
-LUA_API bool tolua_toboolean(lua_State *L, int idx) 
+LUALIB_API void tolua_setquatarray(lua_State *L, int pos, const float* data, int count)
 {
-    int value = lua_toboolean(L, idx);
-    return value == 0 ? false : true;
+    _setvaluearray(L, pos, LUA_RIDX_PACKQUAT, LUA_RIDX_QUATMETA, VALUE_XYZW, 4, data, count);
 }
 
-LUA_API int32_t tolua_tointeger(lua_State *L, int idx) 
+LUALIB_API void tolua_setclrarray(lua_State *L, int pos, const float* data, int count)
 {
-    return (int32_t)lua_tointeger(L, idx);
+    _setvaluearray(L, pos, LUA_RIDX_PACKCLR, LUA_RIDX_CLRMETA, VALUE_RGBA, 4, data, count);
 }
 
-LUALIB_API int tolua_loadbuffer(lua_State *L, const char *buff, int sz, const char *name)
+LUALIB_API int tolua_getvec2array(lua_State *L, int pos, float* data, int count)
 {
-    return luaL_loadbuffer(L, buff, (size_t)sz, name);
+    return _getvaluearray(L, pos, LUA_RIDX_UNPACKVEC2, LUA_RIDX_VEC2META, VALUE_XYZW, 2, data, count);
 }
 
-static int _lua_getfield(lua_State *L)
+LUALIB_API int tolua_getvec3array(lua_State *L, int pos, float* data, int count)
 {
-    const char *name = lua_tostring(L, 2);    
-    lua_getfield(L, 1, name);    
-    return 1;
+    return _getvaluearray(L, pos, LUA_RIDX_UNPACKVEC3, LUA_RIDX_VEC3META, VALUE_XYZW, 3, data, count);
 }
-        
-LUA_API int tolua_getfield(lua_State *L, int idx, const char *field)
+
+LUALIB_API int tolua_getvec4array(lua_State *L, int pos, float* data, int count)
 {
-    idx = abs_index(L, idx);    
-    lua_pushcfunction(L, _lua_getfield);
-    lua_pushvalue(L, idx);
-    lua_pushstring(L, field);
-    return lua_pcall(L, 2, 1, 0);
+    return _getvaluearray(L, pos, LUA_RIDX_UNPACKVEC4, LUA_RIDX_VEC4META, VALUE_XYZW, 4, data, count);
 }
 
-static int _lua_setfield(lua_State *L)
+LUALIB_API int tolua_getquatarray(lua_State *L, int pos, float* data, int count)
 {
-    const char *name = lua_tostring(L, 2);
-    lua_setfield(L, 1, name);
-    return 0;
+    return _getvaluearray(L, pos, LUA_RIDX_UNPACKQUAT, LUA_RIDX_QUATMETA, VALUE_XYZW, 4, data, count);
 }
 
-LUA_API int tolua_setfield(lua_State *L, int idx, const char *key)        
+LUALIB_API int tolua_getclrarray(lua_State *L, int pos, float* data, int count)
 {
-    int top = lua_gettop(L);
-    idx = abs_index(L, idx);
-    lua_pushcfunction(L, _lua_setfield);
-    lua_pushvalue(L, idx);
-    lua_pushstring(L, key);
-    lua_pushvalue(L, top);
-    lua_remove(L, top);
-    return lua_pcall(L, 3, -1, 0);
+    return _getvaluearray(L, pos, LUA_RIDX_UNPACKCLR, LUA_RIDX_CLRMETA, VALUE_RGBA, 4, data, count);
 }
 
-static int _lua_gettable(lua_State *L)
-{    
-    lua_gettable(L, 1);    
-    return 1;
+//matrix 等直接按number数组传递
+LUALIB_API void tolua_setfloatarray(lua_State *L, int pos, const float* data, int count)
+{
+    pos = abs_index(L, pos);
+    int len = (int)lua_objlen(L, pos);
+
+    for (int i = 1; i <= count; i++)
+    {
+        lua_pushnumber(L, data[i - 1]);
+        lua_rawseti(L, pos, i);
+    }
+
+    for (int i = count + 1; i <= len; i++)
+    {
+        lua_pushnil(L);
+        lua_rawseti(L, pos, i);
+    }
 }
 
-LUA_API int tolua_gettable(lua_State *L, int idx)
+LUALIB_API int tolua_getfloatarray(lua_State *L, int pos, float* data, int count)
 {
-    int top = lua_gettop(L);
-    idx = abs_index(L, idx);
-    lua_pushcfunction(L, _lua_gettable);
-    lua_pushvalue(L, idx);
-    lua_pushvalue(L, top);
-    lua_remove(L, top);
-    return lua_pcall(L, 2, -1, 0);
+    pos = abs_index(L, pos);
+    int len = (int)lua_objlen(L, pos);
+    count = len < count ? len : count;
+
+    for (int i = 1; i <= count; i++)
+    {
+        lua_rawgeti(L, pos, i);
+        data[i - 1] = (float)lua_tonumber(L, -1);
+        lua_pop(L, 1);
+    }
+
+    return count;
 }
 
-static int _lua_settable(lua_State *L)
+
+LUA_API const char* tolua_tolstring(lua_State *L, int index, int* len) 
 {
-    lua_settable(L, 1);
-    return 0;
+    size_t sz;
+    const char *ret = lua_tolstring(L, index, &sz);
+    *len = (int)sz;
+    return ret;
 }
 
-LUA_API int tolua_settable(lua_State *L, int idx)
+LUA_API void tolua_pushlstring(lua_State *L, const char *s, int l)
 {
-    int top = lua_gettop(L);
-    idx = abs_index(L, idx);
-    lua_pushcfunction(L, _lua_settable);
-    lua_pushvalue(L, idx);
-    lua_pushvalue(L, top - 1);
-    lua_pushvalue(L, top);
-    lua_remove(L, top);
-    lua_remove(L, top - 1);
-    return lua_pcall(L, 3, -1, 0);
+    lua_pushlstring(L, s, (size_t)l);
 }
 
-static int tolua_closure(lua_State *L)
+/*宿主字符串驻留: tolua_internstring 登记一次得到 id, 之后 tolua_pushinternedstring 按 id 直接把字符串对象压栈, 不再哈希.
+  LUA_RIDX_INTERN: [id] = 字符串, [字符串] = id, [0] = 对象指针数组. 字符串被这张表锚定, 不会回收.
+  对象布局自检没通过时不用指针数组, 按 [id] 取*/
+LUALIB_API int tolua_internstring(lua_State *L, const char *s, int len)
 {
-    lua_CFunction fn = (lua_CFunction)lua_tocfunction(L, lua_upvalueindex(2));
-    int r = fn(L);    
-    
-    if (lua_toboolean(L, lua_upvalueindex(1)))
+    tolua_context *ctx = getcontext(L);
+    lua_getref(L, LUA_RIDX_INTERN);
+    lua_pushlstring(L, s, len > 0 ? (size_t)len : 0);
+    lua_pushvalue(L, -1);
+    lua_rawget(L, -3);                              //stack: t str id
+
+    if (lua_type(L, -1) == LUA_TNUMBER)
     {
-        lua_pushboolean(L, 0);
-        lua_replace(L, lua_upvalueindex(1));
-        return lua_error(L);
+        int id = (int)lua_tointeger(L, -1);
+        lua_pop(L, 3);
+        return id;
     }
-    
-    return r;
-}
 
-//hack for luac, 避免luac error破坏包裹c#函数的异常块(luajit采用的是类似c++异常)
-LUA_API int tolua_pushcfunction(lua_State *L, lua_CFunction fn)
-{        
-    lua_pushboolean(L, 0);
-    lua_pushcfunction(L, fn);
-    lua_pushcclosure(L, tolua_closure, 2);
-    return 0;
+    lua_pop(L, 1);
+    int id = ctx->interncount + 1;
+
+#ifdef TOLUA_NATIVE_UBOX
+    if (ctx->nativeobj)
+    {
+        if (id > ctx->internsize)
+        {
+            int size = ctx->internsize > 0 ? ctx->internsize * 2 : 256;
+            void **interned = (void**)lua_newuserdata(L, sizeof(void*) * size);
+
+            if (ctx->interncount > 0)
+            {
+                memcpy(interned, ctx->interned, sizeof(void*) * ctx->interncount);
+            }
+
+            lua_rawseti(L, -3, 0);
+            ctx->interned = interned;
+            ctx->internsize = size;
+        }
+
+        ctx->interned[id - 1] = intern_toobj(lua_tostring(L, -1));
+    }
+#endif
+
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, -3, id);
+    lua_pushinteger(L, id);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+    ctx->interncount = id;
+    return id;
 }
 
-static int tolua_pusherror(lua_State *L, const char *fmt, ...)
+//id 无效时压入 nil
+LUALIB_API void tolua_pushinternedstring(lua_State *L, int id)
 {
-    va_list argp;
-    va_start(argp, fmt);
-    luaL_where(L, 1);
-    lua_pushvfstring(L, fmt, argp);
-    va_end(argp);
-    lua_concat(L, 2);
-    return 1;
+    tolua_context *ctx = getcontext(L);
+
+    if (id <= 0 || id > ctx->interncount)
+    {
+        lua_pushnil(L);
+        return;
+    }
+
+#ifdef TOLUA_NATIVE_UBOX
+    if (ctx->nativeobj)
+    {
+        intern_pushobj(L, ctx->interned[id - 1]);
+        return;
+    }
+#endif
+
+    lua_getref(L, LUA_RIDX_INTERN);
+    lua_rawgeti(L, -1, id);
+    lua_remove(L, -2);
 }
 
-LUALIB_API int tolua_argerror(lua_State *L, int narg, const char *extramsg)
+/*宿主 UTF-16 字符串直接转 UTF-8 压栈, 或者从 lua 字符串解码到宿主缓冲, 省掉托管层的编码转换.
+  纯 ASCII 段用 SSE2/NEON 一次处理 16 个字符, 其余逐个编解码. 不成对的代理项和非法 UTF-8 替换成 U+FFFD*/
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TOLUA_SSE2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define TOLUA_NEON
+#endif
+
+//转换开头的 ASCII 段, 返回转换的字符数
+static size_t utf16_ascii(const uint16_t *s, size_t n, char *out)
 {
-    lua_Debug ar;
-    
-    if (!lua_getstack(L, 0, &ar))  /* no stack frame? */
+    size_t i = 0;
+
+#if defined(TOLUA_SSE2)
+    const __m128i mask = _mm_set1_epi16((short)0xff80);
+
+    for (; i + 16 <= n; i += 16)
     {
-        return tolua_pusherror(L, "bad argument #%d (%s)", narg, extramsg);        
-    }
+        __m128i a = _mm_loadu_si128((const __m128i*)(s + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(s + i + 8));
+        __m128i t = _mm_and_si128(_mm_or_si128(a, b), mask);
 
-    lua_getinfo(L, "n", &ar);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(t, _mm_setzero_si128())) != 0xffff)
+        {
+            break;
+        }
 
-    if (strcmp(ar.namewhat, "method") == 0) 
+        _mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(a, b));
+    }
+#elif defined(TOLUA_NEON)
+    for (; i + 16 <= n; i += 16)
     {
-        narg--;  /* do not count `self' */
+        uint16x8_t a = vld1q_u16(s + i);
+        uint16x8_t b = vld1q_u16(s + i + 8);
 
-        if (narg == 0)  /* error is in the self argument itself? */
+        if (vmaxvq_u16(vorrq_u16(a, b)) >= 0x80)
         {
-            return tolua_pusherror(L, "calling " LUA_QS " on bad self (%s)", ar.name, extramsg);
+            break;
         }
+
+        vst1q_u8((uint8_t*)out + i, vcombine_u8(vmovn_u16(a), vmovn_u16(b)));
     }
+#endif
 
-    if (ar.name == NULL)
+    for (; i < n && s[i] < 0x80; i++)
     {
-        ar.name = "?";
-    }    
-
-    return tolua_pusherror(L, "bad argument #%d to " LUA_QS " (%s)", narg, ar.name, extramsg);
-}
+        out[i] = (char)s[i];
+    }
 
-LUALIB_API int tolua_error(lua_State *L, const char *msg)
-{
-    lua_pushboolean(L, 1);
-    lua_replace(L, lua_upvalueindex(1));
-    lua_pushstring(L, msg);
-    return 1;
+    return i;
 }
 
-LUALIB_API int tolua_getn(lua_State *L, int i)
+static size_t utf8_ascii(const unsigned char *s, size_t n, uint16_t *out)
 {
-    return tolua_objlen(L, i);
-}
+    size_t i = 0;
 
-LUALIB_API int tolua_strlen(const char *str)
-{
-    if (str == NULL)
+#if defined(TOLUA_SSE2)
+    for (; i + 16 <= n; i += 16)
     {
-        return 0;
+        __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+
+        if (_mm_movemask_epi8(v) != 0)
+        {
+            break;
+        }
+
+        _mm_storeu_si128((__m128i*)(out + i), _mm_unpacklo_epi8(v, _mm_setzero_si128()));
+        _mm_storeu_si128((__m128i*)(out + i + 8), _mm_unpackhi_epi8(v, _mm_setzero_si128()));
     }
+#elif defined(TOLUA_NEON)
+    for (; i + 16 <= n; i += 16)
+    {
+        uint8x16_t v = vld1q_u8(s + i);
 
-    int len = (int)strlen(str);
-    return len;
-}
+        if (vmaxvq_u8(v) >= 0x80)
+        {
+            break;
+        }
 
-static bool _preload(lua_State *L)
-{    
-    lua_settop(L, 2); 
-    lua_getmetatable(L, 1);
-    lua_pushstring(L, ".name");             //stack: t key mt ".name"
-    lua_rawget(L, -2);                      //stack: t key mt space
+        vst1q_u16(out + i, vmovl_u8(vget_low_u8(v)));
+        vst1q_u16(out + i + 8, vmovl_high_u8(v));
+    }
+#endif
 
-    if (!lua_isnil(L, -1))                  //stack: t key mt space
-    {                      
-        lua_getref(L, LUA_RIDX_PRELOAD);    //stack: t key mt space preload
-        lua_pushvalue(L, -2);               //stack: t key mt space preload space
-        lua_pushstring(L, ".");             //stack: t key mt space preload space.
-        lua_pushvalue(L, 2);                //stack: t key mt space preload space.key
-        lua_concat(L, 3);                   //stack: t key mt space preload key1
-        lua_pushvalue(L, -1);               //stack: t key mt space preload key1 key1
-        lua_rawget(L, -3);                  //stack: t key mt space preload key1 value
-
-        if (!lua_isnil(L, -1)) 
-        {      
-            lua_pop(L, 1);                      //stack: t key mt space preload key1
-            lua_getref(L, LUA_RIDX_REQUIRE);    //stack: t key mt space preload key1 require
-            lua_pushvalue(L, -2);
-            lua_call(L, 1, 1);                         
-            return true;
-        }        
+    for (; i < n && s[i] < 0x80; i++)
+    {
+        out[i] = s[i];
     }
 
-    lua_settop(L, 2); 
-    return false;
+    return i;
 }
 
-static int class_index_event(lua_State *L)
+//out 至少 n * 3 字节, 返回写入的字节数
+static size_t utf16_toutf8(const uint16_t *s, size_t n, char *out)
 {
-	int t = lua_type(L, 1);
-
-    if (t == LUA_TUSERDATA)
-    {    	
-        lua_getfenv(L,1);
+    size_t i = 0;
+    size_t o = 0;
 
-        if (!lua_rawequal(L, -1, TOLUA_NOPEER))     // stack: t k env
+    while (i < n)
+    {
+        if (s[i] < 0x80)
         {
-            while (lua_istable(L, -1))                       // stack: t k v mt 
-            {      
-                lua_pushvalue(L, 2); 
-                lua_rawget(L, -2);
-            
-                if (!lua_isnil(L, -1))
-                {
-                    return 1;
-                }
-
-                lua_pop(L, 1);
-                lua_pushlightuserdata(L, &gettag);          
-                lua_rawget(L, -2);                      //stack: obj key env tget
-            
-                if (lua_istable(L, -1))
-                {                    
-                    lua_pushvalue(L, 2);                //stack: obj key env tget key
-                    lua_rawget(L, -2);                  //stack: obj key env tget func 
-
-                    if (lua_isfunction(L, -1))
-                    {                        
-                        lua_pushvalue(L, 1);
-                        lua_call(L, 1, 1);
-                        return 1;
-                    }    
+            size_t k = utf16_ascii(s + i, n - i, out + o);
+            i += k;
+            o += k;
+            continue;
+        }
 
-                    lua_pop(L, 1);                 
-                }
+        uint32_t c = s[i++];
 
-                lua_pop(L, 1); 
+        if (c < 0x800)
+        {
+            out[o++] = (char)(0xc0 | (c >> 6));
+            out[o++] = (char)(0x80 | (c & 0x3f));
+        }
+        else if (c >= 0xd800 && c < 0xdc00 && i < n && s[i] >= 0xdc00 && s[i] < 0xe000)
+        {
+            c = 0x10000 + ((c - 0xd800) << 10) + (s[i++] - 0xdc00);
+            out[o++] = (char)(0xf0 | (c >> 18));
+            out[o++] = (char)(0x80 | ((c >> 12) & 0x3f));
+            out[o++] = (char)(0x80 | ((c >> 6) & 0x3f));
+            out[o++] = (char)(0x80 | (c & 0x3f));
+        }
+        else
+        {
+            c = (c >= 0xd800 && c < 0xe000) ? 0xfffd : c;
+            out[o++] = (char)(0xe0 | (c >> 12));
+            out[o++] = (char)(0x80 | ((c >> 6) & 0x3f));
+            out[o++] = (char)(0x80 | (c & 0x3f));
+        }
+    }
 
-                if (lua_getmetatable(L, -1) == 0)               // stack: t k v mt mt
-                {
-                    lua_pushnil(L);
-                }
+    return o;
+}
 
-                lua_remove(L, -2);                              // stack: t k v mt
-            }        
-        };
+//最多写 cap 个单元, 不拆开代理对. 返回完整转换需要的单元数
+static size_t utf8_toutf16(const unsigned char *s, size_t n, uint16_t *out, size_t cap)
+{
+    size_t i = 0;
+    size_t o = 0;
 
-        lua_settop(L,2);                                        				
-    	lua_pushvalue(L, 1);						// stack: obj key obj	
+    while (i < n)
+    {
+        if (s[i] < 0x80)
+        {
+            if (o < cap)
+            {
+                size_t k = utf8_ascii(s + i, (n - i < cap - o) ? n - i : cap - o, out + o);
+                i += k;
+                o += k;
+            }
+            else
+            {
+                for (; i < n && s[i] < 0x80; i++, o++);
+            }
 
-    	while (lua_getmetatable(L, -1) != 0)
-    	{        	
-        	lua_remove(L, -2);						// stack: obj key mt
+            continue;
+        }
 
-			if (lua_isnumber(L,2))                 	// check if key is a numeric value
-			{		    
-		    	lua_pushstring(L,".geti");
-		    	lua_rawget(L,-2);                   // stack: obj key mt func
-
-		    	if (lua_isfunction(L,-1))
-		    	{
-		        	lua_pushvalue(L,1);
-		        	lua_pushvalue(L,2);
-		        	lua_call(L,2,1);
-		        	return 1;
-		    	}
-			}
-			else
-        	{
-        		lua_pushvalue(L, 2);			    // stack: obj key mt key
-        		lua_rawget(L, -2);					// stack: obj key mt value        
+        uint32_t c = s[i];
+        uint32_t min = 0;
+        size_t len = 0;
 
-        		if (!lua_isnil(L, -1))
-        		{
-        	    	return 1;
-        		}
-                
-                lua_pop(L, 1);
-				lua_pushlightuserdata(L, &gettag);        	
-        		lua_rawget(L, -2);					//stack: obj key mt tget
+        if (c >= 0xc2 && c <= 0xdf)
+        {
+            len = 2;
+            c &= 0x1f;
+            min = 0x80;
+        }
+        else if ((c & 0xf0) == 0xe0)
+        {
+            len = 3;
+            c &= 0x0f;
+            min = 0x800;
+        }
+        else if (c >= 0xf0 && c <= 0xf4)
+        {
+            len = 4;
+            c &= 0x07;
+            min = 0x10000;
+        }
 
-        		if (lua_istable(L, -1))
-        		{
-        	    	lua_pushvalue(L, 2);			//stack: obj key mt tget key
-        	    	lua_rawget(L, -2);           	//stack: obj key mt tget value 
-
-        	    	if (lua_isfunction(L, -1))
-        	    	{
-        	        	lua_pushvalue(L, 1);
-        	        	lua_call(L, 1, 1);
-        	        	return 1;
-        	    	}                    
-        		}
-    		}
+        bool valid = len > 0 && i + len <= n;
 
-            lua_settop(L, 3);
+        for (size_t k = 1; valid && k < len; k++)
+        {
+            valid = (s[i + k] & 0xc0) == 0x80;
+            c = (c << 6) | (s[i + k] & 0x3f);
         }
 
-        lua_settop(L, 2);
-        int *udata = (int*)lua_touserdata(L, 1);
+        if (valid && c >= min && c <= 0x10ffff && (c < 0xd800 || c >= 0xe000))
+        {
+            i += len;
+        }
+        else
+        {
+            c = 0xfffd;
+            ++i;
+        }
 
-        if (*udata == LUA_NULL_USERDATA)
+        if (c >= 0x10000)
         {
-            return luaL_error(L, "attemp to index %s on a nil value", lua_tostring(L, 2));   
+            if (o + 2 <= cap)
+            {
+                c -= 0x10000;
+                out[o] = (uint16_t)(0xd800 + (c >> 10));
+                out[o + 1] = (uint16_t)(0xdc00 + (c & 0x3ff));
+            }
+            else
+            {
+                cap = o;
+            }
+
+            o += 2;
         }
-        
-        if (toluaflags & FLAG_INDEX_ERROR)
+        else
         {
-            return luaL_error(L, "field or property %s does not exist", lua_tostring(L, 2));
-        }        
+            if (o < cap)
+            {
+                out[o] = (uint16_t)c;
+            }
+
+            ++o;
+        }
     }
-    else if(t == LUA_TTABLE)
+
+    return o;
+}
+
+LUALIB_API void tolua_pushwstring(lua_State *L, const uint16_t *s, int len)
+{
+    char buffer[512];
+    size_t n = len > 0 ? (size_t)len : 0;
+
+    if (n * 3 <= sizeof(buffer))
     {
-    	lua_pushvalue(L,1);                          //stack: obj key obj
+        size_t size = utf16_toutf8(s, n, buffer);
+        lua_pushlstring(L, buffer, size);
+        return;
+    }
 
-		while (lua_getmetatable(L, -1) != 0)         //stack: obj key obj mt
-    	{
-        	lua_remove(L, -2);						// stack: obj key mt
+    //长串用 userdata 做临时空间, lua_pushlstring 内存不足抛错时由 gc 回收, 不会泄漏
+    char *out = (char*)lua_newuserdata(L, n * 3);
+    size_t size = utf16_toutf8(s, n, out);
+    lua_pushlstring(L, out, size);
+    lua_remove(L, -2);
+}
 
-        	lua_pushvalue(L, 2);			    	// stack: obj key mt key
-        	lua_rawget(L, -2);						// stack: obj key mt value        
+//解码到 out, 返回完整结果需要的 UTF-16 单元数, 大于 cap 时表示被截断; 不是字符串返回 -1
+LUALIB_API int tolua_towstring(lua_State *L, int idx, uint16_t *out, int cap)
+{
+    size_t len;
+    const char *s = lua_tolstring(L, idx, &len);
 
-        	if (!lua_isnil(L, -1))
-        	{
-        		if (lua_isfunction(L, -1))			//cache static function
-        		{
-        			lua_pushvalue(L, 2);           // stack: obj key mt value key
-        			lua_pushvalue(L, -2);          // stack: obj key mt value key value
-        			lua_rawset(L, 1);
-        		}
+    if (s == NULL)
+    {
+        return -1;
+    }
 
-        	    return 1;
-        	}        	
-        	
-            lua_pop(L, 1);        
-			lua_pushlightuserdata(L, &gettag);        	
-        	lua_rawget(L, -2);						//stack: obj key mt tget
+    return (int)utf8_toutf16((const unsigned char*)s, len, out, cap > 0 ? (size_t)cap : 0);
+}
 
-        	if (lua_istable(L, -1))
-        	{
-        	    lua_pushvalue(L, 2);				//stack: obj key mt tget key
-        	    lua_rawget(L, -2);           		//stack: obj key mt tget value 
+LUA_API void* tolua_newuserdata(lua_State *L, int sz)
+{
+    return lua_newuserdata(L, (size_t)sz);    
+}
 
-        	    if (lua_isfunction(L, -1))
-        	    {        	        	
-                    lua_pushvalue(L, 1);
-        	        lua_call(L, 1, 1);
-        	        return 1;
-        	    }
-        	}
-    		
-        	lua_settop(L, 3);
-    	}        
-        
-        if (_preload(L))
-        {
-            return 1;
-        }          
-        
-        if (toluaflags & FLAG_INDEX_ERROR)
-        {
-            return luaL_error(L, "field or property %s does not exist", lua_tostring(L, 2));               
-        }      
-    }
+LUA_API int tolua_objlen(lua_State *L, int idx)
+{
+    size_t len = lua_objlen(L, idx);
+    return (int)len;
+}
 
-    lua_pushnil(L);
-    return 1;
+LUA_API bool tolua_toboolean(lua_State *L, int idx) 
+{
+    int value = lua_toboolean(L, idx);
+    return value == 0 ? false : true;
 }
 
-static void storeatubox (lua_State *L, int lo)
+LUA_API int32_t tolua_tointeger(lua_State *L, int idx) 
 {
-    lua_getfenv(L, lo);                         // stack: t, k, v, _env
+    return (int32_t)lua_tointeger(L, idx);
+}
 
-    if (lua_rawequal(L, -1, TOLUA_NOPEER)) 
+/*字节码缓存: 按 源码+chunkname+虚拟机类型 的hash存 lua_dump 结果, 下次直接映射文件 lua_load. 默认关闭.
+  文件头记录源码 hash, 字节码长度和 hash, 截断或损坏的文件不交给 lua_load, 改为从源码编译并覆盖*/
+#if defined(LUA_JITLIBNAME)
+#if LJ_GC64
+#define BYTECODE_FLAVOR     "luajit21-gc64"
+#else
+#define BYTECODE_FLAVOR     "luajit21"
+#endif
+#else
+#define BYTECODE_FLAVOR     LUA_RELEASE
+#endif
+
+#define BYTECODE_MAGIC      "tolua\033bc"
+
+typedef struct bytecodeheader
+{
+    char magic[8];
+    uint64_t source;            //同文件名的 hash
+    uint64_t size;              //字节码长度
+    uint64_t hash;              //字节码 hash
+} bytecodeheader;
+
+typedef struct bytecodebuffer
+{
+    char *data;
+    size_t len;
+    size_t cap;
+} bytecodebuffer;
+
+static uint64_t bytecode_hash(uint64_t h, const void *p, size_t len)
+{
+    const unsigned char *s = (const unsigned char*)p;
+
+    for (size_t i = 0; i < len; i++)
     {
-        lua_pop(L, 1);
-        return;
-        //lua_newtable(L);                        // stack: t, k, v, t
-        //lua_pushvalue(L, -1);                   // stack: t, k, v, t, t        
-        //lua_setfenv(L, lo);                     // stack: t, k, v, t
-    };
+        h ^= s[i];
+        h *= 0x100000001b3ULL;
+    }
 
-    lua_insert(L, -3);
-    lua_settable(L, -3);
-    lua_pop(L, 1);
+    return h;
 }
 
-static int class_newindex_event(lua_State *L)
+static uint64_t bytecode_path(char *path, const char *dir, const char *buff, size_t sz, const char *name)
 {
-	int t = lua_type(L, 1);
+    uint64_t h = 0xcbf29ce484222325ULL;
+    h = bytecode_hash(h, BYTECODE_FLAVOR, sizeof(BYTECODE_FLAVOR));
+    h = bytecode_hash(h, &sz, sizeof(sz));
+    h = bytecode_hash(h, name, strlen(name) + 1);       //chunkname 写在调试信息里
+    h = bytecode_hash(h, buff, sz);
+    snprintf(path, BYTECODE_PATHMAX, "%s/%08x%08x.luac", dir, (unsigned int)(h >> 32), (unsigned int)h);
+    return h;
+}
 
-	if (t == LUA_TUSERDATA)
-    {
-        bool useEnv = false;
-        lua_getfenv(L, 1);
+//返回文件里字节码的起始位置, 文件头不符时返回 NULL
+static const char* bytecode_check(const char *view, size_t len, uint64_t source, size_t *size)
+{
+    bytecodeheader header;
 
-        if (!lua_rawequal(L, -1, TOLUA_NOPEER)) 
-        {             
-            useEnv = true;
+    if (len < sizeof(bytecodeheader))
+    {
+        return NULL;
+    }
 
-            while (lua_istable(L, -1))                       // stack: t k v mt 
-            {       
-                lua_pushvalue(L, 2);                        // stack: t k v mt k
-                lua_rawget(L, -2);                          // stack: t k v mt value        
+    memcpy(&header, view, sizeof(bytecodeheader));
+    const char *data = view + sizeof(bytecodeheader);
 
-                if (!lua_isnil(L, -1))
-                {                    
-                    lua_pop(L, 1);
-                    lua_insert(L, -3);
-                    lua_rawset(L, -3);
-                    return 0;
-                }
+    if (memcmp(header.magic, BYTECODE_MAGIC, sizeof(header.magic)) != 0 || header.source != source
+        || header.size != len - sizeof(bytecodeheader) || header.hash != bytecode_hash(0xcbf29ce484222325ULL, data, (size_t)header.size))
+    {
+        return NULL;
+    }
 
-                lua_pop(L, 1);                
-                lua_pushlightuserdata(L, &settag);              // stack: t k v mt tset
-                lua_rawget(L, -2);                   
+    *size = (size_t)header.size;
+    return data;
+}
 
-                if (lua_istable(L, -1)) 
-                {
-                    lua_pushvalue(L, 2);                         // stack: t k v mt tset k
-                    lua_rawget(L, -2);                    
+#ifdef _WIN32
+static const char* bytecode_map(const char *path, size_t *len)
+{
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
 
-                    if (lua_isfunction(L, -1)) 
-                    {                          
-                        lua_pushvalue(L, 1); 
-                        lua_pushvalue(L, 3); 
-                        lua_call(L, 2, 0);
-                        return 0;
-                    }
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return NULL;
+    }
 
-                    lua_pop(L, 1);                              // stack: t k v mt tset 
-                }  
+    DWORD size = GetFileSize(file, NULL);
+    HANDLE map = size != INVALID_FILE_SIZE && size > 0 ? CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+    CloseHandle(file);
 
-                lua_pop(L, 1);                                  // stack: t k v mt
+    if (map == NULL)
+    {
+        return NULL;
+    }
 
-                if (lua_getmetatable(L, -1) == 0)               // stack: t k v mt mt
-                {
-                    lua_pushnil(L);
-                }
+    const char *view = (const char*)MapViewOfFile(map, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(map);
+    *len = (size_t)size;
+    return view;
+}
 
-                lua_remove(L, -2);                              // stack: t k v mt
-            }              
-        }
+static void bytecode_unmap(const char *view, size_t len)
+{
+    UnmapViewOfFile(view);
+}
 
-        lua_settop(L, 3);
-    	lua_getmetatable(L,1);
+static bool bytecode_rename(const char *from, const char *to)
+{
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) != 0;
+}
+#else
+static const char* bytecode_map(const char *path, size_t *len)
+{
+    int fd = open(path, O_RDONLY);
 
-    	while (lua_istable(L, -1))                			// stack: t k v mt
-    	{        	
-    		if (lua_isnumber(L, 2))
-    		{
-				lua_pushstring(L,".seti");
-                lua_rawget(L,-2);                      		// stack: obj key mt func
+    if (fd < 0)
+    {
+        return NULL;
+    }
 
-                if (lua_isfunction(L,-1))
-                {
-                    lua_pushvalue(L,1);
-                    lua_pushvalue(L,2);
-                    lua_pushvalue(L,3);
-                    lua_call(L,3,0);                    
-                }
+    struct stat st;
+    void *view = MAP_FAILED;
 
-                return 0;
-    		}
-    		else
-        	{
-        		lua_pushlightuserdata(L, &settag);
-        		lua_rawget(L, -2);                      	// stack: t k v mt tset
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        view = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
 
-        		if (lua_istable(L, -1))
-        		{
-            		lua_pushvalue(L, 2);
-            		lua_rawget(L, -2);                     	// stack: t k v mt tset func
+    close(fd);
 
-            		if (lua_isfunction(L, -1))
-            		{
-                		lua_pushvalue(L, 1);
-                		lua_pushvalue(L, 3);
-                		lua_call(L, 2, 0);
-                		return 0;
-            		}
+    if (view == MAP_FAILED)
+    {
+        return NULL;
+    }
 
-            		lua_pop(L, 1);                          // stack: t k v mt tset 
-        		}
+    *len = (size_t)st.st_size;
+    return (const char*)view;
+}
 
-        		lua_pop(L, 1);                              // stack: t k v mt 
+static void bytecode_unmap(const char *view, size_t len)
+{
+    munmap((void*)view, len);
+}
 
-        		if (lua_getmetatable(L, -1) == 0)           // stack: t k v mt mt
-        		{
-            		lua_pushnil(L);
-        		}
+static bool bytecode_rename(const char *from, const char *to)
+{
+    return rename(from, to) == 0;
+}
+#endif
 
-        		lua_remove(L, -2);                          // stack: t k v mt 
-        	}
-    	}
+static int bytecode_writer(lua_State *L, const void *p, size_t sz, void *ud)
+{
+    bytecodebuffer *b = (bytecodebuffer*)ud;
+    (void)L;
 
-        lua_settop(L, 3);                                       // stack: t k v
-        int* udata = (int*)lua_touserdata(L, 1);
+    if (b->len + sz > b->cap)
+    {
+        size_t cap = b->cap > 0 ? b->cap : 4096;
 
-        if (*udata == LUA_NULL_USERDATA)
+        while (cap < b->len + sz)
         {
-            return luaL_error(L, "attemp to index %s on a nil value", lua_tostring(L, 2));   
-        }        
+            cap <<= 1;
+        }
 
-        if (useEnv) 
+        char *data = (char*)realloc(b->data, cap);
+
+        if (data == NULL)
         {
-            lua_getfenv(L, 1);                         // stack: t, k, v, _env
-            lua_insert(L, -3);
-            lua_settable(L, -3);
-            lua_pop(L, 1);
-            return 0;
-        }                       
-	}
-	else if (t == LUA_TTABLE)
-	{
-		lua_getmetatable(L, 1);								// stack: t k v mt 
+            return 1;
+        }
 
-		while (lua_istable(L, -1))                			// stack: t k v mt 
-    	{  		
-			lua_pushlightuserdata(L, &settag);				// stack: t k v mt tset
-        	lua_rawget(L, -2);       
+        b->data = data;
+        b->cap = cap;
+    }
 
-        	if (lua_istable(L,-1)) 
-        	{
-            	lua_pushvalue(L,2);  						// stack: t k v mt tset k
-            	lua_rawget(L,-2);
+    memcpy(b->data + b->len, p, sz);
+    b->len += sz;
+    return 0;
+}
 
-            	if (lua_isfunction(L,-1)) 
-            	{  
-                	lua_pushvalue(L,1); 
-                	lua_pushvalue(L,3); 
-                	lua_call(L,2,0);
-                	return 0;
-            	}
+//stack: f, 先写临时文件再改名, 其他进程不会读到写了一半的缓存
+static void bytecode_save(lua_State *L, const char *path, uint64_t source)
+{
+    bytecodebuffer b = {NULL, 0, 0};
+#if LUA_VERSION_NUM >= 503
+    int ret = lua_dump(L, bytecode_writer, &b, 0);
+#else
+    int ret = lua_dump(L, bytecode_writer, &b);
+#endif
+    char temp[BYTECODE_PATHMAX + 8];
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+    FILE *fp = ret == 0 ? fopen(temp, "wb") : NULL;
 
-            	lua_pop(L, 1);                          	// stack: t k v mt tset 
-        	}  
+    if (fp != NULL)
+    {
+        bytecodeheader header;
+        memcpy(header.magic, BYTECODE_MAGIC, sizeof(header.magic));
+        header.source = source;
+        header.size = b.len;
+        header.hash = bytecode_hash(0xcbf29ce484222325ULL, b.data, b.len);
+        bool flag = fwrite(&header, sizeof(header), 1, fp) == 1 && fwrite(b.data, 1, b.len, fp) == b.len;
+
+        if (fclose(fp) != 0 || !flag || !bytecode_rename(temp, path))
+        {
+            remove(temp);
+        }
+    }
 
-			lua_pop(L, 1);                              	// stack: t k v mt
+    free(b.data);
+}
 
-        	if (lua_getmetatable(L, -1) == 0)           	// stack: t k v mt mt
-        	{
-            	lua_pushnil(L);
-        	}
+//dir 为 NULL 或 "" 时关闭. 目录由调用方创建, 每个 lua_State 单独设置
+LUALIB_API bool tolua_setbytecodecache(lua_State *L, const char *dir)
+{
+    tolua_context *ctx = getcontext(L);
+    size_t len = dir != NULL ? strlen(dir) : 0;
 
-        	lua_remove(L, -2);                          	// stack: t k v mt
-        }      
-	}
+    if (len >= sizeof(ctx->bytecodedir))
+    {
+        return false;
+    }
 
-    lua_settop(L, 3); 
-    return luaL_error(L, "field or property %s does not exist", lua_tostring(L, 2));      
+    memcpy(ctx->bytecodedir, dir != NULL ? dir : "", len);
+    ctx->bytecodedir[len] = 0;
+    return true;
 }
 
-static int enum_index_event (lua_State *L)
+LUALIB_API int tolua_loadbuffer(lua_State *L, const char *buff, int sz, const char *name)
 {
-	lua_getmetatable(L, 1);									//stack: t, k, mt
+    const char *dir = getcontext(L)->bytecodedir;
 
-	if (lua_istable(L, -1))
-	{
-		lua_pushvalue(L, 2);								//stack: t, k, mt, k
-		lua_rawget(L, -2);									//stack: t, k, mt, v
+    //已经是字节码(lua 和 luajit 签名都以\033开头)的不缓存
+    if (dir[0] == 0 || sz <= 0 || buff[0] == LUA_SIGNATURE[0])
+    {
+        return luaL_loadbuffer(L, buff, (size_t)sz, name);
+    }
 
-		if (!lua_isnil(L, -1))
-		{		
-			return 1;
-		}
+    char path[BYTECODE_PATHMAX];
+    size_t len = 0;
+    name = name != NULL ? name : "?";
+    uint64_t source = bytecode_path(path, dir, buff, (size_t)sz, name);
+    const char *view = bytecode_map(path, &len);
 
-		lua_pop(L, 1);										//stack: t, k, mt
-		lua_pushlightuserdata(L, &gettag);		
-		lua_rawget(L, -2); 									//stack: t, k, mt, tget
+    if (view != NULL)
+    {
+        size_t size = 0;
+        const char *data = bytecode_check(view, len, source, &size);
+        int ret = data != NULL ? luaL_loadbuffer(L, data, size, name) : -1;
+        bytecode_unmap(view, len);
 
-		if (lua_istable(L,-1)) 
-		{
-            lua_pushvalue(L,2);  							//stack: t k mt tget k
-            lua_rawget(L,-2);								//stack: t k mt tget v
+        if (ret == 0)
+        {
+            return 0;
+        }
 
-           	if (lua_isfunction(L,-1)) 
-			{  
-				lua_call(L, 0, 1);					
-				lua_pushvalue(L,2); 				
-				lua_pushvalue(L,-2); 				
-				lua_rawset(L, 3);		
-				return 1;			
-			}
+        if (ret > 0)
+        {
+            lua_pop(L, 1);                              //缓存损坏, 重新编译覆盖
+        }
+    }
 
-			lua_pop(L, 1);
-        }			
-	}
+    int ret = luaL_loadbuffer(L, buff, (size_t)sz, name);
 
-	lua_settop(L, 2);
-	lua_pushnil(L);
-	return 1;	
-}
+    if (ret == 0)
+    {
+        bytecode_save(L, path, source);
+    }
 
-static int enum_newindex_event(lua_State *L)
-{	
-	luaL_error(L, "the left-hand side of an assignment must be a variable, a property or an indexer");
-    return 1;
+    return ret;
 }
 
-static int static_index_event(lua_State *L)
-{    
-    lua_pushvalue(L, 2);                    //stack: t key key
-    lua_rawget(L, 1);                       //stack: t key value        
+/*---------------------------precompile--------------------------------*/
+//后台线程用独立的 lua_State 编译, lua_dump 结果按 (所属虚拟机, 模块名) 放进缓存. require 的 searcher 先查这里.
+//工作线程进程内共用, tolua_shutdownprecompile 结束并回收
+#ifdef _WIN32
+typedef SRWLOCK tolua_mutex;
+typedef CONDITION_VARIABLE tolua_cond;
+#define TOLUA_MUTEX_INIT        SRWLOCK_INIT
+#define TOLUA_COND_INIT         CONDITION_VARIABLE_INIT
+#define tolua_lock(m)           AcquireSRWLockExclusive(m)
+#define tolua_unlock(m)         ReleaseSRWLockExclusive(m)
+#define tolua_wait(c, m)        SleepConditionVariableSRW(c, m, INFINITE, 0)
+#define tolua_signal(c)         WakeConditionVariable(c)
+#define tolua_broadcast(c)      WakeAllConditionVariable(c)
+#define tolua_mutexinit(m)      InitializeSRWLock(m)
+#define tolua_mutexfree(m)      ((void)(m))
+#define tolua_condinit(c)       InitializeConditionVariable(c)
+#define tolua_condfree(c)       ((void)(c))
+#else
+typedef pthread_mutex_t tolua_mutex;
+typedef pthread_cond_t tolua_cond;
+#define TOLUA_MUTEX_INIT        PTHREAD_MUTEX_INITIALIZER
+#define TOLUA_COND_INIT         PTHREAD_COND_INITIALIZER
+#define tolua_lock(m)           pthread_mutex_lock(m)
+#define tolua_unlock(m)         pthread_mutex_unlock(m)
+#define tolua_wait(c, m)        pthread_cond_wait(c, m)
+#define tolua_signal(c)         pthread_cond_signal(c)
+#define tolua_broadcast(c)      pthread_cond_broadcast(c)
+#define tolua_mutexinit(m)      pthread_mutex_init(m, NULL)
+#define tolua_mutexfree(m)      pthread_mutex_destroy(m)
+#define tolua_condinit(c)       pthread_cond_init(c, NULL)
+#define tolua_condfree(c)       pthread_cond_destroy(c)
+#endif
 
-    if (!lua_isnil(L, -1))
+//原子操作, 统计计数和 channel 共用
+#ifdef _MSC_VER
+#define atomic_load32(p)        ((uint32_t)InterlockedOr((volatile LONG*)(p), 0))
+#define atomic_store32(p, v)    InterlockedExchange((volatile LONG*)(p), (LONG)(v))
+#define atomic_cas32(p, o, n)   (InterlockedCompareExchange((volatile LONG*)(p), (LONG)(n), (LONG)(o)) == (LONG)(o))
+#define atomic_add32(p, v)      InterlockedExchangeAdd((volatile LONG*)(p), (LONG)(v))
+#define atomic_load64(p)        ((uint64_t)InterlockedOr64((volatile LONG64*)(p), 0))
+#define atomic_store64(p, v)    InterlockedExchange64((volatile LONG64*)(p), (LONG64)(v))
+#define atomic_add64(p, v)      InterlockedExchangeAdd64((volatile LONG64*)(p), (LONG64)(v))
+#define atomic_fence()          MemoryBarrier()
+#else
+#define atomic_load32(p)        __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define atomic_store32(p, v)    __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define atomic_cas32(p, o, n)   __sync_bool_compare_and_swap(p, o, n)
+#define atomic_add32(p, v)      __sync_fetch_and_add(p, v)
+#define atomic_load64(p)        __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define atomic_store64(p, v)    __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define atomic_add64(p, v)      __sync_fetch_and_add(p, v)
+#define atomic_fence()          __sync_synchronize()
+#endif
+
+#define PRECOMPILE_BUCKETS      1024
+#define PRECOMPILE_MAXWORKERS   4
+
+#define CHUNK_QUEUED            0
+#define CHUNK_RUNNING           1
+#define CHUNK_DONE              2
+#define CHUNK_FAILED            3
+
+typedef struct chunkentry
+{
+    struct chunkentry *next;        //同一bucket
+    struct chunkentry *qnext;       //待编译队列
+    const void *owner;              //提交它的虚拟机的 tolua_context, 只有这个虚拟机的 require 能取走
+    char *name;
+    char *chunkname;
+    char *source;                   //编译成功后释放, 失败时留给主线程重新编译取错误信息
+    size_t size;
+    char *blob;
+    size_t bloblen;
+    int state;
+} chunkentry;
+
+typedef struct blobwriter
+{
+    char *data;
+    size_t len;
+    size_t cap;
+} blobwriter;
+
+static tolua_mutex precompilelock = TOLUA_MUTEX_INIT;
+static tolua_cond precompileready = TOLUA_COND_INIT;   //队列非空
+static tolua_cond precompiledone = TOLUA_COND_INIT;    //有条目编译完成
+static chunkentry *chunkbuckets[PRECOMPILE_BUCKETS];
+static chunkentry *chunkqhead = NULL;
+static chunkentry *chunkqtail = NULL;
+static int precompileworkers = 0;
+static bool precompilestop = false;
+#ifdef _WIN32
+static HANDLE precompilethreads[PRECOMPILE_MAXWORKERS];
+#else
+static pthread_t precompilethreads[PRECOMPILE_MAXWORKERS];
+#endif
+
+static chunkentry** chunk_find(const void *owner, const char *name)
+{
+    uint64_t h = bytecode_hash(0xcbf29ce484222325ULL, &owner, sizeof(owner));
+    h = bytecode_hash(h, name, strlen(name));
+    chunkentry **p = &chunkbuckets[h & (PRECOMPILE_BUCKETS - 1)];
+
+    while (*p != NULL && ((*p)->owner != owner || strcmp((*p)->name, name) != 0))
     {
-        return 1;
+        p = &(*p)->next;
     }
 
-    lua_pop(L, 1);            
-    lua_pushlightuserdata(L, &gettag);      //stack: t key tag    
-    lua_rawget(L, 1);                       //stack: t key tget
+    return p;
+}
 
-    if (lua_istable(L, -1))
-    {
-        lua_pushvalue(L, 2);                //stack: obj key tget key
-        lua_rawget(L, -2);                  //stack: obj key tget func 
+static void chunk_free(chunkentry *e)
+{
+    free(e->name);
+    free(e->chunkname);
+    free(e->source);
+    free(e->blob);
+    free(e);
+}
 
-        if (lua_isfunction(L, -1))
-        {                       
-            lua_call(L, 0, 1);
-            return 1;
-        }        
-    }
-    
-    lua_settop(L, 2);
+static void chunk_dequeue(chunkentry *e)
+{
+    chunkentry *prev = NULL;
 
-    if (_preload(L))
+    for (chunkentry *q = chunkqhead; q != NULL; prev = q, q = q->qnext)
     {
-        return 1;
+        if (q == e)
+        {
+            if (prev != NULL)
+            {
+                prev->qnext = q->qnext;
+            }
+            else
+            {
+                chunkqhead = q->qnext;
+            }
+
+            if (chunkqtail == q)
+            {
+                chunkqtail = prev;
+            }
+
+            e->qnext = NULL;
+            return;
+        }
     }
-    
-    if (toluaflags & FLAG_INDEX_ERROR)
+}
+
+static char* chunk_strdup(const char *s)
+{
+    size_t len = strlen(s) + 1;
+    char *p = (char*)malloc(len);
+
+    if (p != NULL)
     {
-        luaL_error(L, "field or property %s does not exist", lua_tostring(L, 2));    
+        memcpy(p, s, len);
     }
 
-    return 1;
+    return p;
 }
 
-static int static_newindex_event(lua_State *L)
+static int precompile_writer(lua_State *L, const void *p, size_t sz, void *ud)
 {
-    lua_pushlightuserdata(L, &settag);              //stack: t k v tag
-    lua_rawget(L, 1);                               //stack: t k v tset
+    blobwriter *w = (blobwriter*)ud;
+    (void)L;
 
-    if (lua_istable(L,-1)) 
+    if (w->len + sz > w->cap)
     {
-        lua_pushvalue(L, 2);                         //stack: t k v tset k
-        lua_rawget(L, -2);                           //stack: t k v tset func
+        size_t cap = w->cap == 0 ? 4096 : w->cap;
 
-        if (lua_isfunction(L, -1))
-        {    
-            lua_pushvalue(L,1); 
-            lua_pushvalue(L,3); 
-            lua_call(L,2,0);
-            return 0;
+        while (cap < w->len + sz)
+        {
+            cap *= 2;
+        }
+
+        char *data = (char*)realloc(w->data, cap);
+
+        if (data == NULL)
+        {
+            return 1;
         }
+
+        w->data = data;
+        w->cap = cap;
     }
 
-    lua_settop(L, 3); 
-    luaL_error(L, "field or property %s does not exist", lua_tostring(L, 2));
-    return 1;
+    memcpy(w->data + w->len, p, sz);
+    w->len += sz;
+    return 0;
 }
 
-static int vptr_index_event(lua_State *L)
-{    
-    lua_pushlightuserdata(L, &vptr);
-    lua_rawget(L, 1);                                   // stack: t key u
-    lua_replace(L, 1);                                  // stack: u key
-    lua_pushvalue(L, 1);                                // stack: u key u
+//不持锁调用, e 的状态是 CHUNK_RUNNING, 别的线程不会动它
+static void precompile_run(chunkentry *e)
+{
+    blobwriter w = {NULL, 0, 0};
+    lua_State *L = luaL_newstate();
+    bool ok = false;
 
-    while (lua_getmetatable(L, -1) != 0)
+    if (L != NULL)
     {
-        lua_remove(L, -2);                              // stack: u key mt
-        lua_pushvalue(L, 2);                            // stack: u key mt key
-        lua_rawget(L, -2);                              // stack: u key mt value        
-
-        if (!lua_isnil(L, -1))
+        if (luaL_loadbuffer(L, e->source, e->size, e->chunkname) == 0)
         {
-            return 1;
+#if LUA_VERSION_NUM >= 503
+            ok = lua_dump(L, precompile_writer, &w, 0) == 0;
+#else
+            ok = lua_dump(L, precompile_writer, &w) == 0;
+#endif
         }
-        
-        lua_pop(L, 1);        
-        lua_pushlightuserdata(L, &gettag);          
-        lua_rawget(L, -2);                              //stack: u key mt tget
 
-        if (lua_istable(L, -1))
-        {
-            lua_pushvalue(L, 2);                        //stack: obj key mt tget key
-            lua_rawget(L, -2);                          //stack: obj key mt tget value 
+        lua_close(L);
+    }
 
-            if (lua_isfunction(L, -1))
-            {
-                lua_pushvalue(L, 1);
-                lua_call(L, 1, 1);
-                return 1;
-            }
-        }
+    tolua_lock(&precompilelock);
 
-        lua_settop(L, 3);
+    if (ok)
+    {
+        e->blob = w.data;
+        e->bloblen = w.len;
+        free(e->source);
+        e->source = NULL;
+        e->state = CHUNK_DONE;
+    }
+    else
+    {
+        free(w.data);
+        e->state = CHUNK_FAILED;
     }
 
-    lua_settop(L, 2);
-    lua_pushnil(L);
-    return 1;
+    tolua_broadcast(&precompiledone);
+    tolua_unlock(&precompilelock);
 }
 
-static int vptr_newindex_event(lua_State *L)
-{    
-    lua_pushlightuserdata(L, &vptr);
-    lua_rawget(L, 1);                                   // stack: t key v u        
-    lua_getmetatable(L, -1);
+#ifdef _WIN32
+static DWORD WINAPI precompile_worker(LPVOID arg)
+#else
+static void* precompile_worker(void *arg)
+#endif
+{
+    (void)arg;
 
-    while (lua_istable(L, -1))                          // stack: u k v mt
-    {           
-        lua_pushlightuserdata(L, &settag);
-        lua_rawget(L, -2);                              // stack: u k v mt tset
+    for (;;)
+    {
+        tolua_lock(&precompilelock);
 
-        if (lua_istable(L, -1))
+        while (chunkqhead == NULL && !precompilestop)
         {
-            lua_pushvalue(L, 2);
-            lua_rawget(L, -2);                          // stack: u k v mt tset func
-
-            if (lua_isfunction(L, -1))
-            {
-                lua_pushvalue(L, 4);
-                lua_pushvalue(L, 3);
-                lua_call(L, 2, 0);
-                return 0;
-            }
-
-            lua_pop(L, 1);                              // stack: t k v mt tset 
+            tolua_wait(&precompileready, &precompilelock);
         }
 
-        lua_pop(L, 1);                                  // stack: t k v mt 
-
-        if (lua_getmetatable(L, -1) == 0)               // stack: t k v mt mt
+        if (precompilestop)
         {
-            lua_pushnil(L);
+            tolua_unlock(&precompilelock);
+            break;
         }
 
-        lua_remove(L, -2);                              // stack: t k v mt             
+        chunkentry *e = chunkqhead;
+        chunkqhead = e->qnext;
+        chunkqtail = chunkqhead != NULL ? chunkqtail : NULL;
+        e->qnext = NULL;
+        e->state = CHUNK_RUNNING;
+        tolua_unlock(&precompilelock);
+        precompile_run(e);
     }
 
-    lua_settop(L, 3);    
-    return 1;
-}
-
-LUALIB_API bool tolua_isvptrtable(lua_State *L, int index)
-{    
-    lua_pushlightuserdata(L, &vptr);
-    lua_rawget(L, index);
-    bool flag = lua_isnil(L, -1) ? false : true;
-    lua_pop(L, 1);
-    return flag;
-}
-
-LUALIB_API void tolua_setindex(lua_State *L)
-{
-	lua_pushstring(L, "__index");
-	lua_pushcfunction(L, class_index_event);
-	lua_rawset(L, -3);
+    return 0;
 }
 
-LUALIB_API void tolua_setnewindex(lua_State *L)
+//持锁调用
+static void precompile_startworkers()
 {
-	lua_pushstring(L, "__newindex");
-	lua_pushcfunction(L, class_newindex_event);
-	lua_rawset(L, -3);
-}
+    if (precompileworkers > 0)
+    {
+        return;
+    }
 
-LUALIB_API bool tolua_pushudata(lua_State *L, int index)
-{
-	lua_getref(L, LUA_RIDX_UBOX);			// stack: ubox
-	lua_rawgeti(L, -1, index); 				// stack: ubox, obj
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    int n = (int)info.dwNumberOfProcessors - 1;
+#else
+    int n = (int)sysconf(_SC_NPROCESSORS_ONLN) - 1;
+#endif
+    n = n < 1 ? 1 : (n > PRECOMPILE_MAXWORKERS ? PRECOMPILE_MAXWORKERS : n);
 
-	if (!lua_isnil(L, -1))
-	{
-		lua_remove(L, -2); 					// stack: obj
-		return true;
-	}
+    for (int i = 0; i < n; i++)
+    {
+#ifdef _WIN32
+        HANDLE thread = CreateThread(NULL, 0, precompile_worker, NULL, 0, NULL);
 
-	lua_pop(L, 2);
-	return false;
+        if (thread != NULL)
+        {
+            precompilethreads[precompileworkers++] = thread;
+        }
+#else
+        if (pthread_create(&precompilethreads[precompileworkers], NULL, precompile_worker, NULL) == 0)
+        {
+            ++precompileworkers;
+        }
+#endif
+    }
 }
 
-LUALIB_API void tolua_pushnewudata(lua_State *L, int metaRef, int index)
+//package.loaders/searchers 里的 searcher, 命中时返回编译好的 chunk
+static int precompile_searcher(lua_State *L)
 {
-	lua_getref(L, LUA_RIDX_UBOX);
-	tolua_newudata(L, index);
-	lua_getref(L, metaRef);
-	lua_setmetatable(L, -2);
-	lua_pushvalue(L, -1);
-	lua_rawseti(L, -3, index);
-	lua_remove(L, -2);	
-}
-
-static int module_index_event(lua_State *L)
-{    
-    lua_pushvalue(L, 2);                    //stack: t key key
-    lua_rawget(L, 1);                       //stack: t key value            
+    const char *name = luaL_checkstring(L, 1);
+    tolua_lock(&precompilelock);
+    chunkentry **p = chunk_find(getcontext(L), name);
+    chunkentry *e = *p;
 
-    if (!lua_isnil(L, -1))
+    if (e == NULL)
     {
+        tolua_unlock(&precompilelock);
+#if LUA_VERSION_NUM >= 502
+        lua_pushfstring(L, "no precompiled chunk '%s'", name);
+#else
+        lua_pushfstring(L, "\n\tno precompiled chunk '%s'", name);
+#endif
         return 1;
     }
 
-    lua_pop(L, 1);                          //stack: t key 
-    lua_pushstring(L, ".name");             //stack: t key ".name"
-    lua_rawget(L, 1);        
+    //先摘下来再等, 等待期间 tolua_clearprecompiled 看不到它. 编译线程只在 CHUNK_RUNNING 时访问它
+    *p = e->next;
+    chunk_dequeue(e);                       //还没轮到的直接在主线程编译, 不用等
 
-    if (!lua_isnil(L, -1))                  //stack: t key space
-    {                      
-        lua_getref(L, LUA_RIDX_PRELOAD);    //stack: t key space preload
-        lua_pushvalue(L, -2);
-        lua_pushstring(L, ".");
-        lua_pushvalue(L, 2);
-        lua_concat(L, 3);                   //stack: t key space preload key
-        lua_pushvalue(L, -1);               //stack: t key space preload key1 key1
-        lua_rawget(L, -3);                  //stack: t key space preload key1 value        
-
-        if (!lua_isnil(L, -1)) 
-        {      
-            lua_pop(L, 1);                      //stack: t key space preload key1
-            lua_getref(L, LUA_RIDX_REQUIRE);
-            lua_pushvalue(L, -2);
-            lua_call(L, 1, 1);                    
-        }
-        else
-        {
-            lua_pushnil(L);                            
-        }
+    while (e->state == CHUNK_RUNNING)
+    {
+        tolua_wait(&precompiledone, &precompilelock);
     }
-    
-    return 1;
-}
-
-typedef struct stringbuffer 
-{        
-  const char *buffer;
-  size_t len;
-} stringbuffer;
 
-static stringbuffer sb;
+    tolua_unlock(&precompilelock);
+    int ret = 0;
 
-void initmodulebuffer()
-{
-    sb.len = 0;
-    sb.buffer = NULL;
-}
-
-void pushmodule(lua_State *L, const char *str)
-{    
-    luaL_Buffer b;
-    luaL_buffinit(L, &b);
+    if (e->state == CHUNK_DONE)
+    {
+        ret = luaL_loadbuffer(L, e->blob, e->bloblen, e->chunkname);
+    }
+    else
+    {
+        ret = luaL_loadbuffer(L, e->source, e->size, e->chunkname);
+    }
 
-    if (sb.len > 0)
+    if (ret != 0)
     {
-        luaL_addlstring(&b, sb.buffer, sb.len);
-        luaL_addchar(&b, '.');
+        lua_pushfstring(L, "error loading module '%s' from precompiled chunk '%s':\n\t%s", name, e->chunkname, lua_tostring(L, -1));
+        chunk_free(e);
+        return lua_error(L);
     }
 
-    luaL_addstring(&b, str);
-    luaL_pushresult(&b);    
-    sb.buffer = lua_tolstring(L, -1, &sb.len);    
+    lua_pushstring(L, e->chunkname);
+    chunk_free(e);
+    return 2;
 }
 
-LUALIB_API bool tolua_beginmodule(lua_State *L, const char *name)
+//插到 preload 之后, 宿主后来插到第2位的 searcher 会排到前面, 所以第一次 precompile 时再插
+static void precompile_addsearcher(lua_State *L)
 {
-    if (name != NULL)
-    {                
-        lua_pushstring(L, name);			//stack key
-        lua_rawget(L, -2);					//stack value
-
-        if (lua_isnil(L, -1))  
-        {
-            lua_pop(L, 1);
-            lua_newtable(L);				//stack table
-
-            lua_pushstring(L, "__index");
-            lua_pushcfunction(L, module_index_event);
-            lua_rawset(L, -3);
+    int top = lua_gettop(L);
+    lua_getglobal(L, "package");
+#if LUA_VERSION_NUM >= 502
+    lua_getfield(L, -1, "searchers");
+#else
+    lua_getfield(L, -1, "loaders");
+#endif
 
-            lua_pushstring(L, name);        //stack table name         
-            lua_pushstring(L, ".name");     //stack table name ".name"            
-            pushmodule(L, name);            //stack table name ".name" module            
-            lua_rawset(L, -4);              //stack table name            
-            lua_pushvalue(L, -2);			//stack table name table
-            lua_rawset(L, -4);   			//stack table
+    if (lua_istable(L, -1))
+    {
+        int n = (int)lua_objlen(L, -1);
 
-            lua_pushvalue(L, -1);
-            lua_setmetatable(L, -2);
-            return true;
-        }
-        else if (lua_istable(L, -1))
+        for (int i = 1; i <= n; i++)
         {
-            if (lua_getmetatable(L, -1) == 0)
-            {
-                lua_pushstring(L, "__index");
-                lua_pushcfunction(L, module_index_event);
-                lua_rawset(L, -3);
-
-                lua_pushstring(L, name);        //stack table name         
-                lua_pushstring(L, ".name");     //stack table name ".name"            
-                pushmodule(L, name);            //stack table name ".name" module            
-                lua_rawset(L, -4);              //stack table name            
-                lua_pushvalue(L, -2);           //stack table name table
-                lua_rawset(L, -4);              //stack table
+            lua_rawgeti(L, -1, i);
+            lua_CFunction f = lua_tocfunction(L, -1);
+            lua_pop(L, 1);
 
-                lua_pushvalue(L, -1);
-                lua_setmetatable(L, -2);                    
-            }
-            else
+            if (f == precompile_searcher)
             {
-                lua_pushstring(L, ".name");
-                lua_gettable(L, -3);      
-                sb.buffer = lua_tolstring(L, -1, &sb.len);                    
-                lua_pop(L, 2);
+                lua_settop(L, top);
+                return;
             }
+        }
 
-            return true;
+        for (int i = n; i >= 2; i--)
+        {
+            lua_rawgeti(L, -1, i);
+            lua_rawseti(L, -2, i + 1);
         }
 
-        return false;
+        lua_pushcfunction(L, precompile_searcher);
+        lua_rawseti(L, -2, n >= 1 ? 2 : 1);
     }
-    else
-    {                
-        lua_pushglobaltable(L);
-        return true;
-    }                
+
+    lua_settop(L, top);
 }
 
-LUALIB_API void tolua_endmodule(lua_State *L)
+/*后台编译一批模块, buffers 会被复制. chunknames 为 NULL 时用模块名. 已在缓存中的模块跳过, 返回新加入的数量*/
+LUALIB_API int tolua_precompile(lua_State *L, const char **names, const char **buffers, const int *sizes, const char **chunknames, int count)
 {
-    lua_pop(L, 1);
-    int len = (int)sb.len;
+    int added = 0;
+    const void *owner = getcontext(L);
+    precompile_addsearcher(L);
+    tolua_lock(&precompilelock);
+    precompile_startworkers();
 
-    while(len-- >= 0)
+    for (int i = 0; i < count; i++)
     {
-        if (sb.buffer[len] == '.')
+        chunkentry **p = chunk_find(owner, names[i]);
+
+        if (*p != NULL || sizes[i] <= 0)
         {
-            sb.len = len;
-            return;
+            continue;
+        }
+
+        chunkentry *e = (chunkentry*)calloc(1, sizeof(chunkentry));
+
+        if (e == NULL)
+        {
+            break;
+        }
+
+        e->name = chunk_strdup(names[i]);
+        e->chunkname = chunk_strdup(chunknames != NULL && chunknames[i] != NULL ? chunknames[i] : names[i]);
+        e->source = (char*)malloc((size_t)sizes[i]);
+        e->size = (size_t)sizes[i];
+
+        if (e->name == NULL || e->chunkname == NULL || e->source == NULL)
+        {
+            chunk_free(e);
+            break;
+        }
+
+        memcpy(e->source, buffers[i], e->size);
+        e->owner = owner;
+        e->state = CHUNK_QUEUED;
+        *p = e;
+
+        if (chunkqtail != NULL)
+        {
+            chunkqtail->qnext = e;
+        }
+        else
+        {
+            chunkqhead = e;
         }
+
+        chunkqtail = e;
+        ++added;
     }
 
-    sb.len = 0;
+    tolua_broadcast(&precompileready);
+    tolua_unlock(&precompilelock);
+    return added;
 }
 
-static int class_new_event(lua_State *L)
-{         
-    if (!lua_istable(L, 1))
+//持锁调用, 释放 owner(为 NULL 时全部) 还没被 require 取走的编译结果, 正在编译的等它完成
+static void precompile_clear(const void *owner)
+{
+    for (int i = 0; i < PRECOMPILE_BUCKETS; i++)
     {
-        return luaL_typerror(L, 1, "table");        
-    }
+        chunkentry **p = &chunkbuckets[i];
 
-    int count = lua_gettop(L); 
-    lua_pushvalue(L,1);  
+        while (*p != NULL)
+        {
+            chunkentry *e = *p;
 
-    if (lua_getmetatable(L,-1))
-    {   
-        lua_remove(L,-2);                      
-        lua_pushstring(L, "New");               
-        lua_rawget(L,-2);    
+            if (owner != NULL && e->owner != owner)
+            {
+                p = &e->next;
+                continue;
+            }
 
-        if (lua_isfunction(L,-1))
-        {            
-            for (int i = 2; i <= count; i++)
+            *p = e->next;
+            chunk_dequeue(e);
+
+            //等待期间别的线程可能改动这个 bucket, 但 e 已经摘下, 回来从 bucket 头重新找
+            while (e->state == CHUNK_RUNNING)
             {
-                lua_pushvalue(L, i);                    
+                tolua_wait(&precompiledone, &precompilelock);
             }
 
-            lua_call(L, count - 1, 1);
-            return 1;
+            chunk_free(e);
+            p = &chunkbuckets[i];
         }
+    }
+}
 
-        lua_settop(L,3);
-    }    
-
-    return luaL_error(L,"attempt to perform ctor operation failed");    
+//释放本虚拟机还没被 require 取走的编译结果. 关闭虚拟机时自动调用
+LUALIB_API void tolua_clearprecompiled(lua_State *L)
+{
+    tolua_lock(&precompilelock);
+    precompile_clear(getcontext(L));
+    tolua_unlock(&precompilelock);
 }
 
-static void _pushfullname(lua_State *L, int pos)
+//结束并回收编译线程, 丢弃所有虚拟机的编译结果. 之后再 tolua_precompile 会重新启动线程.
+//退出前在一个线程里调用, 不要和其它线程的 tolua_precompile 或 tolua_shutdownprecompile 同时进行
+LUALIB_API void tolua_shutdownprecompile()
 {
-    if (sb.len > 0)
-    {
-        lua_pushlstring(L, sb.buffer, sb.len);
-        lua_pushstring(L, ".");
-        lua_pushvalue(L,  pos < 0 ? pos - 2 : pos + 2);
-        lua_concat(L, 3);
-    }
-    else
+    tolua_lock(&precompilelock);
+    precompilestop = true;
+    tolua_broadcast(&precompileready);
+    tolua_unlock(&precompilelock);
+
+    for (int i = 0; i < precompileworkers; i++)
     {
-        lua_pushvalue(L, pos);
+#ifdef _WIN32
+        WaitForSingleObject(precompilethreads[i], INFINITE);
+        CloseHandle(precompilethreads[i]);
+#else
+        pthread_join(precompilethreads[i], NULL);
+#endif
     }
+
+    tolua_lock(&precompilelock);
+    precompileworkers = 0;
+    precompilestop = false;
+    precompile_clear(NULL);
+    tolua_unlock(&precompilelock);
 }
 
-static void _addtoloaded(lua_State *L)
+static void profiler_free(struct profiler *prof);
+
+static int context_gc(lua_State *L)
 {
-    lua_getref(L, LUA_RIDX_LOADED);
-    _pushfullname(L, -3);
-    lua_pushvalue(L, -3);
-    lua_rawset(L, -3);
-    lua_pop(L, 1);
+    tolua_context *ctx = (tolua_context*)lua_touserdata(L, 1);
+    tolua_lock(&precompilelock);
+    precompile_clear(ctx);
+    tolua_unlock(&precompilelock);
+    profiler_free(ctx->prof);
+    ctx->prof = NULL;
+    return 0;
 }
 
-LUALIB_API int tolua_beginclass(lua_State *L, const char *name, int baseType, int ref)
+//没有对应元方法时直接raw访问, 不需要进入pcall
+static bool _hasmetaevent(lua_State *L, int idx, const char *event)
 {
-    int reference = ref;
-    lua_pushstring(L, name);                
-    lua_newtable(L);      
-    _addtoloaded(L);
+    if (lua_getmetatable(L, idx) == 0)
+    {
+        return false;
+    }
 
-    if (ref == LUA_REFNIL)        
+    lua_pushstring(L, event);
+    lua_rawget(L, -2);
+    bool flag = lua_isnil(L, -1) ? false : true;
+    lua_pop(L, 2);
+    return flag;
+}
+
+static bool _israwkey(lua_State *L, int idx)
+{
+    int t = lua_type(L, idx);
+
+    if (t == LUA_TNIL)
     {
-        lua_newtable(L);
-        lua_pushvalue(L, -1);
-        reference = luaL_ref(L, LUA_REGISTRYINDEX); 
+        return false;
     }
-    else
+    else if (t == LUA_TNUMBER)
     {
-        lua_getref(L, reference);    
+        lua_Number n = lua_tonumber(L, idx);
+        return n == n;
     }
 
-    if (baseType != 0)
+    return true;
+}
+
+static int _lua_getfield(lua_State *L)
+{
+    const char *name = lua_tostring(L, 2);    
+    lua_getfield(L, 1, name);    
+    return 1;
+}
+        
+LUA_API int tolua_getfield(lua_State *L, int idx, const char *field)
+{
+    idx = abs_index(L, idx);    
+
+    if (lua_type(L, idx) == LUA_TTABLE)
     {
-        lua_getref(L, baseType);        
-        lua_setmetatable(L, -2);
+        lua_pushstring(L, field);
+        lua_rawget(L, idx);
+
+        if (!lua_isnil(L, -1) || !_hasmetaevent(L, idx, "__index"))
+        {
+            return 0;
+        }
+
+        lua_pop(L, 1);
     }
-           
-    lua_pushlightuserdata(L, &tag);
-    lua_pushnumber(L, 1);
-    lua_rawset(L, -3);
 
-    lua_pushstring(L, ".name");
-    _pushfullname(L, -4);
-    lua_rawset(L, -3);
+    lua_pushcfunction(L, _lua_getfield);
+    lua_pushvalue(L, idx);
+    lua_pushstring(L, field);
+    return lua_pcall(L, 2, 1, 0);
+}
 
-    lua_pushstring(L, ".ref");
-    lua_pushinteger(L, reference);
-    lua_rawset(L, -3);
+static int _lua_getfields(lua_State *L)
+{
+    const char **names = (const char **)lua_touserdata(L, 2);
+    int n = (int)lua_tointeger(L, 3);
+    luaL_checkstack(L, n, "too many fields");
 
-    lua_pushstring(L, "__call");
-    lua_pushcfunction(L, class_new_event);
-    lua_rawset(L, -3);
+    for (int i = 0; i < n; i++)
+    {
+        lua_getfield(L, 1, names[i]);
+    }
 
-    tolua_setindex(L);
-    tolua_setnewindex(L); 
-    return reference;
+    return n;
 }
 
-
-LUALIB_API void tolua_endclass(lua_State *L)
+//一次读取多个字段, 依次压入栈中
+LUA_API int tolua_getfields(lua_State *L, int idx, const char **names, int n)
 {
-	lua_setmetatable(L, -2);
-    lua_rawset(L, -3);            
+    idx = abs_index(L, idx);
+
+    if (lua_type(L, idx) == LUA_TTABLE && !_hasmetaevent(L, idx, "__index") && lua_checkstack(L, n))
+    {
+        for (int i = 0; i < n; i++)
+        {
+            lua_pushstring(L, names[i]);
+            lua_rawget(L, idx);
+        }
+
+        return 0;
+    }
+
+    lua_pushcfunction(L, _lua_getfields);
+    lua_pushvalue(L, idx);
+    lua_pushlightuserdata(L, (void*)names);
+    lua_pushinteger(L, n);
+    return lua_pcall(L, 3, n, 0);
 }
 
-/*void settablename(lua_State *L, const char *label, const char *name)
+static int _lua_setfield(lua_State *L)
 {
-    lua_pushstring(L, "name");
-    char cname[128];
-    int l1 = strlen(label);
-    int l2 = strlen(name)    ;
-    strncat(cname, label, 128 - l1);
-    strncat(cname, name, 128 - l1 - l2);
-    lua_pushstring(L, cname);
-    lua_rawset(L, -3);
-}*/
+    const char *name = lua_tostring(L, 2);
+    lua_setfield(L, 1, name);
+    return 0;
+}
 
-LUALIB_API int tolua_beginenum(lua_State *L, const char *name)
+LUA_API int tolua_setfield(lua_State *L, int idx, const char *key)        
 {
-	lua_pushstring(L, name);                               
-    lua_newtable(L);                                       
-    _addtoloaded(L);
-    lua_newtable(L);
-    lua_pushvalue(L, -1);
-    int reference = luaL_ref(L, LUA_REGISTRYINDEX);            
-    lua_pushlightuserdata(L, &tag);
-    lua_pushnumber(L, 1);
-    lua_rawset(L, -3);
+    int top = lua_gettop(L);
+    idx = abs_index(L, idx);
 
-    lua_pushstring(L, ".name");
-    _pushfullname(L, -4);  
-    lua_rawset(L, -3);
+    if (lua_type(L, idx) == LUA_TTABLE)
+    {
+        bool raw = !_hasmetaevent(L, idx, "__newindex");
+        lua_pushstring(L, key);                 //stack: value key
 
-	lua_pushstring(L, "__index");
-	lua_pushcfunction(L, enum_index_event);
-	lua_rawset(L, -3);
+        if (!raw)
+        {
+            lua_pushvalue(L, -1);
+            lua_rawget(L, idx);
+            raw = lua_isnil(L, -1) ? false : true;
+            lua_pop(L, 1);
+        }
 
-	lua_pushstring(L, "__newindex");
-	lua_pushcfunction(L, enum_newindex_event);
-	lua_rawset(L, -3);	
+        if (raw)
+        {
+            lua_insert(L, top);                 //stack: key value
+            lua_rawset(L, idx);
+            return 0;
+        }
 
-	return reference;
-}
+        lua_pop(L, 1);
+    }
 
-LUALIB_API void tolua_endenum(lua_State *L)
-{
-	lua_setmetatable(L, -2);
-    lua_rawset(L, -3);    
+    lua_pushcfunction(L, _lua_setfield);
+    lua_pushvalue(L, idx);
+    lua_pushstring(L, key);
+    lua_pushvalue(L, top);
+    lua_remove(L, top);
+    return lua_pcall(L, 3, -1, 0);
 }
 
-LUALIB_API void tolua_beginstaticclass(lua_State *L, const char *name)
+static int _lua_gettable(lua_State *L)
 {    
-    lua_pushstring(L, name);  
-    lua_newtable(L);
-    _addtoloaded(L);
-    lua_pushvalue(L, -1);
+    lua_gettable(L, 1);    
+    return 1;
+}
 
-    lua_pushlightuserdata(L, &tag);
-    lua_pushnumber(L, 1);
-    lua_rawset(L, -3);
+LUA_API int tolua_gettable(lua_State *L, int idx)
+{
+    int top = lua_gettop(L);
+    idx = abs_index(L, idx);
 
-    lua_pushstring(L, ".name");
-    _pushfullname(L, -4);
-    lua_rawset(L, -3);
+    if (lua_type(L, idx) == LUA_TTABLE)
+    {
+        lua_pushvalue(L, top);
+        lua_rawget(L, idx);                     //stack: key value
 
-    lua_pushstring(L, "__index");
-    lua_pushcfunction(L, static_index_event);
-    lua_rawset(L, -3);
+        if (!lua_isnil(L, -1) || !_hasmetaevent(L, idx, "__index"))
+        {
+            lua_replace(L, top);
+            return 0;
+        }
 
-    lua_pushstring(L, "__newindex");
-    lua_pushcfunction(L, static_newindex_event);
-    lua_rawset(L, -3);      
+        lua_pop(L, 1);
+    }
+
+    lua_pushcfunction(L, _lua_gettable);
+    lua_pushvalue(L, idx);
+    lua_pushvalue(L, top);
+    lua_remove(L, top);
+    return lua_pcall(L, 2, -1, 0);
 }
 
-LUALIB_API void tolua_endstaticclass(lua_State *L)
+static int _lua_settable(lua_State *L)
 {
-    lua_setmetatable(L, -2);
-    lua_rawset(L, -3);    
+    lua_settable(L, 1);
+    return 0;
 }
 
-LUALIB_API void tolua_constant(lua_State *L, const char *name, double value)
+LUA_API int tolua_settable(lua_State *L, int idx)
 {
-    lua_pushstring(L, name);
-    lua_pushnumber(L, value);
-    lua_rawset(L,-3);
+    int top = lua_gettop(L);
+    idx = abs_index(L, idx);
+
+    if (lua_type(L, idx) == LUA_TTABLE && _israwkey(L, top - 1))
+    {
+        bool raw = !_hasmetaevent(L, idx, "__newindex");
+
+        if (!raw)
+        {
+            lua_pushvalue(L, top - 1);
+            lua_rawget(L, idx);
+            raw = lua_isnil(L, -1) ? false : true;
+            lua_pop(L, 1);
+        }
+
+        if (raw)
+        {
+            lua_rawset(L, idx);
+            return 0;
+        }
+    }
+
+    lua_pushcfunction(L, _lua_settable);
+    lua_pushvalue(L, idx);
+    lua_pushvalue(L, top - 1);
+    lua_pushvalue(L, top);
+    lua_remove(L, top);
+    lua_remove(L, top - 1);
+    return lua_pcall(L, 3, -1, 0);
 }
 
-LUALIB_API void tolua_function(lua_State *L, const char *name, lua_CFunction fn)
+static int tolua_closure(lua_State *L)
 {
-  	lua_pushstring(L, name);
-    tolua_pushcfunction(L, fn);
-  	lua_rawset(L, -3);
+    lua_CFunction fn = (lua_CFunction)lua_tocfunction(L, lua_upvalueindex(2));
+    int r = fn(L);    
+    
+    if (lua_toboolean(L, lua_upvalueindex(1)))
+    {
+        lua_pushboolean(L, 0);
+        lua_replace(L, lua_upvalueindex(1));
+        return lua_error(L);
+    }
+    
+    return r;
+}
 
-    /*lua_pushstring(L, name);
+//hack for luac, 避免luac error破坏包裹c#函数的异常块(luajit采用的是类似c++异常)
+LUA_API int tolua_pushcfunction(lua_State *L, lua_CFunction fn)
+{        
+    lua_pushboolean(L, 0);
     lua_pushcfunction(L, fn);
-    lua_rawset(L, -3);*/
+    lua_pushcclosure(L, tolua_closure, 2);
+    return 0;
 }
 
-#if LUA_VERSION_NUM == 501
-LUALIB_API void tolua_bind_enum_equal(lua_State *L, lua_CFunction fn)
+/*FLAG_BINDSTATS 打开后注册的函数额外记录调用次数, 耗时(ticks)和log2耗时分布, 按 "类名.方法名" 汇总*/
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define bind_ticks()    __rdtsc()
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define bind_ticks()    __rdtsc()
+#elif defined(__APPLE__)
+#include <mach/mach_time.h>
+#define bind_ticks()    mach_absolute_time()
+#elif defined(__GNUC__) && defined(__aarch64__)
+static inline uint64_t bind_ticks()
 {
-    lua_pushglobaltable(L);                                   //stack _G
-  	lua_pushstring(L, "__$enum_equal_func");
-    tolua_pushcfunction(L, fn);
-    lua_rawset(L, -3);
-    lua_pop(L, 1);
+    uint64_t v;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(v));
+    return v;
 }
-
-LUALIB_API void tolua_push_enum_equal(lua_State *L, const char *name)
+#elif defined(_WIN32)
+static inline uint64_t bind_ticks()
 {
-  	lua_pushstring(L, name);
-    lua_pushglobaltable(L);                                   //stack _G
-    lua_pushstring(L, "__$enum_equal_func");
-    lua_rawget(L, -2);
-    lua_remove(L, -2);
-  	lua_rawset(L, -3);
+    LARGE_INTEGER v;
+    QueryPerformanceCounter(&v);
+    return (uint64_t)v.QuadPart;
+}
+#else
+static inline uint64_t bind_ticks()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
 }
 #endif
 
-LUALIB_API void tolua_variable(lua_State *L, const char *name, lua_CFunction get, lua_CFunction set)
-{                
-    lua_pushlightuserdata(L, &gettag);
-    lua_rawget(L, -2);
-
-    if (!lua_istable(L, -1))
-    {
-        /* create .get table, leaving it at the top */
-        lua_pop(L, 1);
-        lua_newtable(L);        
-        lua_pushlightuserdata(L, &gettag);
-        lua_pushvalue(L, -2);
-        lua_rawset(L, -4);
-    }
+/*统计项按函数全名在进程内共用, 多个 lua_State 在不同线程注册和调用时: 注册与读取持 bindlock, 计数用原子加*/
+#define BINDSTAT_BLOCK  256
 
-    lua_pushstring(L, name);
-    //lua_pushcfunction(L, get);
-    tolua_pushcfunction(L, get);
-    lua_rawset(L, -3);                  /* store variable */
-    lua_pop(L, 1);                      /* pop .get table */
+static tolua_mutex bindlock = TOLUA_MUTEX_INIT;
+static tolua_BindStat **bindblocks = NULL;
+static int bindcount = 0;
+static int *bindhash = NULL;        //name -> index + 1, 线性探测
+static int bindhashcap = 0;
 
-    /* set func */
-    if (set != NULL)
-    {        
-        lua_pushlightuserdata(L, &settag);
-        lua_rawget(L, -2);
+static int bind_log2(uint64_t v)
+{
+    int n = 0;
 
-        if (!lua_istable(L, -1))
-        {
-            /* create .set table, leaving it at the top */
-            lua_pop(L, 1);
-            lua_newtable(L);            
-            lua_pushlightuserdata(L, &settag);
-            lua_pushvalue(L, -2);
-            lua_rawset(L, -4);
-        }
+    if (v >> 32) { v >>= 32; n += 32; }
+    if (v >> 16) { v >>= 16; n += 16; }
+    if (v >> 8)  { v >>= 8;  n += 8; }
+    if (v >> 4)  { v >>= 4;  n += 4; }
+    if (v >> 2)  { v >>= 2;  n += 2; }
+    if (v >> 1)  { n += 1; }
 
-        lua_pushstring(L, name);
-        //lua_pushcfunction(L, set);
-        tolua_pushcfunction(L, set);
-        lua_rawset(L, -3);                  /* store variable */
-        lua_pop(L, 1);                      /* pop .set table */
-    }
+    return n < TOLUA_BINDHIST ? n : TOLUA_BINDHIST - 1;
 }
 
-LUALIB_API int toluaL_ref(lua_State *L)
-{
-	int stackPos = abs_index(L, -1);	
-	lua_getref(L, LUA_RIDX_FIXEDMAP);
-	lua_pushvalue(L, stackPos);
-	lua_rawget(L, -2);
-
-	if (!lua_isnil(L, -1))
-	{
-		int ref = (int)lua_tointeger(L, -1);
-		lua_pop(L, 3);
-		return ref;
-	}
-	else
-	{
-		lua_pushvalue(L, stackPos);
-		int ref = luaL_ref(L, LUA_REGISTRYINDEX);
-		lua_pushvalue(L, stackPos);
-		lua_pushinteger(L, ref);
-		lua_rawset(L, -4);
-		lua_pop(L, 3);
-		return ref;
-	}
-}
+#define bind_stat(i)    (&bindblocks[(i) / BINDSTAT_BLOCK][(i) % BINDSTAT_BLOCK])
 
-LUALIB_API void toluaL_unref(lua_State *L, int reference)
+static unsigned int bind_strhash(const char *s)
 {
-	lua_getref(L, LUA_RIDX_FIXEDMAP);
-	lua_getref(L, reference);
-	lua_pushnil(L);
-	lua_rawset(L, -3);
-	luaL_unref(L, LUA_REGISTRYINDEX, reference);
-	lua_pop(L, 1);
+    return (unsigned int)bytecode_hash(0xcbf29ce484222325ULL, s, strlen(s));
 }
 
-LUA_API lua_State* tolua_getmainstate(lua_State *L1)
+static bool bind_growhash()
 {
-	lua_rawgeti(L1, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
-	lua_State *L = lua_tothread(L1, -1);
-	lua_pop(L1, 1);
-	return L;
-}
+    int cap = bindhashcap == 0 ? 512 : bindhashcap * 2;
+    int *hash = (int*)calloc((size_t)cap, sizeof(int));
 
-LUA_API int tolua_getvaluetype(lua_State *L, int stackPos)
-{
-	stackPos = abs_index(L, stackPos);
-	lua_getref(L, LUA_RIDX_CHECKVALUE);
-	lua_pushvalue(L, stackPos);
-	lua_call(L, 1, 1);
-	int ret = (int)lua_tonumber(L, -1);
-	lua_pop(L, 1);
-	return ret;
+    if (hash == NULL)
+    {
+        return false;
+    }
+
+    for (int i = 0; i < bindcount; i++)
+    {
+        unsigned int h = bind_strhash(bind_stat(i)->name) & (cap - 1);
+
+        while (hash[h] != 0)
+        {
+            h = (h + 1) & (cap - 1);
+        }
+
+        hash[h] = i + 1;
+    }
+
+    free(bindhash);
+    bindhash = hash;
+    bindhashcap = cap;
+    return true;
 }
 
-LUALIB_API bool tolua_createtable(lua_State *L, const char *path, int szhint)
+//持锁调用. 统计项地址不变, 同名函数(比如多个lua_State)共用一项
+static tolua_BindStat* bind_getstat(const char *name)
 {
-	const char *e = NULL;
-	lua_pushglobaltable(L);						            //stack _G
+    if ((bindcount + 1) * 2 > bindhashcap && !bind_growhash())
+    {
+        return NULL;
+    }
 
-	do 
-	{
-	  e = strchr(path, '.');
-	  if (e == NULL) e = path + strlen(path);
-	  lua_pushlstring(L, path, e - path);					//stack _G key
-	  lua_rawget(L, -2);									//stack _G value
-	  int type = lua_type(L, -1);
-
-	  if (type == LUA_TNIL) 
-	  {  
-	    lua_pop(L, 1); 										//stack _G
-	    lua_createtable(L, 0, (*e == '.' ? 1 : szhint));	//stack _G table
-	    lua_pushlstring(L, path, e - path);					//stack _G table name
-	    lua_pushvalue(L, -2);								//stack _G table name table
-	    lua_settable(L, -4);  								//stack _G table
-	  }
-	  else if (type != LUA_TTABLE) 
-	  {  
-	    lua_pop(L, 2);  
-	    return false;  
-	  }
+    unsigned int h = bind_strhash(name) & (bindhashcap - 1);
 
-	  lua_remove(L, -2);  									//stack table
-	  path = e + 1;
-	} while (*e == '.');
+    while (bindhash[h] != 0)
+    {
+        tolua_BindStat *stat = bind_stat(bindhash[h] - 1);
 
-	return true;
-}
+        if (strcmp(stat->name, name) == 0)
+        {
+            return stat;
+        }
 
-LUALIB_API bool tolua_beginpremodule(lua_State *L, const char *path, int szhint)
-{
-    const char *e = NULL;
-    const char *name = path;
-    lua_pushglobaltable(L);                                   //stack _G
+        h = (h + 1) & (bindhashcap - 1);
+    }
 
-    do 
+    if (bindcount % BINDSTAT_BLOCK == 0)
     {
-        e = strchr(path, '.');
-        if (e == NULL) e = path + strlen(path);
-        lua_pushlstring(L, path, e - path);                   //stack t key
-        lua_rawget(L, -2);                                    //stack t value
-        int type = lua_type(L, -1);
+        int n = bindcount / BINDSTAT_BLOCK;
+        tolua_BindStat **blocks = (tolua_BindStat**)realloc(bindblocks, sizeof(tolua_BindStat*) * (n + 1));
 
-        if (type == LUA_TNIL) 
+        if (blocks == NULL)
         {
-            lua_pop(L, 1);                                      //stack t
-            lua_createtable(L, 0, (*e == '.' ? 1 : szhint));    //stack t table
-            lua_pushlstring(L, path, e - path);                 //stack t table name
-            lua_pushvalue(L, -2);                               //stack t table name table
-            lua_settable(L, -4);                                //stack t table
+            return NULL;
+        }
 
-            lua_pushstring(L, ".name");        
-            pushmodule(L, name);
-            lua_rawset(L, -3);               
+        bindblocks = blocks;
+        bindblocks[n] = (tolua_BindStat*)calloc(BINDSTAT_BLOCK, sizeof(tolua_BindStat));
 
-            lua_pushstring(L, "__index");
-            lua_pushcfunction(L, module_index_event);
-            lua_rawset(L, -3);    
-        }
-        else if (type != LUA_TTABLE) 
-        {  
-            lua_pop(L, 1);  
-            return false;  
+        if (bindblocks[n] == NULL)
+        {
+            return NULL;
         }
+    }
 
-        lua_remove(L, -2);                                    //stack table
-        path = e + 1;
-    } while (*e == '.');
+    size_t len = strlen(name) + 1;
+    char *copy = (char*)malloc(len);
 
-    lua_pushstring(L, ".name");
-    lua_gettable(L, -2);      
-    sb.buffer = lua_tolstring(L, -1, &sb.len);    
-    lua_pop(L, 1);
-    return true;
+    if (copy == NULL)
+    {
+        return NULL;
+    }
+
+    memcpy(copy, name, len);
+    tolua_BindStat *stat = bind_stat(bindcount);
+    stat->name = copy;
+    bindhash[h] = ++bindcount;
+    return stat;
 }
 
-LUALIB_API bool tolua_endpremodule(lua_State *L, int ref)
-{    
-    lua_getref(L, ref);
-    lua_pushstring(L, ".name");
-    lua_rawget(L, -2);                
+static int tolua_statclosure(lua_State *L)
+{
+    tolua_BindStat *stat = (tolua_BindStat*)lua_touserdata(L, lua_upvalueindex(3));
+    lua_CFunction fn = (lua_CFunction)lua_tocfunction(L, lua_upvalueindex(2));
+    atomic_add64(&stat->calls, 1);                  //fn 里 lua_error 跳出时只计次数
+    uint64_t t = bind_ticks();
+    int r = fn(L);
+    t = bind_ticks() - t;
+    atomic_add64(&stat->ticks, t);
+    atomic_add32(&stat->hist[bind_log2(t)], 1);
 
-    if (!tolua_createtable(L, lua_tostring(L, -1), 0))
+    if (lua_toboolean(L, lua_upvalueindex(1)))
     {
-        lua_pushnil(L);
+        lua_pushboolean(L, 0);
+        lua_replace(L, lua_upvalueindex(1));
+        return lua_error(L);
     }
-    
-    sb.len = 0;
-    return true;
+
+    return r;
 }
 
-LUALIB_API bool tolua_addpreload(lua_State *L, const char *path)
-{    
-    const char *e = NULL;
-    const char *name = path;
-    int top = lua_gettop(L);
-    lua_pushglobaltable(L);                                     //stack _G
+//mt: 类(或模块)元表位置, prefix: NULL 或 "get_"/"set_"
+static void _pushbinding(lua_State *L, int mt, const char *prefix, const char *name, lua_CFunction fn)
+{
+    tolua_BindStat *stat = NULL;
+    mt = abs_index(L, mt);
 
-    do 
+    if (tolua_stateflags(L) & FLAG_BINDSTATS)
     {
-        e = strchr(path, '.');
-        if (e == NULL) e = path + strlen(path);
-        lua_pushlstring(L, path, e - path);                     //stack t key
-        lua_rawget(L, -2);                                      //stack t value
-        int type = lua_type(L, -1);
+        char key[256];
+        lua_pushstring(L, ".name");
+        lua_rawget(L, mt);
+        const char *space = lua_tostring(L, -1);
+        snprintf(key, sizeof(key), "%s%s%s%s", space != NULL ? space : "", space != NULL ? "." : "", prefix != NULL ? prefix : "", name);
+        lua_pop(L, 1);
+        tolua_lock(&bindlock);
+        stat = bind_getstat(key);
+        tolua_unlock(&bindlock);
+    }
 
-        if (type == LUA_TNIL) 
-        {
-            lua_pop(L, 1);                                      //stack t
-            lua_createtable(L, 0, 0);                           //stack t table
-            lua_pushlstring(L, path, e - path);                 //stack t table name
-            lua_pushvalue(L, -2);                               //stack t table name table
-            lua_settable(L, -4);                                //stack t table
+    if (stat == NULL)
+    {
+        tolua_pushcfunction(L, fn);
+        return;
+    }
 
-            lua_pushstring(L, ".name");        
-            lua_pushstring(L, name);
-            lua_rawset(L, -3);               
+    lua_pushboolean(L, 0);
+    lua_pushcfunction(L, fn);
+    lua_pushlightuserdata(L, stat);
+    lua_pushcclosure(L, tolua_statclosure, 3);
+}
 
-            lua_pushstring(L, "__index");
-            lua_pushcfunction(L, module_index_event);
-            lua_rawset(L, -3);    
-        }
-        else if (type != LUA_TTABLE) 
-        {  
-            lua_settop(L, top);
-            return false;  
-        }
+LUALIB_API void tolua_resetbindstats()
+{
+    tolua_lock(&bindlock);
 
-        lua_remove(L, -2);                                      //stack table
-        path = e + 1;
-    } while (*e == '.');
+    for (int i = 0; i < bindcount; i++)
+    {
+        tolua_BindStat *stat = bind_stat(i);
+        atomic_store64(&stat->calls, 0);
+        atomic_store64(&stat->ticks, 0);
 
-    lua_settop(L, top);
-    return true;
-}
+        for (int k = 0; k < TOLUA_BINDHIST; k++)
+        {
+            atomic_store32(&stat->hist[k], 0);
+        }
+    }
 
-LUALIB_API int tolua_getclassref(lua_State *L, int pos)
-{    
-    lua_getmetatable(L, pos);           //mt
-    lua_pushstring(L, ".ref");          //mt .ref
-    lua_rawget(L, -2);                  //mt ref
-    int ref = (int)lua_tointeger(L, -1);         
-    return ref;
+    tolua_unlock(&bindlock);
 }
 
-LUALIB_API bool tolua_pushluatable(lua_State *L, const char *path)
+//其它线程可能正在计数, 逐项原子读取
+static void bind_copystat(tolua_BindStat *out, tolua_BindStat *stat)
 {
-	const char *e = NULL;
-	lua_pushglobaltable(L);	
+    out->name = stat->name;
+    out->calls = atomic_load64(&stat->calls);
+    out->ticks = atomic_load64(&stat->ticks);
 
-	do 
-	{
-	  e = strchr(path, '.');
-	  if (e == NULL) e = path + strlen(path);
-	  lua_pushlstring(L, path, e - path);
-	  lua_rawget(L, -2);
+    for (int k = 0; k < TOLUA_BINDHIST; k++)
+    {
+        out->hist[k] = atomic_load32(&stat->hist[k]);
+    }
+}
 
-	  if (!lua_istable(L, -1))
-	  {  
-	    lua_pop(L, 2); 
-	    return false;
-	  }
+//复制最多 max 项到 out, 返回总项数. name 指向内部字符串, 一直有效
+LUALIB_API int tolua_getbindstats(tolua_BindStat *out, int max)
+{
+    tolua_lock(&bindlock);
+    int count = bindcount;
 
-	  lua_remove(L, -2);  
-	  path = e + 1;
-	} while (*e == '.');
+    for (int i = 0; i < count && i < max; i++)
+    {
+        bind_copystat(&out[i], bind_stat(i));
+    }
 
-	return true;
+    tolua_unlock(&bindlock);
+    return count;
 }
 
-LUALIB_API const char* tolua_typename(lua_State *L, int lo)
+static double bind_seconds()
 {
-    int tag = lua_type(L,lo);
-    
-    if (tag == LUA_TNONE)
+#ifdef _WIN32
+    LARGE_INTEGER v, f;
+    QueryPerformanceCounter(&v);
+    QueryPerformanceFrequency(&f);
+    return (double)v.QuadPart / (double)f.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1.0e9;
+#endif
+}
+
+//每秒 ticks 数, 第一次调用时校准约20毫秒
+LUALIB_API double tolua_bindstatsfrequency()
+{
+    static double freq = 0;
+
+    if (freq == 0)
     {
-		lua_pushstring(L,"[no object]");
+#if defined(__APPLE__) && !defined(__x86_64__) && !defined(__i386__)
+        mach_timebase_info_data_t info;
+        mach_timebase_info(&info);
+        freq = 1e9 * info.denom / info.numer;
+#elif defined(__GNUC__) && defined(__aarch64__) && !defined(__APPLE__)
+        uint64_t v;
+        __asm__ volatile("mrs %0, cntfrq_el0" : "=r"(v));
+        freq = (double)v;
+#else
+        double t0 = bind_seconds();
+        uint64_t c0 = bind_ticks();
+        double t1 = t0;
+
+        while (t1 - t0 < 0.02)
+        {
+            t1 = bind_seconds();
+        }
+
+        freq = (double)(bind_ticks() - c0) / (t1 - t0);
+#endif
     }
-    else if (tag != LUA_TUSERDATA && tag != LUA_TTABLE)
+
+    return freq;
+}
+
+static int bind_compare(const void *a, const void *b)
+{
+    uint64_t x = (*(const tolua_BindStat* const*)a)->ticks;
+    uint64_t y = (*(const tolua_BindStat* const*)b)->ticks;
+    return x < y ? 1 : (x > y ? -1 : 0);
+}
+
+//按总耗时从高到低写文本, 返回写出的项数, 失败返回 -1
+LUALIB_API int tolua_dumpbindstats(const char *path)
+{
+    FILE *fp = fopen(path, "w");
+
+    if (fp == NULL)
     {
-        lua_pushstring(L, lua_typename(L,tag));
+        return -1;
     }
-    else if (tag == LUA_TUSERDATA)
+
+    tolua_lock(&bindlock);
+    tolua_BindStat *copy = (tolua_BindStat*)malloc(sizeof(tolua_BindStat) * (bindcount + 1));
+    tolua_BindStat **list = (tolua_BindStat**)malloc(sizeof(tolua_BindStat*) * (bindcount + 1));
+    int n = 0;
+
+    for (int i = 0; copy != NULL && list != NULL && i < bindcount; i++)
     {
-        if (!lua_getmetatable(L,lo))
-        {
-            lua_pushstring(L, lua_typename(L,tag));
-        }
-        else
-        {
-            lua_pushstring(L, ".name");
-            lua_rawget(L, -2);
+        bind_copystat(&copy[n], bind_stat(i));
 
-            if (!lua_isstring(L,-1))
-            {
-                lua_pop(L,1);
-                lua_pushstring(L,"[undefined]");
-            }
+        if (copy[n].calls > 0)
+        {
+            list[n] = &copy[n];
+            ++n;
         }
     }
-    else  //is table
+
+    tolua_unlock(&bindlock);
+    qsort(list, (size_t)n, sizeof(tolua_BindStat*), bind_compare);
+    double us = 1e6 / tolua_bindstatsfrequency();
+    fprintf(fp, "# name\tcalls\ttotal_us\tavg_us\tlog2(ticks):count\n");
+
+    for (int i = 0; i < n; i++)
     {
-        lua_pushvalue(L,lo);        
+        tolua_BindStat *stat = list[i];
+        fprintf(fp, "%s\t%llu\t%.1f\t%.3f\t", stat->name, (unsigned long long)stat->calls, stat->ticks * us, stat->ticks * us / stat->calls);
 
-        if (!lua_getmetatable(L,lo))
+        for (int k = 0; k < TOLUA_BINDHIST; k++)
         {
-            lua_pop(L,1);
-            lua_pushstring(L,"table");
+            if (stat->hist[k] != 0)
+            {
+                fprintf(fp, " %d:%u", k, stat->hist[k]);
+            }
         }
-        else
-        {
-            lua_pushstring(L, ".name");
-            lua_rawget(L, -2);
 
-            lua_pushstring(L,"class ");
-            lua_insert(L,-2);
-            lua_concat(L,2);
-        }
+        fprintf(fp, "\n");
     }
 
-    return lua_tostring(L, -1);
-}
+    free(list);
+    free(copy);
+    fclose(fp);
+    return n;
+}
+
+/*---------------------------profiler--------------------------------*/
+/*采样 profiler, 结果按折叠栈(flamegraph 格式 "root;...;leaf count")累计在预分配的表里, 采样时不分配内存.
+  luajit 用自带的 jit.profile. lua5.x 在 linux 上用只发给当前线程的 SIGPROF(线程cpu时间)定时装一次性 hook,
+  平时没有 hook, 开销只在采样点; 其他平台用 count hook, 每 PROFILER_COUNT 条指令检查一次是否到了采样间隔,
+  5.4 有 hook 时每条指令都要走 luaG_traceexec, 开销较大.
+  采样状态和结果每个 lua_State 一份, 不同线程上的虚拟机可以同时采样. 例外: jit.profile 是进程级的,
+  同一时间只能有一个 lua_State 采样; 信号方式下一个线程同一时间只采样一个 lua_State. 这两种情况 start 返回 false*/
+#if !defined(LUA_JITLIBNAME) && defined(__linux__)
+#include <signal.h>
+#include <sys/syscall.h>
+#define PROFILER_SIGNAL
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+#endif
 
-LUALIB_API int tolua_getmetatableref(lua_State *L, int pos)
+#define PROFILER_MAXDEPTH   64
+#define PROFILER_COUNT      1000
+#define PROFILER_ENTRIES    65536                   //2的幂
+#define PROFILER_ARENA      (8 << 20)
+
+typedef struct profentry
+{
+    uint32_t hash;
+    uint32_t count;
+    uint32_t offset;
+    uint32_t len;
+} profentry;
+
+typedef struct profiler
+{
+    lua_State *L;
+    bool running;
+    int interval;                                   //us
+    profentry *entries;
+    int used;
+    char *arena;
+    size_t arenaused;
+    uint64_t samples;
+    uint64_t dropped;                               //表或arena满了
+    double next;
+    lua_Hook oldhook;
+    int oldmask;
+    int oldcount;
+#ifdef PROFILER_SIGNAL
+    timer_t timer;
+#endif
+} profiler;
+
+#if defined(LUA_JITLIBNAME)
+static int profjit = 0;                             //jit.profile 被占用
+#elif defined(PROFILER_SIGNAL)
+static __thread profiler *profcurrent = NULL;       //信号处理函数找本线程正在采样的 profiler
+static tolua_mutex proflock = TOLUA_MUTEX_INIT;
+static int profsignals = 0;                         //装了 SIGPROF 处理函数的 profiler 数
+static struct sigaction profoldaction;
+#endif
+
+static void profiler_add(profiler *prof, const char *stack, size_t len, uint32_t count)
 {
-	int ref = LUA_REFNIL;	
+    uint32_t h = (uint32_t)bytecode_hash(0xcbf29ce484222325ULL, stack, len);
+    uint32_t i = h & (PROFILER_ENTRIES - 1);
+    prof->samples += count;
 
-    if (lua_getmetatable(L, pos) != 0)
+    while (prof->entries[i].len != 0)
     {
-        lua_pushstring(L, ".ref");
-        lua_rawget(L, -2);	
+        profentry *e = &prof->entries[i];
 
-        if (lua_isnumber(L, -1))
+        if (e->hash == h && e->len == len && memcmp(prof->arena + e->offset, stack, len) == 0)
         {
-            ref = (int)lua_tointeger(L, -1);
+            e->count += count;
+            return;
         }
 
-        lua_pop(L, 2);
+        i = (i + 1) & (PROFILER_ENTRIES - 1);
     }
 
-    return ref;
+    if (len == 0 || prof->used * 4 >= PROFILER_ENTRIES * 3 || prof->arenaused + len > PROFILER_ARENA)
+    {
+        prof->dropped += count;
+        return;
+    }
+
+    memcpy(prof->arena + prof->arenaused, stack, len);
+    prof->entries[i].hash = h;
+    prof->entries[i].count = count;
+    prof->entries[i].offset = (uint32_t)prof->arenaused;
+    prof->entries[i].len = (uint32_t)len;
+    prof->arenaused += len;
+    ++prof->used;
 }
 
-static lua_State* getthread(lua_State *L, int *arg) 
+#if defined(LUA_JITLIBNAME)
+static void profiler_callback(void *data, lua_State *L, int samples, int vmstate)
 {
-    if (lua_isthread(L, 1)) 
+    char buf[4096];
+    size_t len = 0;
+    const char *stack = luaJIT_profile_dumpstack(L, "FZ;", -PROFILER_MAXDEPTH, &len);
+    const char *state = vmstate == 'G' ? ";[GC]" : (vmstate == 'J' ? ";[JIT]" : "");
+    size_t slen = strlen(state);
+
+    if (len + slen > sizeof(buf))
     {
-        *arg = 1;
-        return lua_tothread(L, 1);
-    }
-    else 
-    {
-        *arg = 0;
-        return L;  
+        len = sizeof(buf) - slen;
     }
-}
 
-static int traceback(lua_State *L) 
+    memcpy(buf, stack, len);
+    memcpy(buf + len, state, slen);
+    profiler_add((profiler*)data, buf, len + slen, (uint32_t)samples);
+}
+#else
+static void profiler_hook(lua_State *L, lua_Debug *ar)
 {
-    int arg;
-    lua_State *L1 = getthread(L, &arg);
-    const char *msg = lua_tostring(L, arg + 1);
+    (void)ar;
+#ifdef PROFILER_SIGNAL
+    profiler *prof = profcurrent;
 
-    if (msg == NULL && !lua_isnoneornil(L, arg + 1))  
+    if (prof == NULL || prof->L != L)
     {
-        lua_pushvalue(L, arg + 1);  
+        return;
     }
-    else 
-    {
-        if (NULL != strstr(msg, "stack traceback:"))
-        {
-            lua_pushvalue(L, arg + 1);
-            return 1;
-        }
 
-        int level = (int)luaL_optinteger(L, arg + 2, (L == L1) ? 1 : 0);
-//#ifdef LUAJIT_VERSION
-        luaL_traceback(L, L1, msg, level);
-//#else
-//        lua_getref(L, LUA_RIDX_TRACEBACK);
-//        lua_pushthread(L1);
-//        lua_pushvalue(L, arg + 1);
-//        lua_pushnumber(L, level + 1);
-//        lua_call(L, 3, 1);
-//#endif
-    }     
+    lua_sethook(L, prof->oldhook, prof->oldmask, prof->oldcount);
+#else
+    profiler *prof = getcontext(L)->prof;
+    double now = bind_seconds();
 
-    return 1;
-}
+    if (prof == NULL || now < prof->next)
+    {
+        return;
+    }
 
-LUALIB_API int tolua_beginpcall(lua_State *L, int reference)
-{	
-    lua_getref(L, LUA_RIDX_CUSTOMTRACEBACK);
-	int top = lua_gettop(L);
-	lua_getref(L, reference);
-	return top;
-}
+    prof->next = now + prof->interval / 1e6;
+#endif
+    lua_Debug frames[PROFILER_MAXDEPTH];
+    int depth = 0;
 
-LUALIB_API void tolua_pushtraceback(lua_State *L)
-{
-	lua_getref(L, LUA_RIDX_CUSTOMTRACEBACK);
-}
+    while (depth < PROFILER_MAXDEPTH && lua_getstack(L, depth, &frames[depth]))
+    {
+        ++depth;
+    }
 
-/*static const int sentinel_ = 0;
-#define sentinel ((void *)&sentinel_)
+    char buf[4096];
+    size_t len = 0;
 
-static int _require(lua_State *L)
-{
-    const char *name = luaL_checkstring(L, 1);    
-    lua_settop(L, 1);  
-    const char *key = luaL_gsub(L, name, "/", ".");            
-    lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
-    lua_getfield(L, 3, key);
+    for (int i = depth - 1; i >= 0 && len < sizeof(buf) - 1; i--)
+    {
+        lua_Debug *f = &frames[i];
+        lua_getinfo(L, "Sn", f);
+        int n = 0;
 
-    if (lua_toboolean(L, -1)) 
-    {  
-        if (lua_touserdata(L, -1) == sentinel)  
+        if (f->what[0] == 'C')
         {
-            luaL_error(L, "loop or previous error loading module " LUA_QS, name);
+            n = snprintf(buf + len, sizeof(buf) - len, "%s%s", len > 0 ? ";" : "", f->name != NULL ? f->name : "[C]");
+        }
+        else if (f->name != NULL)
+        {
+            n = snprintf(buf + len, sizeof(buf) - len, "%s%s:%s", len > 0 ? ";" : "", f->short_src, f->name);
+        }
+        else
+        {
+            n = snprintf(buf + len, sizeof(buf) - len, "%s%s:%d", len > 0 ? ";" : "", f->short_src, f->linedefined);
         }
 
-        return 1;  //package is already loaded
+        len = n > 0 && len + n < sizeof(buf) ? len + n : sizeof(buf) - 1;
     }
 
-    // else must load it; iterate over available loaders
-    lua_getfield(L, LUA_ENVIRONINDEX, "loaders");
+    profiler_add(prof, buf, len, 1);
+}
 
-    if (!lua_istable(L, -1))
+#ifdef PROFILER_SIGNAL
+static void profiler_signal(int sig)
+{
+    //lua_sethook 可以在信号里调用, 定时器只把信号发给启动采样的线程
+    profiler *prof = profcurrent;
+    (void)sig;
+
+    if (prof != NULL)
     {
-        luaL_error(L, LUA_QL("package.loaders") " must be a table");
+        lua_sethook(prof->L, profiler_hook, LUA_MASKCOUNT, 1);
     }
+}
 
-    lua_pushliteral(L, "");  //error message accumulator
+static bool profiler_settimer(profiler *prof)
+{
+    tolua_lock(&proflock);
 
-    for(int i = 1; ; i++) 
+    if (profsignals == 0)
     {
-        lua_rawgeti(L, -2, i);  // get a loader
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = profiler_signal;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
 
-        if (lua_isnil(L, -1))
+        if (sigaction(SIGPROF, &sa, &profoldaction) != 0)
         {
-            luaL_error(L, "module " LUA_QS " not found:%s", name, lua_tostring(L, -2));
+            tolua_unlock(&proflock);
+            return false;
         }
+    }
 
-        lua_pushstring(L, name);
-        lua_call(L, 1, 1);  
+    ++profsignals;
+    tolua_unlock(&proflock);
 
-        if (lua_isfunction(L, -1))  // did it find module?
-        {
-            break;  // module loaded successfully
-        }
-        else if (lua_isstring(L, -1))  // loader returned error message?
+    clockid_t clock;
+    struct sigevent sev;
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = SIGPROF;
+    sev.sigev_notify_thread_id = (pid_t)syscall(SYS_gettid);
+
+    if (pthread_getcpuclockid(pthread_self(), &clock) != 0 || timer_create(clock, &sev, &prof->timer) != 0)
+    {
+        tolua_lock(&proflock);
+
+        if (--profsignals == 0)
         {
-            lua_concat(L, 2);  // accumulate it
+            sigaction(SIGPROF, &profoldaction, NULL);
         }
-        else
-        {
-            lua_pop(L, 1);            
-        }    
+
+        tolua_unlock(&proflock);
+        return false;
     }
 
-    lua_pushlightuserdata(L, sentinel);
-    lua_setfield(L, 3, key);   // _LOADED[name] = sentinel
-    lua_pushstring(L, name);    // pass name as argument to module
-    lua_call(L, 1, 1);          // run loaded module
+    profcurrent = prof;
+    struct itimerspec its;
+    its.it_interval.tv_sec = prof->interval / 1000000;
+    its.it_interval.tv_nsec = (prof->interval % 1000000) * 1000;
+    its.it_value = its.it_interval;
+    timer_settime(prof->timer, 0, &its, NULL);
+    return true;
+}
 
-    if (!lua_isnil(L, -1))  // non-nil return? 
+static void profiler_deletetimer(profiler *prof)
+{
+    timer_delete(prof->timer);
+
+    if (profcurrent == prof)
     {
-        lua_setfield(L, 3, key);  // _LOADED[name] = returned value
+        profcurrent = NULL;
     }
 
-    lua_getfield(L, 3, key);
+    tolua_lock(&proflock);
 
-    if (lua_touserdata(L, -1) == sentinel) 
-    {   // module did not set a value? 
-        lua_pushboolean(L, 1);          // use true as result
-        lua_pushvalue(L, -1);           // extra copy to be returned
-        lua_setfield(L, 3, key);        // _LOADED[name] = true 
+    if (--profsignals == 0)
+    {
+        sigaction(SIGPROF, &profoldaction, NULL);
     }
 
-    return 1;
+    tolua_unlock(&proflock);
 }
+#endif
+#endif
 
-void tolua_openrequire(lua_State *L)
-{    
-    lua_getglobal(L, "require");
-    lua_pushcfunction(L, _require);
-    lua_getfenv(L, -2);
-    lua_setfenv(L, -2);
-    lua_setglobal(L, "require");
-    lua_pop(L, 1);
-}*/
-
-LUALIB_API int tolua_require(lua_State *L, const char *fileName)
+static void profiler_stop(profiler *prof)
 {
-    int top = lua_gettop(L);
-    lua_getref(L, LUA_RIDX_CUSTOMTRACEBACK);
-    lua_getref(L, LUA_RIDX_REQUIRE);
-    lua_pushstring(L, fileName);        
-    int ret = lua_pcall(L, 1, -1, top + 1);
-    lua_remove(L, top + 1);    
-    return ret;
+    if (!prof->running)
+    {
+        return;
+    }
+
+#if defined(LUA_JITLIBNAME)
+    luaJIT_profile_stop(prof->L);
+    atomic_store32(&profjit, 0);
+#else
+#ifdef PROFILER_SIGNAL
+    profiler_deletetimer(prof);
+#endif
+    lua_sethook(prof->L, prof->oldhook, prof->oldmask, prof->oldcount);
+#endif
+    prof->running = false;
 }
 
+//context 释放时调用, lua_close 前没有 stop 的也在这里停掉
+static void profiler_free(profiler *prof)
+{
+    if (prof != NULL)
+    {
+        profiler_stop(prof);
+        free(prof->entries);
+        free(prof->arena);
+        free(prof);
+    }
+}
 
-/*LUALIB_API bool tolua_checkluaslot(lua_State *L, int stackPos, int *func, int *table)
+/*interval_us 采样间隔, 在运行 L 的线程调用. lua5.x 下 hook 装在 L 上: 信号方式下协程里的采样记在 resume 它的位置,
+  count hook 方式下之后创建的协程会继承 hook, 之前已有的协程不采样. 返回 false 表示已在运行, 被占用(见上)或初始化失败*/
+LUALIB_API bool tolua_profiler_start(lua_State *L, int interval_us)
 {
-    lua_pushstring(L, "__call");      
-    lua_rawget(L, stackPos);
+    tolua_context *ctx = getcontext(L);
 
-    if (lua_isfunction(L, -1))
+    if (ctx->prof != NULL && ctx->prof->running)
     {
-        *func = toluaL_ref(L);        
+        return false;
     }
-    else
+
+#if defined(LUA_JITLIBNAME)
+    if (!atomic_cas32(&profjit, 0, 1))
+    {
+        return false;
+    }
+#elif defined(PROFILER_SIGNAL)
+    if (profcurrent != NULL)
     {
-        lua_pop(L, 1);
         return false;
     }
+#endif
 
-    lua_pushvalue(L, stackPos);
-    *table = toluaL_ref(L);    
-    return true;
-}*/
+    profiler *prof = ctx->prof;
 
-/*static int do_operator (lua_State *L, const char *op)
-{
-    if (lua_isuserdata(L,1))
-    {        
-        lua_pushvalue(L,1);  
+    if (prof == NULL)
+    {
+        prof = (profiler*)calloc(1, sizeof(profiler));
 
-        while (lua_getmetatable(L,-1))
-        {   
-            lua_remove(L,-2);                      
-            lua_pushstring(L,op);               
-            lua_rawget(L,-2);    
+        if (prof != NULL)
+        {
+            prof->entries = (profentry*)malloc(sizeof(profentry) * PROFILER_ENTRIES);
+            prof->arena = (char*)malloc(PROFILER_ARENA);
 
-            if (lua_isfunction(L,-1))
+            if (prof->entries == NULL || prof->arena == NULL)
             {
-                lua_pushvalue(L,1);
-                lua_pushvalue(L,2);
-                lua_call(L,2,1);
-                return 1;
+                profiler_free(prof);
+                prof = NULL;
             }
+        }
 
-            lua_settop(L,3);
+        if (prof == NULL)
+        {
+#if defined(LUA_JITLIBNAME)
+            atomic_store32(&profjit, 0);
+#endif
+            return false;
         }
+
+        ctx->prof = prof;
     }
 
-    luaL_error(L,"attempt to perform operation %s failed", op);
-    return 0;
+    memset(prof->entries, 0, sizeof(profentry) * PROFILER_ENTRIES);
+    prof->used = 0;
+    prof->arenaused = 0;
+    prof->samples = 0;
+    prof->dropped = 0;
+    prof->L = L;
+    prof->interval = interval_us > 0 ? interval_us : 1000;
+
+#if defined(LUA_JITLIBNAME)
+    char mode[32];
+    int ms = (prof->interval + 500) / 1000;
+    snprintf(mode, sizeof(mode), "i%d", ms > 0 ? ms : 1);   //jit.profile 精度为毫秒
+    luaJIT_profile_start(L, mode, profiler_callback, prof);
+#else
+    prof->oldhook = lua_gethook(L);
+    prof->oldmask = lua_gethookmask(L);
+    prof->oldcount = lua_gethookcount(L);
+#ifdef PROFILER_SIGNAL
+    if (!profiler_settimer(prof))
+    {
+        return false;
+    }
+#else
+    prof->next = bind_seconds() + prof->interval / 1e6;
+    lua_sethook(L, profiler_hook, LUA_MASKCOUNT, PROFILER_COUNT);
+#endif
+#endif
+    prof->running = true;
+    return true;
 }
 
-static int class_add_event (lua_State *L)
+LUALIB_API void tolua_profiler_stop(lua_State *L)
 {
-    return do_operator(L,"op_Addition");
+    profiler *prof = getcontext(L)->prof;
+
+    if (prof != NULL)
+    {
+        profiler_stop(prof);
+    }
 }
 
-static int class_sub_event (lua_State *L)
+//写 L 的折叠栈, 可以直接交给 flamegraph.pl. 返回行数, 失败返回 -1
+LUALIB_API int tolua_profiler_dump(lua_State *L, const char *path)
 {
-    return do_operator(L,"op_Subtraction");
+    profiler *prof = getcontext(L)->prof;
+    FILE *fp = fopen(path, "w");
+
+    if (fp == NULL)
+    {
+        return -1;
+    }
+
+    int n = 0;
+
+    for (int i = 0; prof != NULL && i < PROFILER_ENTRIES; i++)
+    {
+        profentry *e = &prof->entries[i];
+
+        if (e->len != 0)
+        {
+            fwrite(prof->arena + e->offset, 1, e->len, fp);
+            fprintf(fp, " %u\n", e->count);
+            ++n;
+        }
+    }
+
+    if (prof != NULL && prof->dropped > 0)
+    {
+        fprintf(fp, "[dropped] %llu\n", (unsigned long long)prof->dropped);
+        ++n;
+    }
+
+    fclose(fp);
+    return n;
 }
 
-static int class_mul_event (lua_State *L)
+/*tolua_newstate 的分页池分配器. 一个 lua_State 一个池, state 只在一个线程里跑, 池等同线程本地, 不加锁.
+  <= 256 字节按 16 字节分级, 每页按 MEMPOOL_PAGE 对齐, 释放时由地址直接找到页头; 更大的块走 realloc*/
+#define MEMPOOL_PAGE        (16 * 1024)
+#define MEMPOOL_GRAIN       16
+#define MEMPOOL_SMALL       (MEMPOOL_GRAIN * TOLUA_MEMCLASSES)
+#define MEMPOOL_CLASS(sz)   ((int)(((sz) - 1) / MEMPOOL_GRAIN))
+#define MEMPOOL_HEAD        ((sizeof(mempage) + MEMPOOL_GRAIN - 1) & ~(size_t)(MEMPOOL_GRAIN - 1))
+#define MEMPOOL_CAP(cls)    ((uint32_t)((MEMPOOL_PAGE - MEMPOOL_HEAD) / (((cls) + 1) * MEMPOOL_GRAIN)))
+
+typedef struct mempage
 {
-    return do_operator(L,"op_Multiply");
-}
+    struct mempage *prev;
+    struct mempage *next;
+    void *free;
+    uint32_t carved;                        //未切分部分的偏移, 新页不用一次切完
+    uint16_t used;
+    uint16_t cls;
+} mempage;
 
-static int class_div_event (lua_State *L)
+typedef struct mempool
 {
-    return do_operator(L,"op_Division");
-}
+    mempage *partial[TOLUA_MEMCLASSES];     //还有空闲块的页
+    lua_State *L;                           //创建成功后才设置, 之后 used 归零即 lua_close 结束
+    tolua_MemStats stats;
+} mempool;
 
-static int class_equals_event (lua_State *L)
+static void mempage_unlink(mempool *pool, mempage *p)
 {
-    return do_operator(L,"op_Equality");
-}*/
+    if (p->prev != NULL)
+    {
+        p->prev->next = p->next;
+    }
+    else
+    {
+        pool->partial[p->cls] = p->next;
+    }
 
+    if (p->next != NULL)
+    {
+        p->next->prev = p->prev;
+    }
 
-#ifdef _WIN32
-double tolua_timegettime()
-{
-	FILETIME ft;
-	double t;
-	GetSystemTimeAsFileTime(&ft);
-	/* Windows file time (time since January 1, 1601 (UTC)) */
-	t = ft.dwLowDateTime / 1.0e7 + ft.dwHighDateTime*(4294967296.0 / 1.0e7);
-	/* convert to Unix Epoch time (time since January 1, 1970 (UTC)) */
-	return (t - 11644473600.0);
+    p->prev = p->next = NULL;
 }
-#else
-double tolua_timegettime()
+
+static void mempage_link(mempool *pool, mempage *p)
 {
-	struct timeval v;
-	gettimeofday(&v, (struct timezone *) NULL);
-	/* Unix Epoch time (time since January 1, 1970 (UTC)) */
-	return v.tv_sec + v.tv_usec / 1.0e6;
+    p->prev = NULL;
+    p->next = pool->partial[p->cls];
+
+    if (p->next != NULL)
+    {
+        p->next->prev = p;
+    }
+
+    pool->partial[p->cls] = p;
 }
+
+static mempage *mempage_new(mempool *pool, int cls)
+{
+    void *mem = NULL;
+
+#ifdef _WIN32
+    mem = _aligned_malloc(MEMPOOL_PAGE, MEMPOOL_PAGE);
+#else
+    if (posix_memalign(&mem, MEMPOOL_PAGE, MEMPOOL_PAGE) != 0)
+    {
+        mem = NULL;
+    }
 #endif
 
-static int tolua_gettime(lua_State *L)
+    if (mem == NULL)
+    {
+        return NULL;
+    }
+
+    mempage *p = (mempage*)mem;
+    p->free = NULL;
+    p->carved = (uint32_t)MEMPOOL_HEAD;
+    p->used = 0;
+    p->cls = (uint16_t)cls;
+    mempage_link(pool, p);
+    pool->stats.classes[cls].pages++;
+    return p;
+}
+
+static void mempage_free(mempool *pool, mempage *p)
 {
-	lua_pushnumber(L, tolua_timegettime());
-	return 1;
+    mempage_unlink(pool, p);
+    pool->stats.classes[p->cls].pages--;
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
 }
 
-static int tolua_bnd_setpeer(lua_State *L) 
+static void *mempool_alloc(mempool *pool, size_t size)
 {
-    // stack: userdata, table
-    if (!lua_isuserdata(L, -2)) 
-    {
-        return luaL_error(L, "Invalid argument #1 to setpeer: userdata expected.");        
-    }
+    tolua_MemStats *st = &pool->stats;
+    void *block;
 
-    if (lua_isnil(L, 2)) 
+    if (size > MEMPOOL_SMALL)
     {
-        lua_pop(L, 1);
-        lua_pushvalue(L, TOLUA_NOPEER);
-        lua_setfenv(L, -2);
-    }        
+        block = malloc(size);
+
+        if (block == NULL)
+        {
+            return NULL;
+        }
+
+        st->large += size;
+        st->largeallocs++;
+    }
     else
     {
-        lua_pushvalue(L, 2);                //stack: u p p
-        lua_setfenv(L, -3);                 //stack: u p
-        lua_newtable(L);                    //stack: u p vt        
-        
-        lua_pushlightuserdata(L, &vptr);    
-        lua_pushvalue(L, 1);
-        lua_rawset(L, -3);
-        //lua_pushvalue(L, 1);
-        //lua_rawseti(L, -2, 1);
+        int cls = MEMPOOL_CLASS(size);
+        mempage *p = pool->partial[cls];
 
-        lua_getref(L, LUA_RIDX_VPTR);       //stack: u p vt mt
-        lua_setmetatable(L, -2);            //stack: u p vt
+        if (p == NULL && (p = mempage_new(pool, cls)) == NULL)
+        {
+            return NULL;
+        }
 
-        lua_pushstring(L, "base");          //stack: u p vt "base"
-        lua_pushvalue(L, -2);               //stack: u p vt "base" vt
-        lua_rawset(L, 2);                   //stack: u p vt    
-        lua_pop(L, 1);
-    }
+        if (p->free != NULL)
+        {
+            block = p->free;
+            p->free = *(void**)block;
+        }
+        else
+        {
+            block = (char*)p + p->carved;
+            p->carved += (cls + 1) * MEMPOOL_GRAIN;
+        }
 
-    return 0;
-};
+        if (++p->used == MEMPOOL_CAP(cls))
+        {
+            mempage_unlink(pool, p);
+        }
 
-static int tolua_bnd_getpeer(lua_State *L) 
-{    
-    lua_getfenv(L, -1);
+        tolua_MemClass *mc = &st->classes[cls];
+        mc->blocks++;
+        mc->bytes += size;
+        mc->allocs++;
+    }
 
-    if (lua_rawequal(L, -1, TOLUA_NOPEER)) 
+    st->used += size;
+
+    if (st->used > st->peak)
     {
-        lua_pop(L, 1);
-        lua_pushnil(L);
-    };
+        st->peak = st->used;
+    }
 
-    return 1;
-};
+    return block;
+}
 
-static int tolua_bnd_getfunction(lua_State *L)
+static void mempool_free(mempool *pool, void *block, size_t size)
 {
-    lua_pushvalue(L, 1);                            // stack: obj key obj
+    tolua_MemStats *st = &pool->stats;
+    st->used -= size;
 
-    while (lua_getmetatable(L, -1) != 0)            // stack: obj key mt
-    {            
-        lua_remove(L, -2);                          // stack: obj key mt
+    if (size > MEMPOOL_SMALL)
+    {
+        st->large -= size;
+        free(block);
+        return;
+    }
 
-        lua_pushvalue(L, 2);                        // stack: obj key mt key
-        lua_rawget(L, -2);                          // stack: obj key mt value        
+    mempage *p = (mempage*)((uintptr_t)block & ~(uintptr_t)(MEMPOOL_PAGE - 1));
+    int cls = p->cls;
+    tolua_MemClass *mc = &st->classes[cls];
+    mc->blocks--;
+    mc->bytes -= size;
+    *(void**)block = p->free;
+    p->free = block;
 
-        if (!lua_isfunction(L, -1))
+    if (p->used-- == MEMPOOL_CAP(cls))
+    {
+        mempage_link(pool, p);
+    }
+
+    //每级留一张空页, 避免在页边界上反复申请释放
+    if (p->used == 0 && (pool->partial[cls] != p || p->next != NULL))
+    {
+        mempage_free(pool, p);
+    }
+}
+
+static void mempool_destroy(mempool *pool)
+{
+    for (int i = 0; i < TOLUA_MEMCLASSES; i++)
+    {
+        while (pool->partial[i] != NULL)
         {
-            return 1;
+            mempage_free(pool, pool->partial[i]);
         }
-        else
+    }
+
+    free(pool);
+}
+
+static void *tolua_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+    mempool *pool = (mempool*)ud;
+
+    if (ptr == NULL)
+    {
+        osize = 0;                          //5.4 这时 osize 是对象类型
+    }
+
+    if (nsize == 0)
+    {
+        if (ptr != NULL)
         {
-            lua_pop(L, 1);
+            mempool_free(pool, ptr, osize);
+
+            if (pool->stats.used == 0 && pool->L != NULL)
+            {
+                mempool_destroy(pool);      //lua_close 释放了最后一块
+            }
         }
-        
-        lua_pushlightuserdata(L, &gettag);          
-        lua_rawget(L, -2);                          //stack: obj key mt tget
 
-        if (lua_istable(L, -1))
+        return NULL;
+    }
+
+    if (osize > MEMPOOL_SMALL && nsize > MEMPOOL_SMALL)
+    {
+        void *block = realloc(ptr, nsize);
+
+        if (block != NULL)
         {
-            lua_pushvalue(L, 2);                    //stack: obj key mt tget key
-            lua_rawget(L, -2);                      //stack: obj key mt tget value 
+            pool->stats.large += nsize - osize;
+            pool->stats.used += nsize - osize;
 
-            if (lua_isfunction(L, -1))
-            {                                           
-                return 1;
+            if (pool->stats.used > pool->stats.peak)
+            {
+                pool->stats.peak = pool->stats.used;
             }
         }
-            
-        lua_settop(L, 3);                           //stack: obj key mt
+
+        return block;
     }
 
-    lua_settop(L, 2);
-    lua_pushnil(L);
-    return 1;
+    if (osize != 0 && osize <= MEMPOOL_SMALL && nsize <= MEMPOOL_SMALL && MEMPOOL_CLASS(osize) == MEMPOOL_CLASS(nsize))
+    {
+        pool->stats.classes[MEMPOOL_CLASS(osize)].bytes += nsize - osize;
+        pool->stats.used += nsize - osize;
+
+        if (pool->stats.used > pool->stats.peak)
+        {
+            pool->stats.peak = pool->stats.used;
+        }
+
+        return ptr;
+    }
+
+    void *block = mempool_alloc(pool, nsize);
+
+    if (block != NULL && ptr != NULL)
+    {
+        memcpy(block, ptr, osize < nsize ? osize : nsize);
+        mempool_free(pool, ptr, osize);
+    }
+
+    return block;
 }
 
-static int tolua_bnd_type (lua_State *L)
+static int tolua_panic(lua_State *L)
 {
-    tolua_typename(L,lua_gettop(L));
-    return 1;
+    const char *msg = lua_tostring(L, -1);
+    fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n", msg != NULL ? msg : "error object is not a string");
+    fflush(stderr);
+    return 0;
 }
 
-static int tolua_initgettable(lua_State *L)
+//pooled 为 false 时等同 luaL_newstate. luajit x64 非 GC64 不允许自定义分配器, 同样退回 luaL_newstate
+LUALIB_API lua_State *tolua_newstate(bool pooled)
 {
-    if (!lua_istable(L, 1))
-    {        
-        return luaL_typerror(L, 1, "table");         
+#if defined(LUA_JITLIBNAME) && LJ_64 && !LJ_GC64
+    pooled = false;
+#endif
+
+    if (!pooled)
+    {
+        return luaL_newstate();
     }
 
-    lua_newtable(L);
-    lua_pushlightuserdata(L, &gettag);
-    lua_pushvalue(L, -2);    
-    lua_rawset(L, 1);
-    return 1;
+    mempool *pool = (mempool*)calloc(1, sizeof(mempool));
+
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+
+    for (int i = 0; i < TOLUA_MEMCLASSES; i++)
+    {
+        pool->stats.classes[i].size = (i + 1) * MEMPOOL_GRAIN;
+    }
+
+    lua_State *L = lua_newstate(tolua_alloc, pool);
+
+    if (L == NULL)
+    {
+        mempool_destroy(pool);
+        return NULL;
+    }
+
+    pool->L = L;
+    lua_atpanic(L, tolua_panic);
+    return L;
 }
 
-static int tolua_initsettable(lua_State *L)
+//state 不是 tolua_newstate(true) 创建时返回 false
+LUALIB_API bool tolua_memstats(lua_State *L, tolua_MemStats *out)
 {
-    if (!lua_istable(L, 1))
-    {        
-        return luaL_typerror(L, 1, "table");         
+    void *ud = NULL;
+
+    if (lua_getallocf(L, &ud) != tolua_alloc)
+    {
+        return false;
     }
 
-    lua_newtable(L);
-    lua_pushlightuserdata(L, &settag);    
-    lua_pushvalue(L, -2);    
-    lua_rawset(L, 1);
+    mempool *pool = (mempool*)ud;
+    uint64_t pages = 0, bytes = 0;
+    *out = pool->stats;
+
+    for (int i = 0; i < TOLUA_MEMCLASSES; i++)
+    {
+        pages += out->classes[i].pages;
+        bytes += out->classes[i].bytes;
+    }
+
+    out->reserved = pages * MEMPOOL_PAGE + out->large;
+    out->fragmentation = pages == 0 ? 0 : 1.0 - (double)bytes / (double)(pages * MEMPOOL_PAGE);
+    return true;
+}
+
+static int tolua_pusherror(lua_State *L, const char *fmt, ...)
+{
+    va_list argp;
+    va_start(argp, fmt);
+    luaL_where(L, 1);
+    lua_pushvfstring(L, fmt, argp);
+    va_end(argp);
+    lua_concat(L, 2);
     return 1;
 }
 
-void tolua_openvptr(lua_State *L)
+LUALIB_API int tolua_argerror(lua_State *L, int narg, const char *extramsg)
 {
-    lua_newtable(L);        
+    lua_Debug ar;
+    
+    if (!lua_getstack(L, 0, &ar))  /* no stack frame? */
+    {
+        return tolua_pusherror(L, "bad argument #%d (%s)", narg, extramsg);        
+    }
 
-    lua_pushstring(L, "__index");
-    lua_pushcfunction(L, vptr_index_event);
-    lua_rawset(L, -3);  
+    lua_getinfo(L, "n", &ar);
 
-    lua_pushstring(L, "__newindex");
-    lua_pushcfunction(L, vptr_newindex_event);
-    lua_rawset(L, -3);  
+    if (strcmp(ar.namewhat, "method") == 0) 
+    {
+        narg--;  /* do not count `self' */
 
-    lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_VPTR); 
+        if (narg == 0)  /* error is in the self argument itself? */
+        {
+            return tolua_pusherror(L, "calling " LUA_QS " on bad self (%s)", ar.name, extramsg);
+        }
+    }
+
+    if (ar.name == NULL)
+    {
+        ar.name = "?";
+    }    
+
+    return tolua_pusherror(L, "bad argument #%d to " LUA_QS " (%s)", narg, ar.name, extramsg);
 }
 
-static const struct luaL_Reg tolua_funcs[] = 
+LUALIB_API int tolua_error(lua_State *L, const char *msg)
 {
-	{ "gettime", tolua_gettime },
-	{ "typename", tolua_bnd_type },
-	{ "setpeer", tolua_bnd_setpeer},
-	{ "getpeer", tolua_bnd_getpeer},
-    { "getfunction", tolua_bnd_getfunction},
-    { "initset", tolua_initsettable},
-    { "initget", tolua_initgettable},
-    { "int64", tolua_newint64},        
-    { "uint64", tolua_newuint64},
-    { "traceback", traceback},
-	{ NULL, NULL }
-};
+    lua_pushboolean(L, 1);
+    lua_replace(L, lua_upvalueindex(1));
+    lua_pushstring(L, msg);
+    return 1;
+}
+
+LUALIB_API int tolua_getn(lua_State *L, int i)
+{
+    return tolua_objlen(L, i);
+}
+
+LUALIB_API int tolua_strlen(const char *str)
+{
+    if (str == NULL)
+    {
+        return 0;
+    }
+
+    int len = (int)strlen(str);
+    return len;
+}
+
+/*LUA_RIDX_PRELOADCACHE[mt]: key -> "space.key" 或 false(preload里没有), 避免每次miss都拼接字符串. 弱键表, 不写进模块表.
+  names[1] 记录建表时的 preloadversion, tolua_addpreload 或经过代理写 package.preload 后整体失效.
+  命中 "space.key" 时再查一次 preload, 绕过代理删除的项不会让 require 报错*/
+static bool _requirepreload(lua_State *L, int mt, int space, int key)
+{
+    bool cache = lua_type(L, key) == LUA_TSTRING;
+
+    if (cache)
+    {
+        lua_getref(L, LUA_RIDX_PRELOADCACHE);
+        lua_pushvalue(L, mt);
+        lua_rawget(L, -2);                          //stack: caches names
+
+        if (lua_istable(L, -1))
+        {
+            lua_rawgeti(L, -1, 1);
+            cache = lua_tointeger(L, -1) == getcontext(L)->preloadversion;
+            lua_pop(L, 1);
+        }
+        else
+        {
+            cache = false;
+        }
+
+        if (!cache)
+        {
+            lua_pop(L, 1);
+            lua_newtable(L);
+            lua_pushinteger(L, getcontext(L)->preloadversion);
+            lua_rawseti(L, -2, 1);
+            lua_pushvalue(L, mt);
+            lua_pushvalue(L, -2);
+            lua_rawset(L, -4);
+            cache = true;
+        }
+
+        lua_remove(L, -2);                          //stack: names
+        lua_pushvalue(L, key);
+        lua_rawget(L, -2);                          //stack: names key1/false/nil
+
+        if (lua_type(L, -1) == LUA_TSTRING)
+        {
+            lua_getref(L, LUA_RIDX_PRELOAD);
+            lua_pushvalue(L, -2);
+            lua_gettable(L, -2);                    //stack: names key1 preload value
+
+            if (lua_isnil(L, -1))
+            {
+                lua_pop(L, 3);
+                lua_pushnil(L);
+            }
+            else
+            {
+                lua_pop(L, 2);
+            }
+        }
+    }
+    else
+    {
+        lua_pushnil(L);
+        lua_pushnil(L);                             //stack: nil nil
+    }
+
+    if (lua_isnil(L, -1))
+    {
+        lua_pop(L, 1);
+        lua_getref(L, LUA_RIDX_PRELOAD);            //stack: names preload
+        lua_pushvalue(L, space);
+        lua_pushstring(L, ".");
+        lua_pushvalue(L, key);
+        lua_concat(L, 3);                           //stack: names preload key1
+        lua_pushvalue(L, -1);
+        lua_gettable(L, -3);                        //stack: names preload key1 value
+
+        if (lua_isnil(L, -1))
+        {
+            lua_pop(L, 2);
+            lua_pushboolean(L, 0);                  //stack: names preload false
+        }
+        else
+        {
+            lua_pop(L, 1);                          //stack: names preload key1
+        }
+
+        lua_remove(L, -2);                          //stack: names key1/false
+
+        if (cache)
+        {
+            lua_pushvalue(L, key);
+            lua_pushvalue(L, -2);
+            lua_rawset(L, -4);
+        }
+    }
+
+    if (lua_type(L, -1) != LUA_TSTRING)
+    {
+        lua_pop(L, 2);
+        return false;
+    }
+
+    lua_getref(L, LUA_RIDX_REQUIRE);                //stack: names key1 require
+    lua_insert(L, -2);                              //stack: names require key1
+    lua_call(L, 1, 1);                              //stack: names value
+    lua_remove(L, -2);
+    return true;
+}
+
+static bool _preload(lua_State *L)
+{    
+    lua_settop(L, 2); 
+    lua_getmetatable(L, 1);
+    lua_pushstring(L, ".name");             //stack: t key mt ".name"
+    lua_rawget(L, -2);                      //stack: t key mt space
+
+    if (!lua_isnil(L, -1) && _requirepreload(L, 3, 4, 2))
+    {                      
+        return true;                        //stack: t key mt space value
+    }
+
+    lua_settop(L, 2); 
+    return false;
+}
+
+/*per class flattened lookup cache, cache[1] holds the classversion it was built with.
+  entries are {value, holder, getter}: a hit is only used while holder still has the same value,
+  so overwriting or removing a member (even with rawset) is seen without bumping the version*/
+static void pushclasscache(lua_State *L, int mt)
+{
+    lua_pushlightuserdata(L, &cachetag);
+    lua_rawget(L, mt);                              //stack: cache
+
+    if (lua_istable(L, -1))
+    {
+        lua_rawgeti(L, -1, 1);                      //stack: cache version
+
+        if (lua_tointeger(L, -1) == getcontext(L)->classversion)
+        {
+            lua_pop(L, 1);
+            return;
+        }
+
+        lua_pop(L, 1);
+    }
+
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushinteger(L, getcontext(L)->classversion);
+    lua_rawseti(L, -2, 1);
+    lua_pushlightuserdata(L, &cachetag);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, mt);
+}
+
+static void invalidateclasscache(lua_State *L)
+{
+    ++getcontext(L)->classversion;
+}
+
+//stack: key, cache[key] = {value, holder, getter}, 弹出 key
+static void setclasscache(lua_State *L, int cache, int value, int holder, bool getter)
+{
+    value = abs_index(L, value);
+    holder = abs_index(L, holder);
+    lua_createtable(L, 3, 0);
+    lua_pushvalue(L, value);
+    lua_rawseti(L, -2, 1);
+    lua_pushvalue(L, holder);
+    lua_rawseti(L, -2, 2);
+
+    if (getter)
+    {
+        lua_pushboolean(L, 1);
+        lua_rawseti(L, -2, 3);
+    }
+
+    lua_rawset(L, cache);
+}
+
+//get/set 表新增键时缓存整体失效, 已有键的改写由缓存项的 holder 检查发现
+static int accessor_newindex(lua_State *L)
+{
+    invalidateclasscache(L);
+    lua_rawset(L, 1);
+    return 0;
+}
+
+//stack: table, 给 get/set 表设置上面的元表
+static void setaccessormeta(lua_State *L)
+{
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_ACCESSORMETA);
+
+    if (!lua_istable(L, -1))
+    {
+        lua_pop(L, 1);
+        lua_createtable(L, 0, 1);
+        lua_pushstring(L, "__newindex");
+        lua_pushcfunction(L, accessor_newindex);
+        lua_rawset(L, -3);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_ACCESSORMETA);
+    }
+
+    lua_setmetatable(L, -2);
+}
+
+static int class_index_event(lua_State *L)
+{
+	int t = lua_type(L, 1);
+
+    if (t == LUA_TUSERDATA)
+    {    	
+        lua_getfenv(L,1);
+
+        if (!lua_rawequal(L, -1, TOLUA_NOPEER))     // stack: t k env
+        {
+            while (lua_istable(L, -1))                       // stack: t k v mt 
+            {      
+                lua_pushvalue(L, 2); 
+                lua_rawget(L, -2);
+            
+                if (!lua_isnil(L, -1))
+                {
+                    return 1;
+                }
+
+                lua_pop(L, 1);
+                lua_pushlightuserdata(L, &gettag);          
+                lua_rawget(L, -2);                      //stack: obj key env tget
+            
+                if (lua_istable(L, -1))
+                {                    
+                    lua_pushvalue(L, 2);                //stack: obj key env tget key
+                    lua_rawget(L, -2);                  //stack: obj key env tget func 
+
+                    if (lua_isfunction(L, -1))
+                    {                        
+                        lua_pushvalue(L, 1);
+                        lua_call(L, 1, 1);
+                        return 1;
+                    }    
+
+                    lua_pop(L, 1);                 
+                }
+
+                lua_pop(L, 1); 
+
+                if (lua_getmetatable(L, -1) == 0)               // stack: t k v mt mt
+                {
+                    lua_pushnil(L);
+                }
+
+                lua_remove(L, -2);                              // stack: t k v mt
+            }        
+        };
+
+        lua_settop(L, 2);
+
+        if (lua_getmetatable(L, 1) != 0)                // stack: obj key mt
+        {
+            bool isnum = lua_isnumber(L, 2) ? true : false;
+            pushclasscache(L, 3);                       // stack: obj key mt cache
+            lua_replace(L, 3);                          // stack: obj key cache
+
+            if (isnum)
+            {
+                lua_pushlightuserdata(L, &getitag);
+            }
+            else
+            {
+                lua_pushvalue(L, 2);
+            }
+
+            lua_rawget(L, 3);                           // stack: obj key cache entry
+
+            if (lua_istable(L, -1))
+            {
+                lua_rawgeti(L, 4, 1);                   // stack: obj key cache entry value
+                lua_rawgeti(L, 4, 2);                   // stack: obj key cache entry value holder
+
+                if (isnum)
+                {
+                    lua_pushstring(L, ".geti");
+                }
+                else
+                {
+                    lua_pushvalue(L, 2);
+                }
+
+                lua_rawget(L, 6);                       // stack: obj key cache entry value holder current
+
+                if (lua_rawequal(L, 5, 7))
+                {
+                    lua_rawgeti(L, 4, 3);
+                    bool getter = lua_toboolean(L, -1) != 0;
+                    lua_settop(L, 5);
+
+                    if (isnum)
+                    {
+                        lua_pushvalue(L, 1);
+                        lua_pushvalue(L, 2);
+                        lua_call(L, 2, 1);
+                    }
+                    else if (getter)
+                    {
+                        lua_pushvalue(L, 1);
+                        lua_call(L, 1, 1);
+                    }
+
+                    return 1;
+                }
+            }
+
+            lua_settop(L, 3);
+            lua_pushvalue(L, 1);                        // stack: obj key cache obj
+
+            while (lua_getmetatable(L, -1) != 0)
+            {
+                lua_remove(L, -2);                      // stack: obj key cache mt
+
+                if (isnum)                              // check if key is a numeric value
+                {
+                    lua_pushstring(L, ".geti");
+                    lua_rawget(L, -2);                  // stack: obj key cache mt func
+
+                    if (lua_isfunction(L, -1))
+                    {
+                        lua_pushlightuserdata(L, &getitag);
+                        setclasscache(L, 3, -2, -3, false);
+                        lua_pushvalue(L, 1);
+                        lua_pushvalue(L, 2);
+                        lua_call(L, 2, 1);
+                        return 1;
+                    }
+                }
+                else
+                {
+                    lua_pushvalue(L, 2);                // stack: obj key cache mt key
+                    lua_rawget(L, -2);                  // stack: obj key cache mt value
+
+                    if (!lua_isnil(L, -1))
+                    {
+                        lua_pushvalue(L, 2);
+                        setclasscache(L, 3, -2, -3, false);
+                        return 1;
+                    }
+
+                    lua_pop(L, 1);
+                    lua_pushlightuserdata(L, &gettag);
+                    lua_rawget(L, -2);                  //stack: obj key cache mt tget
+
+                    if (lua_istable(L, -1))
+                    {
+                        lua_pushvalue(L, 2);            //stack: obj key cache mt tget key
+                        lua_rawget(L, -2);              //stack: obj key cache mt tget func
+
+                        if (lua_isfunction(L, -1))
+                        {
+                            lua_pushvalue(L, 2);
+                            setclasscache(L, 3, -2, -3, true);
+                            lua_pushvalue(L, 1);
+                            lua_call(L, 1, 1);
+                            return 1;
+                        }
+                    }
+                }
+
+                lua_settop(L, 4);
+            }
+        }
+
+        lua_settop(L, 2);
+        int *udata = (int*)lua_touserdata(L, 1);
+
+        if (*udata == LUA_NULL_USERDATA)
+        {
+            return luaL_error(L, "attemp to index %s on a nil value", lua_tostring(L, 2));   
+        }
+        
+        if (tolua_stateflags(L) & FLAG_INDEX_ERROR)
+        {
+            return luaL_error(L, "field or property %s does not exist", lua_tostring(L, 2));
+        }        
+    }
+    else if(t == LUA_TTABLE)
+    {
+    	lua_pushvalue(L,1);                          //stack: obj key obj
+
+		while (lua_getmetatable(L, -1) != 0)         //stack: obj key obj mt
+    	{
+        	lua_remove(L, -2);						// stack: obj key mt
+
+        	lua_pushvalue(L, 2);			    	// stack: obj key mt key
+        	lua_rawget(L, -2);						// stack: obj key mt value        
+
+        	if (!lua_isnil(L, -1))
+        	{
+        		if (lua_isfunction(L, -1))			//cache static function
+        		{
+        			lua_pushvalue(L, 2);           // stack: obj key mt value key
+        			lua_pushvalue(L, -2);          // stack: obj key mt value key value
+        			lua_rawset(L, 1);
+        		}
+
+        	    return 1;
+        	}        	
+        	
+            lua_pop(L, 1);        
+			lua_pushlightuserdata(L, &gettag);        	
+        	lua_rawget(L, -2);						//stack: obj key mt tget
+
+        	if (lua_istable(L, -1))
+        	{
+        	    lua_pushvalue(L, 2);				//stack: obj key mt tget key
+        	    lua_rawget(L, -2);           		//stack: obj key mt tget value 
+
+        	    if (lua_isfunction(L, -1))
+        	    {        	        	
+                    lua_pushvalue(L, 1);
+        	        lua_call(L, 1, 1);
+        	        return 1;
+        	    }
+        	}
+    		
+        	lua_settop(L, 3);
+    	}        
+        
+        if (_preload(L))
+        {
+            return 1;
+        }          
+        
+        if (tolua_stateflags(L) & FLAG_INDEX_ERROR)
+        {
+            return luaL_error(L, "field or property %s does not exist", lua_tostring(L, 2));               
+        }      
+    }
+
+    lua_pushnil(L);
+    return 1;
+}
+
+static void storeatubox (lua_State *L, int lo)
+{
+    lua_getfenv(L, lo);                         // stack: t, k, v, _env
+
+    if (lua_rawequal(L, -1, TOLUA_NOPEER)) 
+    {
+        lua_pop(L, 1);
+        return;
+        //lua_newtable(L);                        // stack: t, k, v, t
+        //lua_pushvalue(L, -1);                   // stack: t, k, v, t, t        
+        //lua_setfenv(L, lo);                     // stack: t, k, v, t
+    };
+
+    lua_insert(L, -3);
+    lua_settable(L, -3);
+    lua_pop(L, 1);
+}
+
+static int class_newindex_event(lua_State *L)
+{
+	int t = lua_type(L, 1);
+
+	if (t == LUA_TUSERDATA)
+    {
+        bool useEnv = false;
+        lua_getfenv(L, 1);
+
+        if (!lua_rawequal(L, -1, TOLUA_NOPEER)) 
+        {             
+            useEnv = true;
+
+            while (lua_istable(L, -1))                       // stack: t k v mt 
+            {       
+                lua_pushvalue(L, 2);                        // stack: t k v mt k
+                lua_rawget(L, -2);                          // stack: t k v mt value        
+
+                if (!lua_isnil(L, -1))
+                {                    
+                    lua_pop(L, 1);
+                    lua_insert(L, -3);
+                    lua_rawset(L, -3);
+                    return 0;
+                }
+
+                lua_pop(L, 1);                
+                lua_pushlightuserdata(L, &settag);              // stack: t k v mt tset
+                lua_rawget(L, -2);                   
+
+                if (lua_istable(L, -1)) 
+                {
+                    lua_pushvalue(L, 2);                         // stack: t k v mt tset k
+                    lua_rawget(L, -2);                    
+
+                    if (lua_isfunction(L, -1)) 
+                    {                          
+                        lua_pushvalue(L, 1); 
+                        lua_pushvalue(L, 3); 
+                        lua_call(L, 2, 0);
+                        return 0;
+                    }
+
+                    lua_pop(L, 1);                              // stack: t k v mt tset 
+                }  
+
+                lua_pop(L, 1);                                  // stack: t k v mt
+
+                if (lua_getmetatable(L, -1) == 0)               // stack: t k v mt mt
+                {
+                    lua_pushnil(L);
+                }
+
+                lua_remove(L, -2);                              // stack: t k v mt
+            }              
+        }
+
+        lua_settop(L, 3);
+    	lua_getmetatable(L,1);
+
+    	while (lua_istable(L, -1))                			// stack: t k v mt
+    	{        	
+    		if (lua_isnumber(L, 2))
+    		{
+				lua_pushstring(L,".seti");
+                lua_rawget(L,-2);                      		// stack: obj key mt func
+
+                if (lua_isfunction(L,-1))
+                {
+                    lua_pushvalue(L,1);
+                    lua_pushvalue(L,2);
+                    lua_pushvalue(L,3);
+                    lua_call(L,3,0);                    
+                }
+
+                return 0;
+    		}
+    		else
+        	{
+        		lua_pushlightuserdata(L, &settag);
+        		lua_rawget(L, -2);                      	// stack: t k v mt tset
+
+        		if (lua_istable(L, -1))
+        		{
+            		lua_pushvalue(L, 2);
+            		lua_rawget(L, -2);                     	// stack: t k v mt tset func
+
+            		if (lua_isfunction(L, -1))
+            		{
+                		lua_pushvalue(L, 1);
+                		lua_pushvalue(L, 3);
+                		lua_call(L, 2, 0);
+                		return 0;
+            		}
+
+            		lua_pop(L, 1);                          // stack: t k v mt tset 
+        		}
+
+        		lua_pop(L, 1);                              // stack: t k v mt 
+
+        		if (lua_getmetatable(L, -1) == 0)           // stack: t k v mt mt
+        		{
+            		lua_pushnil(L);
+        		}
+
+        		lua_remove(L, -2);                          // stack: t k v mt 
+        	}
+    	}
+
+        lua_settop(L, 3);                                       // stack: t k v
+        int* udata = (int*)lua_touserdata(L, 1);
+
+        if (*udata == LUA_NULL_USERDATA)
+        {
+            return luaL_error(L, "attemp to index %s on a nil value", lua_tostring(L, 2));   
+        }        
+
+        if (useEnv) 
+        {
+            lua_getfenv(L, 1);                         // stack: t, k, v, _env
+            lua_insert(L, -3);
+            lua_settable(L, -3);
+            lua_pop(L, 1);
+            return 0;
+        }                       
+	}
+	else if (t == LUA_TTABLE)
+	{
+		lua_getmetatable(L, 1);								// stack: t k v mt 
+
+		while (lua_istable(L, -1))                			// stack: t k v mt 
+    	{  		
+			lua_pushlightuserdata(L, &settag);				// stack: t k v mt tset
+        	lua_rawget(L, -2);       
+
+        	if (lua_istable(L,-1)) 
+        	{
+            	lua_pushvalue(L,2);  						// stack: t k v mt tset k
+            	lua_rawget(L,-2);
+
+            	if (lua_isfunction(L,-1)) 
+            	{  
+                	lua_pushvalue(L,1); 
+                	lua_pushvalue(L,3); 
+                	lua_call(L,2,0);
+                	return 0;
+            	}
+
+            	lua_pop(L, 1);                          	// stack: t k v mt tset 
+        	}  
+
+			lua_pop(L, 1);                              	// stack: t k v mt
+
+        	if (lua_getmetatable(L, -1) == 0)           	// stack: t k v mt mt
+        	{
+            	lua_pushnil(L);
+        	}
+
+        	lua_remove(L, -2);                          	// stack: t k v mt
+        }      
+	}
+
+    lua_settop(L, 3); 
+    return luaL_error(L, "field or property %s does not exist", lua_tostring(L, 2));      
+}
+
+static int enum_index_event (lua_State *L)
+{
+	lua_getmetatable(L, 1);									//stack: t, k, mt
+
+	if (lua_istable(L, -1))
+	{
+		lua_pushvalue(L, 2);								//stack: t, k, mt, k
+		lua_rawget(L, -2);									//stack: t, k, mt, v
+
+		if (!lua_isnil(L, -1))
+		{		
+			return 1;
+		}
+
+		lua_pop(L, 1);										//stack: t, k, mt
+		lua_pushlightuserdata(L, &gettag);		
+		lua_rawget(L, -2); 									//stack: t, k, mt, tget
+
+		if (lua_istable(L,-1)) 
+		{
+            lua_pushvalue(L,2);  							//stack: t k mt tget k
+            lua_rawget(L,-2);								//stack: t k mt tget v
+
+           	if (lua_isfunction(L,-1)) 
+			{  
+				lua_call(L, 0, 1);					
+				lua_pushvalue(L,2); 				
+				lua_pushvalue(L,-2); 				
+				lua_rawset(L, 3);		
+				return 1;			
+			}
+
+			lua_pop(L, 1);
+        }			
+	}
+
+	lua_settop(L, 2);
+	lua_pushnil(L);
+	return 1;	
+}
+
+static int enum_newindex_event(lua_State *L)
+{	
+	luaL_error(L, "the left-hand side of an assignment must be a variable, a property or an indexer");
+    return 1;
+}
+
+static int static_index_event(lua_State *L)
+{    
+    lua_pushvalue(L, 2);                    //stack: t key key
+    lua_rawget(L, 1);                       //stack: t key value        
+
+    if (!lua_isnil(L, -1))
+    {
+        return 1;
+    }
+
+    lua_pop(L, 1);            
+    lua_pushlightuserdata(L, &gettag);      //stack: t key tag    
+    lua_rawget(L, 1);                       //stack: t key tget
+
+    if (lua_istable(L, -1))
+    {
+        lua_pushvalue(L, 2);                //stack: obj key tget key
+        lua_rawget(L, -2);                  //stack: obj key tget func 
+
+        if (lua_isfunction(L, -1))
+        {                       
+            lua_call(L, 0, 1);
+            return 1;
+        }        
+    }
+    
+    lua_settop(L, 2);
+
+    if (_preload(L))
+    {
+        return 1;
+    }
+    
+    if (tolua_stateflags(L) & FLAG_INDEX_ERROR)
+    {
+        luaL_error(L, "field or property %s does not exist", lua_tostring(L, 2));    
+    }
+
+    return 1;
+}
+
+static int static_newindex_event(lua_State *L)
+{
+    lua_pushlightuserdata(L, &settag);              //stack: t k v tag
+    lua_rawget(L, 1);                               //stack: t k v tset
+
+    if (lua_istable(L,-1)) 
+    {
+        lua_pushvalue(L, 2);                         //stack: t k v tset k
+        lua_rawget(L, -2);                           //stack: t k v tset func
+
+        if (lua_isfunction(L, -1))
+        {    
+            lua_pushvalue(L,1); 
+            lua_pushvalue(L,3); 
+            lua_call(L,2,0);
+            return 0;
+        }
+    }
+
+    lua_settop(L, 3); 
+    luaL_error(L, "field or property %s does not exist", lua_tostring(L, 2));
+    return 1;
+}
+
+static int vptr_index_event(lua_State *L)
+{    
+    lua_pushlightuserdata(L, &vptr);
+    lua_rawget(L, 1);                                   // stack: t key u
+    lua_replace(L, 1);                                  // stack: u key
+    lua_pushvalue(L, 1);                                // stack: u key u
+
+    while (lua_getmetatable(L, -1) != 0)
+    {
+        lua_remove(L, -2);                              // stack: u key mt
+        lua_pushvalue(L, 2);                            // stack: u key mt key
+        lua_rawget(L, -2);                              // stack: u key mt value        
+
+        if (!lua_isnil(L, -1))
+        {
+            return 1;
+        }
+        
+        lua_pop(L, 1);        
+        lua_pushlightuserdata(L, &gettag);          
+        lua_rawget(L, -2);                              //stack: u key mt tget
+
+        if (lua_istable(L, -1))
+        {
+            lua_pushvalue(L, 2);                        //stack: obj key mt tget key
+            lua_rawget(L, -2);                          //stack: obj key mt tget value 
+
+            if (lua_isfunction(L, -1))
+            {
+                lua_pushvalue(L, 1);
+                lua_call(L, 1, 1);
+                return 1;
+            }
+        }
+
+        lua_settop(L, 3);
+    }
+
+    lua_settop(L, 2);
+    lua_pushnil(L);
+    return 1;
+}
+
+static int vptr_newindex_event(lua_State *L)
+{    
+    lua_pushlightuserdata(L, &vptr);
+    lua_rawget(L, 1);                                   // stack: t key v u        
+    lua_getmetatable(L, -1);
+
+    while (lua_istable(L, -1))                          // stack: u k v mt
+    {           
+        lua_pushlightuserdata(L, &settag);
+        lua_rawget(L, -2);                              // stack: u k v mt tset
+
+        if (lua_istable(L, -1))
+        {
+            lua_pushvalue(L, 2);
+            lua_rawget(L, -2);                          // stack: u k v mt tset func
+
+            if (lua_isfunction(L, -1))
+            {
+                lua_pushvalue(L, 4);
+                lua_pushvalue(L, 3);
+                lua_call(L, 2, 0);
+                return 0;
+            }
+
+            lua_pop(L, 1);                              // stack: t k v mt tset 
+        }
+
+        lua_pop(L, 1);                                  // stack: t k v mt 
+
+        if (lua_getmetatable(L, -1) == 0)               // stack: t k v mt mt
+        {
+            lua_pushnil(L);
+        }
+
+        lua_remove(L, -2);                              // stack: t k v mt             
+    }
+
+    lua_settop(L, 3);    
+    return 1;
+}
+
+LUALIB_API bool tolua_isvptrtable(lua_State *L, int index)
+{    
+    lua_pushlightuserdata(L, &vptr);
+    lua_rawget(L, index);
+    bool flag = lua_isnil(L, -1) ? false : true;
+    lua_pop(L, 1);
+    return flag;
+}
+
+LUALIB_API void tolua_setindex(lua_State *L)
+{
+	lua_pushstring(L, "__index");
+	lua_pushcfunction(L, class_index_event);
+	lua_rawset(L, -3);
+}
+
+LUALIB_API void tolua_setnewindex(lua_State *L)
+{
+	lua_pushstring(L, "__newindex");
+	lua_pushcfunction(L, class_newindex_event);
+	lua_rawset(L, -3);
+}
+
+#ifdef TOLUA_NATIVE_UBOX
+/*按c#对象索引存放代理userdata, 不被gc遍历. 代理的__gc清理自己的槽位, gen用来识别槽位已被复用.
+  开启释放队列后 __gc 只把索引记进环形队列, 不再逐个回调 c#, 由宿主每帧 tolua_drainreleased 批量取走.
+  __gc 和 drain 都在虚拟机所在线程执行, 队列不需要加锁*/
+#define UBOX_RELEASED   1           //代理已回收, 等宿主取走
+#define UBOX_QUEUED     2           //索引在队列里
+#define UBOX_FINALIZING 4           //5.4: 代理在 tobefnz 里等待 __gc
+
+typedef struct ubox_slot
+{
+    ubox_obj *obj;
+    int gen;
+    int state;
+} ubox_slot;
+
+typedef struct ubox
+{
+    ubox_slot *slots;
+    int size;
+    bool queue;
+    int *released;                  //环形队列, 容量为2的幂
+    int head;
+    int count;
+    int capacity;
+} ubox;
+
+#define UBOX_UDATA_SIZE (sizeof(int) * 2)
+
+static bool ubox_release(ubox *box, int index)
+{
+    ubox_slot *slot = &box->slots[index];
+    slot->state |= UBOX_RELEASED;
+
+    if (slot->state & UBOX_QUEUED)
+    {
+        return true;
+    }
+
+    if (box->count == box->capacity)
+    {
+        int capacity = box->capacity > 0 ? box->capacity * 2 : 1024;
+        int *released = (int*)malloc(sizeof(int) * capacity);
+
+        if (released == NULL)
+        {
+            slot->state &= ~UBOX_RELEASED;
+            return false;
+        }
+
+        for (int i = 0; i < box->count; i++)
+        {
+            released[i] = box->released[(box->head + i) & (box->capacity - 1)];
+        }
+
+        free(box->released);
+        box->released = released;
+        box->head = 0;
+        box->capacity = capacity;
+    }
+
+    box->released[(box->head + box->count++) & (box->capacity - 1)] = index;
+    slot->state |= UBOX_QUEUED;
+    return true;
+}
+
+static int ubox_gc_event(lua_State *L)
+{
+    int *udata = (int*)lua_touserdata(L, 1);
+
+    if (udata != NULL && lua_objlen(L, 1) == UBOX_UDATA_SIZE)
+    {
+        lua_getref(L, LUA_RIDX_UBOX);
+        ubox *box = (ubox*)lua_touserdata(L, -1);
+        lua_pop(L, 1);
+        int index = udata[0];
+
+        if (box != NULL && index >= 0 && index < box->size)
+        {
+            ubox_slot *slot = &box->slots[index];
+            bool live = slot->gen == udata[1] && slot->obj == ubox_toobj(udata);
+
+            if (live)
+            {
+                slot->obj = NULL;
+                slot->state &= ~UBOX_FINALIZING;
+            }
+
+            //过期的代理不通知, 同一索引上已经有新代理
+            if (box->queue && (!live || ubox_release(box, index)))
+            {
+                return 0;
+            }
+        }
+    }
+
+    if (lua_isfunction(L, lua_upvalueindex(1)))
+    {
+        lua_pushvalue(L, lua_upvalueindex(1));
+        lua_insert(L, 1);
+        lua_call(L, lua_gettop(L) - 1, 0);
+    }
+
+    return 0;
+}
+
+//栈顶function包装成清理槽位的__gc
+static void ubox_pushgc(lua_State *L)
+{
+    if (lua_tocfunction(L, -1) != ubox_gc_event)
+    {
+        lua_pushcclosure(L, ubox_gc_event, 1);
+    }
+}
+
+static void ubox_checkgc(lua_State *L, int mt)
+{
+    lua_pushstring(L, "__gc");
+    lua_rawget(L, mt);
+
+    if (lua_tocfunction(L, -1) != ubox_gc_event)
+    {
+        ubox_pushgc(L);
+        lua_pushstring(L, "__gc");
+        lua_insert(L, -2);
+        lua_rawset(L, mt);
+        invalidateclasscache(L);
+        return;
+    }
+
+    lua_pop(L, 1);
+}
+
+static int ubox_set(ubox *box, int index, ubox_obj *obj)
+{
+    if (index >= box->size)
+    {
+        int size = box->size > 0 ? box->size : 256;
+
+        while (size <= index)
+        {
+            size <<= 1;
+        }
+
+        ubox_slot *slots = (ubox_slot*)realloc(box->slots, sizeof(ubox_slot) * size);
+
+        if (slots == NULL)
+        {
+            return 0;
+        }
+
+        memset(slots + box->size, 0, sizeof(ubox_slot) * (size - box->size));
+        box->slots = slots;
+        box->size = size;
+    }
+
+    ubox_slot *slot = &box->slots[index];
+    slot->obj = obj;
+    slot->state &= ~(UBOX_RELEASED | UBOX_FINALIZING);      //宿主还没取走就重新建了代理, 撤销这次释放
+    return ++slot->gen;
+}
+
+#if LUA_VERSION_NUM == 504
+/*5.4 没有标记等待 __gc 的位, 只能遍历 tobefnz. tobefnz 只在 atomic 阶段追加, 遍历一次把其中的代理记到槽位上,
+  之后按槽位判断. ubox 的 uservalue 是弱值表, [1] 放一个只被弱引用的哨兵, 下一次 atomic 会清掉它, 据此知道要重新遍历*/
+static bool ubox_finalizing(lua_State *L, ubox *box, int index)
+{
+    if (G(L)->tobefnz == NULL)
+    {
+        return false;
+    }
+
+    lua_getref(L, LUA_RIDX_UBOX);
+    lua_getiuservalue(L, -1, 1);                        //stack: ubox, weak
+
+    if (lua_rawgeti(L, -1, 1) == LUA_TNIL)
+    {
+        for (GCObject *o = G(L)->tobefnz; o != NULL; o = o->next)
+        {
+            if (o->tt != LUA_VUSERDATA || !ubox_checkobj(gco2u(o), UBOX_UDATA_SIZE))
+            {
+                continue;
+            }
+
+            int i = ((int*)getudatamem(gco2u(o)))[0];
+
+            if (i >= 0 && i < box->size && box->slots[i].obj == gco2u(o))
+            {
+                box->slots[i].state |= UBOX_FINALIZING;
+            }
+        }
+
+        lua_newtable(L);
+        lua_rawseti(L, -3, 1);
+    }
+
+    lua_pop(L, 3);
+    return (box->slots[index].state & UBOX_FINALIZING) != 0;
+}
+#endif
+
+static bool ubox_push(lua_State *L, ubox *box, int index)
+{
+    if (index < 0 || index >= box->size || box->slots[index].obj == NULL)
+    {
+        return false;
+    }
+
+    ubox_obj *obj = box->slots[index].obj;
+
+    if (ubox_finalizing(L, box, index))     //等待__gc的对象同弱表一样视为已回收
+    {
+        return false;
+    }
+
+    ubox_pushobj(L, obj);
+    return true;
+}
+
+static int ubox_free(lua_State *L)
+{
+    ubox *box = (ubox*)lua_touserdata(L, 1);
+    free(box->slots);
+    free(box->released);
+    memset(box, 0, sizeof(ubox));
+    return 0;
+}
+
+//验证对象布局和编译时的虚拟机一致
+static bool ubox_selftest(lua_State *L)
+{
+    bool flag = false;
+    int *udata = (int*)lua_newuserdata(L, UBOX_UDATA_SIZE);
+    ubox_obj *obj = ubox_toobj(udata);
+
+    if (ubox_checkobj(obj, UBOX_UDATA_SIZE))
+    {
+        ubox_pushobj(L, obj);
+        flag = lua_rawequal(L, -1, -2) ? true : false;
+        lua_pop(L, 1);
+    }
+
+    lua_pop(L, 1);
+
+    //驻留字符串同样按对象指针压栈
+    if (flag)
+    {
+        lua_pushstring(L, "tolua");
+        const char *s = lua_tostring(L, -1);
+        intern_pushobj(L, intern_toobj(s));
+        flag = lua_rawequal(L, -1, -2) && lua_tostring(L, -1) == s;
+        lua_pop(L, 2);
+    }
+
+    return flag;
+}
+#endif
+
+LUALIB_API bool tolua_pushudata(lua_State *L, int index)
+{
+	lua_getref(L, LUA_RIDX_UBOX);			// stack: ubox
+
+#ifdef TOLUA_NATIVE_UBOX
+    if (lua_isuserdata(L, -1))
+    {
+        ubox *box = (ubox*)lua_touserdata(L, -1);
+        lua_pop(L, 1);
+        return ubox_push(L, box, index);
+    }
+#endif
+
+	lua_rawgeti(L, -1, index); 				// stack: ubox, obj
+
+	if (!lua_isnil(L, -1))
+	{
+		lua_remove(L, -2); 					// stack: obj
+		return true;
+	}
+
+	lua_pop(L, 2);
+	return false;
+}
+
+LUALIB_API void tolua_pushnewudata(lua_State *L, int metaRef, int index)
+{
+	lua_getref(L, LUA_RIDX_UBOX);
+
+#ifdef TOLUA_NATIVE_UBOX
+    if (lua_isuserdata(L, -1))
+    {
+        ubox *box = (ubox*)lua_touserdata(L, -1);
+        lua_pop(L, 1);
+        int* udata = (int*)lua_newuserdata(L, UBOX_UDATA_SIZE);
+        lua_pushvalue(L, TOLUA_NOPEER);
+        lua_setfenv(L, -2);
+        udata[0] = index;
+        lua_getref(L, metaRef);
+        ubox_checkgc(L, abs_index(L, -1));
+        lua_setmetatable(L, -2);
+        udata[1] = ubox_set(box, index, ubox_toobj(udata));
+        return;
+    }
+#endif
+
+	tolua_newudata(L, index);
+	lua_getref(L, metaRef);
+	lua_setmetatable(L, -2);
+	lua_pushvalue(L, -1);
+	lua_rawseti(L, -3, index);
+	lua_remove(L, -2);	
+}
+
+/*开启后代理回收不再调用元表原来的 __gc, 索引进入释放队列. 退回弱表实现时不支持, 返回 false*/
+LUALIB_API bool tolua_setreleasequeue(lua_State *L, bool enable)
+{
+#ifdef TOLUA_NATIVE_UBOX
+    lua_getref(L, LUA_RIDX_UBOX);
+    ubox *box = lua_isuserdata(L, -1) ? (ubox*)lua_touserdata(L, -1) : NULL;
+    lua_pop(L, 1);
+
+    if (box != NULL)
+    {
+        box->queue = enable;
+        return true;
+    }
+#else
+    (void)L;
+#endif
+
+    return !enable;
+}
+
+//取出最多 max 个已回收代理的对象索引, 返回个数
+LUALIB_API int tolua_drainreleased(lua_State *L, int *out, int max)
+{
+    int n = 0;
+
+#ifdef TOLUA_NATIVE_UBOX
+    lua_getref(L, LUA_RIDX_UBOX);
+    ubox *box = lua_isuserdata(L, -1) ? (ubox*)lua_touserdata(L, -1) : NULL;
+    lua_pop(L, 1);
+
+    if (box == NULL)
+    {
+        return 0;
+    }
+
+    while (n < max && box->count > 0)
+    {
+        int index = box->released[box->head];
+        ubox_slot *slot = &box->slots[index];
+        box->head = (box->head + 1) & (box->capacity - 1);
+        --box->count;
+
+        if (slot->state & UBOX_RELEASED)
+        {
+            out[n++] = index;
+        }
+
+        slot->state = 0;
+    }
+#else
+    (void)L;
+    (void)out;
+    (void)max;
+#endif
+
+    return n;
+}
+
+static int module_index_event(lua_State *L)
+{    
+    lua_pushvalue(L, 2);                    //stack: t key key
+    lua_rawget(L, 1);                       //stack: t key value            
+
+    if (!lua_isnil(L, -1))
+    {
+        return 1;
+    }
+
+    lua_pop(L, 1);                          //stack: t key 
+    lua_pushstring(L, ".name");             //stack: t key ".name"
+    lua_rawget(L, 1);        
+
+    if (!lua_isnil(L, -1) && !_requirepreload(L, 1, 3, 2))    //stack: t key space
+    {                      
+        lua_pushnil(L);                            
+    }
+    
+    return 1;
+}
+
+void pushmodule(lua_State *L, const char *str)
+{    
+    stringbuffer *sb = &getcontext(L)->sb;
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+
+    if (sb->len > 0)
+    {
+        luaL_addlstring(&b, sb->buffer, sb->len);
+        luaL_addchar(&b, '.');
+    }
+
+    luaL_addstring(&b, str);
+    luaL_pushresult(&b);    
+    sb->buffer = lua_tolstring(L, -1, &sb->len);    
+}
+
+LUALIB_API bool tolua_beginmodule(lua_State *L, const char *name)
+{
+    if (name != NULL)
+    {                
+        lua_pushstring(L, name);			//stack key
+        lua_rawget(L, -2);					//stack value
+
+        if (lua_isnil(L, -1))  
+        {
+            lua_pop(L, 1);
+            lua_newtable(L);				//stack table
+
+            lua_pushstring(L, "__index");
+            lua_pushcfunction(L, module_index_event);
+            lua_rawset(L, -3);
+
+            lua_pushstring(L, name);        //stack table name         
+            lua_pushstring(L, ".name");     //stack table name ".name"            
+            pushmodule(L, name);            //stack table name ".name" module            
+            lua_rawset(L, -4);              //stack table name            
+            lua_pushvalue(L, -2);			//stack table name table
+            lua_rawset(L, -4);   			//stack table
+
+            lua_pushvalue(L, -1);
+            lua_setmetatable(L, -2);
+            return true;
+        }
+        else if (lua_istable(L, -1))
+        {
+            if (lua_getmetatable(L, -1) == 0)
+            {
+                lua_pushstring(L, "__index");
+                lua_pushcfunction(L, module_index_event);
+                lua_rawset(L, -3);
+
+                lua_pushstring(L, name);        //stack table name         
+                lua_pushstring(L, ".name");     //stack table name ".name"            
+                pushmodule(L, name);            //stack table name ".name" module            
+                lua_rawset(L, -4);              //stack table name            
+                lua_pushvalue(L, -2);           //stack table name table
+                lua_rawset(L, -4);              //stack table
+
+                lua_pushvalue(L, -1);
+                lua_setmetatable(L, -2);                    
+            }
+            else
+            {
+                stringbuffer *sb = &getcontext(L)->sb;
+                lua_pushstring(L, ".name");
+                lua_gettable(L, -3);      
+                sb->buffer = lua_tolstring(L, -1, &sb->len);                    
+                lua_pop(L, 2);
+            }
+
+            return true;
+        }
+
+        return false;
+    }
+    else
+    {                
+        lua_pushglobaltable(L);
+        return true;
+    }                
+}
+
+LUALIB_API void tolua_endmodule(lua_State *L)
+{
+    stringbuffer *sb = &getcontext(L)->sb;
+    lua_pop(L, 1);
+    int len = (int)sb->len;
+
+    while(len-- >= 0)
+    {
+        if (sb->buffer[len] == '.')
+        {
+            sb->len = len;
+            return;
+        }
+    }
+
+    sb->len = 0;
+}
+
+static int class_new_event(lua_State *L)
+{         
+    if (!lua_istable(L, 1))
+    {
+        return luaL_typerror(L, 1, "table");        
+    }
+
+    int count = lua_gettop(L); 
+    lua_pushvalue(L,1);  
+
+    if (lua_getmetatable(L,-1))
+    {   
+        lua_remove(L,-2);                      
+        lua_pushstring(L, "New");               
+        lua_rawget(L,-2);    
+
+        if (lua_isfunction(L,-1))
+        {            
+            for (int i = 2; i <= count; i++)
+            {
+                lua_pushvalue(L, i);                    
+            }
+
+            lua_call(L, count - 1, 1);
+            return 1;
+        }
+
+        lua_settop(L,3);
+    }    
+
+    return luaL_error(L,"attempt to perform ctor operation failed");    
+}
+
+static void _pushfullname(lua_State *L, int pos)
+{
+    stringbuffer *sb = &getcontext(L)->sb;
+
+    if (sb->len > 0)
+    {
+        lua_pushlstring(L, sb->buffer, sb->len);
+        lua_pushstring(L, ".");
+        lua_pushvalue(L,  pos < 0 ? pos - 2 : pos + 2);
+        lua_concat(L, 3);
+    }
+    else
+    {
+        lua_pushvalue(L, pos);
+    }
+}
+
+static void _addtoloaded(lua_State *L)
+{
+    lua_getref(L, LUA_RIDX_LOADED);
+    _pushfullname(L, -3);
+    lua_pushvalue(L, -3);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+}
+
+static int _beginclass(lua_State *L, const char *name, int baseType, int ref, int nrec)
+{
+    int reference = ref;
+    lua_pushstring(L, name);                
+    lua_newtable(L);      
+    _addtoloaded(L);
+
+    if (ref == LUA_REFNIL)        
+    {
+        lua_createtable(L, 0, nrec);
+        lua_pushvalue(L, -1);
+        reference = luaL_ref(L, LUA_REGISTRYINDEX); 
+    }
+    else
+    {
+        lua_getref(L, reference);    
+    }
+
+    if (baseType != 0)
+    {
+        lua_getref(L, baseType);        
+        lua_setmetatable(L, -2);
+        invalidateclasscache(L);
+    }
+           
+    lua_pushlightuserdata(L, &tag);
+    lua_pushnumber(L, 1);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, ".name");
+    _pushfullname(L, -4);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, ".ref");
+    lua_pushinteger(L, reference);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "__call");
+    lua_pushcfunction(L, class_new_event);
+    lua_rawset(L, -3);
+
+    tolua_setindex(L);
+    tolua_setnewindex(L); 
+    return reference;
+}
+
+LUALIB_API int tolua_beginclass(lua_State *L, const char *name, int baseType, int ref)
+{
+    return _beginclass(L, name, baseType, ref, 0);
+}
+
+
+LUALIB_API void tolua_endclass(lua_State *L)
+{
+	lua_setmetatable(L, -2);
+    lua_rawset(L, -3);            
+}
+
+/*void settablename(lua_State *L, const char *label, const char *name)
+{
+    lua_pushstring(L, "name");
+    char cname[128];
+    int l1 = strlen(label);
+    int l2 = strlen(name)    ;
+    strncat(cname, label, 128 - l1);
+    strncat(cname, name, 128 - l1 - l2);
+    lua_pushstring(L, cname);
+    lua_rawset(L, -3);
+}*/
+
+LUALIB_API int tolua_beginenum(lua_State *L, const char *name)
+{
+	lua_pushstring(L, name);                               
+    lua_newtable(L);                                       
+    _addtoloaded(L);
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    int reference = luaL_ref(L, LUA_REGISTRYINDEX);            
+    lua_pushlightuserdata(L, &tag);
+    lua_pushnumber(L, 1);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, ".name");
+    _pushfullname(L, -4);  
+    lua_rawset(L, -3);
+
+	lua_pushstring(L, "__index");
+	lua_pushcfunction(L, enum_index_event);
+	lua_rawset(L, -3);
+
+	lua_pushstring(L, "__newindex");
+	lua_pushcfunction(L, enum_newindex_event);
+	lua_rawset(L, -3);	
+
+	return reference;
+}
+
+LUALIB_API void tolua_endenum(lua_State *L)
+{
+	lua_setmetatable(L, -2);
+    lua_rawset(L, -3);    
+}
+
+LUALIB_API void tolua_beginstaticclass(lua_State *L, const char *name)
+{    
+    lua_pushstring(L, name);  
+    lua_newtable(L);
+    _addtoloaded(L);
+    lua_pushvalue(L, -1);
+
+    lua_pushlightuserdata(L, &tag);
+    lua_pushnumber(L, 1);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, ".name");
+    _pushfullname(L, -4);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "__index");
+    lua_pushcfunction(L, static_index_event);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "__newindex");
+    lua_pushcfunction(L, static_newindex_event);
+    lua_rawset(L, -3);      
+}
+
+LUALIB_API void tolua_endstaticclass(lua_State *L)
+{
+    lua_setmetatable(L, -2);
+    lua_rawset(L, -3);    
+}
+
+LUALIB_API void tolua_constant(lua_State *L, const char *name, double value)
+{
+    lua_pushstring(L, name);
+    lua_pushnumber(L, value);
+    lua_rawset(L,-3);
+    invalidateclasscache(L);
+}
+
+LUALIB_API void tolua_function(lua_State *L, const char *name, lua_CFunction fn)
+{
+  	lua_pushstring(L, name);
+    _pushbinding(L, -2, NULL, name, fn);
+#ifdef TOLUA_NATIVE_UBOX
+    if (strcmp(name, "__gc") == 0)
+    {
+        ubox_pushgc(L);
+    }
+#endif
+  	lua_rawset(L, -3);
+    invalidateclasscache(L);
+
+    /*lua_pushstring(L, name);
+    lua_pushcfunction(L, fn);
+    lua_rawset(L, -3);*/
+}
+
+#if LUA_VERSION_NUM == 501
+LUALIB_API void tolua_bind_enum_equal(lua_State *L, lua_CFunction fn)
+{
+    lua_pushglobaltable(L);                                   //stack _G
+  	lua_pushstring(L, "__$enum_equal_func");
+    tolua_pushcfunction(L, fn);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+}
+
+LUALIB_API void tolua_push_enum_equal(lua_State *L, const char *name)
+{
+  	lua_pushstring(L, name);
+    lua_pushglobaltable(L);                                   //stack _G
+    lua_pushstring(L, "__$enum_equal_func");
+    lua_rawget(L, -2);
+    lua_remove(L, -2);
+  	lua_rawset(L, -3);
+}
+#endif
+
+LUALIB_API void tolua_variable(lua_State *L, const char *name, lua_CFunction get, lua_CFunction set)
+{                
+    lua_pushlightuserdata(L, &gettag);
+    lua_rawget(L, -2);
+
+    if (!lua_istable(L, -1))
+    {
+        /* create .get table, leaving it at the top */
+        lua_pop(L, 1);
+        lua_newtable(L);        
+        setaccessormeta(L);
+        lua_pushlightuserdata(L, &gettag);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, -4);
+    }
+
+    lua_pushstring(L, name);
+    //lua_pushcfunction(L, get);
+    _pushbinding(L, -3, "get_", name, get);
+    lua_rawset(L, -3);                  /* store variable */
+    lua_pop(L, 1);                      /* pop .get table */
+
+    /* set func */
+    if (set != NULL)
+    {        
+        lua_pushlightuserdata(L, &settag);
+        lua_rawget(L, -2);
+
+        if (!lua_istable(L, -1))
+        {
+            /* create .set table, leaving it at the top */
+            lua_pop(L, 1);
+            lua_newtable(L);            
+            setaccessormeta(L);
+            lua_pushlightuserdata(L, &settag);
+            lua_pushvalue(L, -2);
+            lua_rawset(L, -4);
+        }
+
+        lua_pushstring(L, name);
+        //lua_pushcfunction(L, set);
+        _pushbinding(L, -3, "set_", name, set);
+        lua_rawset(L, -3);                  /* store variable */
+        lua_pop(L, 1);                      /* pop .set table */
+    }
+
+    invalidateclasscache(L);
+}
+
+//stack: mt, 取出或按 nrec 预分配 mt[tag] 访问器表, 留在栈顶
+static void _pushaccessors(lua_State *L, void *key, int nrec)
+{
+    lua_pushlightuserdata(L, key);
+    lua_rawget(L, -2);
+
+    if (!lua_istable(L, -1))
+    {
+        lua_pop(L, 1);
+        lua_createtable(L, 0, nrec);
+        setaccessormeta(L);
+        lua_pushlightuserdata(L, key);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, -4);
+    }
+}
+
+//stack: module, 等同 tolua_beginclass ... tolua_endclass, 各表按描述的成员数预分配
+LUALIB_API int tolua_regclass(lua_State *L, const tolua_Class *c)
+{
+    int nset = 0;
+
+    for (int i = 0; i < c->nvars; i++)
+    {
+        nset += c->vars[i].set != NULL ? 1 : 0;
+    }
+
+    //tag .name .ref __call __index __newindex gettag settag
+    int reference = _beginclass(L, c->name, c->baseType, c->ref, c->nfuncs + c->nconsts + 8);
+
+    for (int i = 0; i < c->nfuncs; i++)
+    {
+        lua_pushstring(L, c->funcs[i].name);
+        _pushbinding(L, -2, NULL, c->funcs[i].name, c->funcs[i].func);
+#ifdef TOLUA_NATIVE_UBOX
+        if (strcmp(c->funcs[i].name, "__gc") == 0)
+        {
+            ubox_pushgc(L);
+        }
+#endif
+        lua_rawset(L, -3);
+    }
+
+    if (c->nvars > 0)
+    {
+        _pushaccessors(L, &gettag, c->nvars);           //stack: mt get
+
+        for (int i = 0; i < c->nvars; i++)
+        {
+            lua_pushstring(L, c->vars[i].name);
+            _pushbinding(L, -3, "get_", c->vars[i].name, c->vars[i].get);
+            lua_rawset(L, -3);
+        }
+
+        lua_pop(L, 1);
+    }
+
+    if (nset > 0)
+    {
+        _pushaccessors(L, &settag, nset);               //stack: mt set
+
+        for (int i = 0; i < c->nvars; i++)
+        {
+            if (c->vars[i].set != NULL)
+            {
+                lua_pushstring(L, c->vars[i].name);
+                _pushbinding(L, -3, "set_", c->vars[i].name, c->vars[i].set);
+                lua_rawset(L, -3);
+            }
+        }
+
+        lua_pop(L, 1);
+    }
+
+    for (int i = 0; i < c->nconsts; i++)
+    {
+        lua_pushstring(L, c->consts[i].name);
+        lua_pushnumber(L, c->consts[i].value);
+        lua_rawset(L, -3);
+    }
+
+    invalidateclasscache(L);
+    tolua_endclass(L);
+    return reference;
+}
+
+//stack: module, 注册一批类, refs 返回各类引用. baseType 可以是同批次前面的类 -(i + 1)
+LUALIB_API void tolua_regclasses(lua_State *L, const tolua_Class *classes, int count, int *refs)
+{
+    for (int i = 0; i < count; i++)
+    {
+        tolua_Class c = classes[i];
+
+        if (c.baseType < 0)
+        {
+            int base = -c.baseType - 1;
+            c.baseType = base < i ? refs[base] : 0;
+        }
+
+        refs[i] = tolua_regclass(L, &c);
+    }
+}
+
+/*toluaL_ref 引用表: 同一对象只占一个registry引用, 按对象指针去重. 与原来的约定相同, toluaL_ref 取多少次都只算一份,
+  一次 toluaL_unref 即释放. owner 引用每次单独计数, 由 toluaL_ownerunref/toluaL_unrefowner 释放,
+  计数归零才释放 registry 引用. 已释放或未知的引用再次 unref 直接忽略, 不会破坏 registry 的空闲链*/
+#define REF_NUMTYPES (LUA_TTHREAD + 1)
+
+typedef struct refentry
+{
+    const void *ptr;
+    int count;                  //owner 引用数, 加上 held 的一份
+    int type;
+    bool held;                  //被 toluaL_ref 取过, 还没 toluaL_unref
+} refentry;
+
+typedef struct refowner
+{
+    int owner;
+    int *refs;
+    int count;
+    int cap;
+} refowner;
+
+typedef struct refmap
+{
+    refentry *entries;          //按ref下标
+    int size;
+    int *hash;                  //ptr -> ref, 线性探测, 0为空
+    int hashcap;
+    int hashcount;
+    refowner *owners;           //owner -> refs, owner为0表示空
+    int ownercap;
+    int ownercount;
+    int live[REF_NUMTYPES];
+} refmap;
+
+static unsigned int refhash(const void *ptr)
+{
+    uintptr_t h = (uintptr_t)ptr;
+    h ^= h >> 16;
+    h *= 0x45d9f3b;
+    h ^= h >> 16;
+    return (unsigned int)h;
+}
+
+static refmap* getrefmap(lua_State *L)
+{
+    lua_getref(L, LUA_RIDX_FIXEDMAP);
+    refmap *map = (refmap*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    return map;
+}
+
+static int refmap_find(refmap *map, const void *ptr, int type)
+{
+    if (map->hashcap == 0)
+    {
+        return 0;
+    }
+
+    unsigned int mask = map->hashcap - 1;
+
+    for (unsigned int i = refhash(ptr) & mask; map->hash[i] != 0; i = (i + 1) & mask)
+    {
+        refentry *e = &map->entries[map->hash[i]];
+
+        if (e->ptr == ptr && e->type == type)
+        {
+            return map->hash[i];
+        }
+    }
+
+    return 0;
+}
+
+static void refmap_insert(refmap *map, int ref)
+{
+    unsigned int mask = map->hashcap - 1;
+    unsigned int i = refhash(map->entries[ref].ptr) & mask;
+
+    while (map->hash[i] != 0)
+    {
+        i = (i + 1) & mask;
+    }
+
+    map->hash[i] = ref;
+    ++map->hashcount;
+}
+
+static bool refmap_growhash(refmap *map)
+{
+    if ((map->hashcount + 1) * 4 < map->hashcap * 3)
+    {
+        return true;
+    }
+
+    int *old = map->hash;
+    int oldcap = map->hashcap;
+    int cap = oldcap > 0 ? oldcap * 2 : 256;
+    int *hash = (int*)calloc(cap, sizeof(int));
+
+    if (hash == NULL)
+    {
+        return false;
+    }
+
+    map->hash = hash;
+    map->hashcap = cap;
+    map->hashcount = 0;
+
+    for (int i = 0; i < oldcap; i++)
+    {
+        if (old[i] != 0)
+        {
+            refmap_insert(map, old[i]);
+        }
+    }
+
+    free(old);
+    return true;
+}
+
+static void refmap_remove(refmap *map, int ref)
+{
+    unsigned int mask = map->hashcap - 1;
+    unsigned int i = refhash(map->entries[ref].ptr) & mask;
+
+    while (map->hash[i] != ref)
+    {
+        i = (i + 1) & mask;
+    }
+
+    //backward shift deletion
+    for (unsigned int j = (i + 1) & mask; map->hash[j] != 0; j = (j + 1) & mask)
+    {
+        unsigned int k = refhash(map->entries[map->hash[j]].ptr) & mask;
+
+        if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j)))
+        {
+            map->hash[i] = map->hash[j];
+            i = j;
+        }
+    }
+
+    map->hash[i] = 0;
+    --map->hashcount;
+}
+
+static bool refmap_reserve(refmap *map, int ref)
+{
+    if (ref < map->size)
+    {
+        return true;
+    }
+
+    int size = map->size > 0 ? map->size : 256;
+
+    while (size <= ref)
+    {
+        size <<= 1;
+    }
+
+    refentry *entries = (refentry*)realloc(map->entries, sizeof(refentry) * size);
+
+    if (entries == NULL)
+    {
+        return false;
+    }
+
+    memset(entries + map->size, 0, sizeof(refentry) * (size - map->size));
+    map->entries = entries;
+    map->size = size;
+    return true;
+}
+
+static refowner* refmap_getowner(refmap *map, int owner, bool create)
+{
+    if (map->ownercap > 0)
+    {
+        unsigned int mask = map->ownercap - 1;
+
+        for (unsigned int i = refhash((void*)(intptr_t)owner) & mask; map->owners[i].owner != 0; i = (i + 1) & mask)
+        {
+            if (map->owners[i].owner == owner)
+            {
+                return &map->owners[i];
+            }
+        }
+    }
+
+    if (!create)
+    {
+        return NULL;
+    }
+
+    if ((map->ownercount + 1) * 4 >= map->ownercap * 3)
+    {
+        refowner *old = map->owners;
+        int oldcap = map->ownercap;
+        int cap = oldcap > 0 ? oldcap * 2 : 64;
+        refowner *owners = (refowner*)calloc(cap, sizeof(refowner));
+
+        if (owners == NULL)
+        {
+            return NULL;
+        }
+
+        map->owners = owners;
+        map->ownercap = cap;
+
+        for (int i = 0; i < oldcap; i++)
+        {
+            if (old[i].owner != 0)
+            {
+                unsigned int j = refhash((void*)(intptr_t)old[i].owner) & (cap - 1);
+
+                while (owners[j].owner != 0)
+                {
+                    j = (j + 1) & (cap - 1);
+                }
+
+                owners[j] = old[i];
+            }
+        }
+
+        free(old);
+    }
+
+    unsigned int mask = map->ownercap - 1;
+    unsigned int i = refhash((void*)(intptr_t)owner) & mask;
+
+    while (map->owners[i].owner != 0)
+    {
+        i = (i + 1) & mask;
+    }
+
+    map->owners[i].owner = owner;
+    ++map->ownercount;
+    return &map->owners[i];
+}
+
+static void refmap_removeowner(refmap *map, refowner *o)
+{
+    unsigned int mask = map->ownercap - 1;
+    unsigned int i = (unsigned int)(o - map->owners);
+    free(o->refs);
+    memset(o, 0, sizeof(refowner));
+
+    for (unsigned int j = (i + 1) & mask; map->owners[j].owner != 0; j = (j + 1) & mask)
+    {
+        unsigned int k = refhash((void*)(intptr_t)map->owners[j].owner) & mask;
+
+        if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j)))
+        {
+            map->owners[i] = map->owners[j];
+            memset(&map->owners[j], 0, sizeof(refowner));
+            i = j;
+        }
+    }
+
+    --map->ownercount;
+}
+
+static int refmap_free(lua_State *L)
+{
+    refmap *map = (refmap*)lua_touserdata(L, 1);
+
+    for (int i = 0; i < map->ownercap; i++)
+    {
+        free(map->owners[i].refs);
+    }
+
+    free(map->entries);
+    free(map->hash);
+    free(map->owners);
+    memset(map, 0, sizeof(refmap));
+    return 0;
+}
+
+static int refmap_acquire(lua_State *L, bool owned)
+{
+	int stackPos = abs_index(L, -1);
+    refmap *map = getrefmap(L);
+    int type = lua_type(L, stackPos);
+    const void *ptr = lua_topointer(L, stackPos);
+    int ref = ptr != NULL ? refmap_find(map, ptr, type) : 0;
+
+    if (ref == 0)
+    {
+        ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+        if (ref <= 0)
+        {
+            return ref;
+        }
+
+        if (!refmap_reserve(map, ref) || (ptr != NULL && !refmap_growhash(map)))
+        {
+            luaL_unref(L, LUA_REGISTRYINDEX, ref);
+            return luaL_error(L, "not enough memory");
+        }
+
+        refentry *e = &map->entries[ref];
+        e->ptr = ptr;
+        e->type = type;
+        ++map->live[type];
+
+        if (ptr != NULL)
+        {
+            refmap_insert(map, ref);
+        }
+    }
+    else
+    {
+        lua_pop(L, 1);
+    }
+
+    refentry *e = &map->entries[ref];
+
+    if (owned)
+    {
+        ++e->count;
+    }
+    else if (!e->held)
+    {
+        e->held = true;
+        ++e->count;
+    }
+
+    return ref;
+}
+
+static void refmap_release(lua_State *L, int reference, bool owned)
+{
+    refmap *map = getrefmap(L);
+
+    if (reference <= 0 || reference >= map->size || map->entries[reference].count <= 0)
+    {
+        return;
+    }
+
+    refentry *e = &map->entries[reference];
+
+    if (!owned)
+    {
+        if (!e->held)
+        {
+            return;
+        }
+
+        e->held = false;
+    }
+    else if (e->count <= (e->held ? 1 : 0))
+    {
+        return;
+    }
+
+    if (--e->count > 0)
+    {
+        return;
+    }
+
+    if (e->ptr != NULL)
+    {
+        refmap_remove(map, reference);
+    }
+
+    --map->live[e->type];
+    memset(e, 0, sizeof(refentry));
+	luaL_unref(L, LUA_REGISTRYINDEX, reference);
+}
+
+LUALIB_API int toluaL_ref(lua_State *L)
+{
+    return refmap_acquire(L, false);
+}
+
+LUALIB_API void toluaL_unref(lua_State *L, int reference)
+{
+    refmap_release(L, reference, false);
+}
+
+//引用栈顶对象, 记在owner名下
+LUALIB_API int toluaL_ownerref(lua_State *L, int owner)
+{
+    if (owner == 0)
+    {
+        return toluaL_ref(L);
+    }
+
+    int ref = refmap_acquire(L, true);
+
+    if (ref <= 0)
+    {
+        return ref;
+    }
+
+    refowner *o = refmap_getowner(getrefmap(L), owner, true);
+
+    if (o != NULL && o->count == o->cap)
+    {
+        int cap = o->cap > 0 ? o->cap * 2 : 4;
+        int *refs = (int*)realloc(o->refs, sizeof(int) * cap);
+
+        if (refs == NULL)
+        {
+            o = NULL;
+        }
+        else
+        {
+            o->refs = refs;
+            o->cap = cap;
+        }
+    }
+
+    if (o == NULL)
+    {
+        refmap_release(L, ref, true);
+        return luaL_error(L, "not enough memory");
+    }
+
+    o->refs[o->count++] = ref;
+    return ref;
+}
+
+LUALIB_API void toluaL_ownerunref(lua_State *L, int owner, int reference)
+{
+    refowner *o = refmap_getowner(getrefmap(L), owner, false);
+
+    if (o != NULL)
+    {
+        for (int i = o->count - 1; i >= 0; i--)
+        {
+            if (o->refs[i] == reference)
+            {
+                o->refs[i] = o->refs[--o->count];
+                refmap_release(L, reference, true);
+                return;
+            }
+        }
+    }
+}
+
+//释放owner持有的全部引用, 返回释放次数
+LUALIB_API int toluaL_unrefowner(lua_State *L, int owner)
+{
+    refmap *map = getrefmap(L);
+    refowner *o = refmap_getowner(map, owner, false);
+
+    if (o == NULL)
+    {
+        return 0;
+    }
+
+    int count = o->count;
+    int *refs = o->refs;
+    o->refs = NULL;
+    refmap_removeowner(map, o);
+
+    for (int i = 0; i < count; i++)
+    {
+        refmap_release(L, refs[i], true);
+    }
+
+    free(refs);
+    return count;
+}
+
+LUALIB_API int toluaL_refcount(lua_State *L, int reference)
+{
+    refmap *map = getrefmap(L);
+
+    if (reference > 0 && reference < map->size)
+    {
+        return map->entries[reference].count;
+    }
+
+    return 0;
+}
+
+//stats[type] 为该lua类型的存活引用数, 返回存活引用总数
+LUALIB_API int toluaL_refstats(lua_State *L, int *stats, int n)
+{
+    refmap *map = getrefmap(L);
+    int total = 0;
+
+    for (int i = 0; i < REF_NUMTYPES; i++)
+    {
+        if (i < n)
+        {
+            stats[i] = map->live[i];
+        }
+
+        total += map->live[i];
+    }
+
+    return total;
+}
+
+LUA_API lua_State* tolua_getmainstate(lua_State *L1)
+{
+	lua_rawgeti(L1, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+	lua_State *L = lua_tothread(L1, -1);
+	lua_pop(L1, 1);
+	return L;
+}
+
+//和 lua 的 GetLuaValueType 一样按元表查类型, 元表 -> 类型 的映射在 tolua_openvaluetype 时建好
+LUA_API int tolua_getvaluetype(lua_State *L, int stackPos)
+{
+	stackPos = abs_index(L, stackPos);
+
+    tolua_context *ctx = getcontext(L);
+
+    if (ctx->valuetypes > 0)
+    {
+        if (lua_getmetatable(L, stackPos) == 0)
+        {
+            return 0;
+        }
+
+        const void *mt = lua_topointer(L, -1);
+        lua_pop(L, 1);
+
+        for (int i = 0; i < ctx->valuetypes; i++)
+        {
+            if (ctx->valuetypemeta[i] == mt)
+            {
+                return ctx->valuetypeid[i];
+            }
+        }
+
+        return 0;
+    }
+
+	lua_getref(L, LUA_RIDX_CHECKVALUE);
+	lua_pushvalue(L, stackPos);
+	lua_call(L, 1, 1);
+	int ret = (int)lua_tonumber(L, -1);
+	lua_pop(L, 1);
+	return ret;
+}
+
+LUALIB_API bool tolua_createtable(lua_State *L, const char *path, int szhint)
+{
+	const char *e = NULL;
+	lua_pushglobaltable(L);						            //stack _G
+
+	do 
+	{
+	  e = strchr(path, '.');
+	  if (e == NULL) e = path + strlen(path);
+	  lua_pushlstring(L, path, e - path);					//stack _G key
+	  lua_rawget(L, -2);									//stack _G value
+	  int type = lua_type(L, -1);
+
+	  if (type == LUA_TNIL) 
+	  {  
+	    lua_pop(L, 1); 										//stack _G
+	    lua_createtable(L, 0, (*e == '.' ? 1 : szhint));	//stack _G table
+	    lua_pushlstring(L, path, e - path);					//stack _G table name
+	    lua_pushvalue(L, -2);								//stack _G table name table
+	    lua_settable(L, -4);  								//stack _G table
+	  }
+	  else if (type != LUA_TTABLE) 
+	  {  
+	    lua_pop(L, 2);  
+	    return false;  
+	  }
+
+	  lua_remove(L, -2);  									//stack table
+	  path = e + 1;
+	} while (*e == '.');
+
+	return true;
+}
+
+LUALIB_API bool tolua_beginpremodule(lua_State *L, const char *path, int szhint)
+{
+    const char *e = NULL;
+    const char *name = path;
+    lua_pushglobaltable(L);                                   //stack _G
+
+    do 
+    {
+        e = strchr(path, '.');
+        if (e == NULL) e = path + strlen(path);
+        lua_pushlstring(L, path, e - path);                   //stack t key
+        lua_rawget(L, -2);                                    //stack t value
+        int type = lua_type(L, -1);
+
+        if (type == LUA_TNIL) 
+        {
+            lua_pop(L, 1);                                      //stack t
+            lua_createtable(L, 0, (*e == '.' ? 1 : szhint));    //stack t table
+            lua_pushlstring(L, path, e - path);                 //stack t table name
+            lua_pushvalue(L, -2);                               //stack t table name table
+            lua_settable(L, -4);                                //stack t table
+
+            lua_pushstring(L, ".name");        
+            pushmodule(L, name);
+            lua_rawset(L, -3);               
+
+            lua_pushstring(L, "__index");
+            lua_pushcfunction(L, module_index_event);
+            lua_rawset(L, -3);    
+        }
+        else if (type != LUA_TTABLE) 
+        {  
+            lua_pop(L, 1);  
+            return false;  
+        }
+
+        lua_remove(L, -2);                                    //stack table
+        path = e + 1;
+    } while (*e == '.');
+
+    stringbuffer *sb = &getcontext(L)->sb;
+    lua_pushstring(L, ".name");
+    lua_gettable(L, -2);      
+    sb->buffer = lua_tolstring(L, -1, &sb->len);    
+    lua_pop(L, 1);
+    return true;
+}
+
+LUALIB_API bool tolua_endpremodule(lua_State *L, int ref)
+{    
+    lua_getref(L, ref);
+    lua_pushstring(L, ".name");
+    lua_rawget(L, -2);                
+
+    if (!tolua_createtable(L, lua_tostring(L, -1), 0))
+    {
+        lua_pushnil(L);
+    }
+    
+    getcontext(L)->sb.len = 0;
+    return true;
+}
+
+LUALIB_API bool tolua_addpreload(lua_State *L, const char *path)
+{    
+    const char *e = NULL;
+    const char *name = path;
+    int top = lua_gettop(L);
+    lua_pushglobaltable(L);                                     //stack _G
+
+    do 
+    {
+        e = strchr(path, '.');
+        if (e == NULL) e = path + strlen(path);
+        lua_pushlstring(L, path, e - path);                     //stack t key
+        lua_rawget(L, -2);                                      //stack t value
+        int type = lua_type(L, -1);
+
+        if (type == LUA_TNIL) 
+        {
+            lua_pop(L, 1);                                      //stack t
+            lua_createtable(L, 0, 0);                           //stack t table
+            lua_pushlstring(L, path, e - path);                 //stack t table name
+            lua_pushvalue(L, -2);                               //stack t table name table
+            lua_settable(L, -4);                                //stack t table
+
+            lua_pushstring(L, ".name");        
+            lua_pushstring(L, name);
+            lua_rawset(L, -3);               
+
+            lua_pushstring(L, "__index");
+            lua_pushcfunction(L, module_index_event);
+            lua_rawset(L, -3);    
+        }
+        else if (type != LUA_TTABLE) 
+        {  
+            lua_settop(L, top);
+            return false;  
+        }
+
+        lua_remove(L, -2);                                      //stack table
+        path = e + 1;
+    } while (*e == '.');
+
+    ++getcontext(L)->preloadversion;
+    lua_settop(L, top);
+    return true;
+}
+
+LUALIB_API int tolua_getclassref(lua_State *L, int pos)
+{    
+    lua_getmetatable(L, pos);           //mt
+    lua_pushstring(L, ".ref");          //mt .ref
+    lua_rawget(L, -2);                  //mt ref
+    int ref = (int)lua_tointeger(L, -1);         
+    return ref;
+}
+
+LUALIB_API bool tolua_pushluatable(lua_State *L, const char *path)
+{
+	const char *e = NULL;
+	lua_pushglobaltable(L);	
+
+	do 
+	{
+	  e = strchr(path, '.');
+	  if (e == NULL) e = path + strlen(path);
+	  lua_pushlstring(L, path, e - path);
+	  lua_rawget(L, -2);
+
+	  if (!lua_istable(L, -1))
+	  {  
+	    lua_pop(L, 2); 
+	    return false;
+	  }
+
+	  lua_remove(L, -2);  
+	  path = e + 1;
+	} while (*e == '.');
+
+	return true;
+}
+
+LUALIB_API const char* tolua_typename(lua_State *L, int lo)
+{
+    int tag = lua_type(L,lo);
+    
+    if (tag == LUA_TNONE)
+    {
+		lua_pushstring(L,"[no object]");
+    }
+    else if (tag != LUA_TUSERDATA && tag != LUA_TTABLE)
+    {
+        lua_pushstring(L, lua_typename(L,tag));
+    }
+    else if (tag == LUA_TUSERDATA)
+    {
+        if (!lua_getmetatable(L,lo))
+        {
+            lua_pushstring(L, lua_typename(L,tag));
+        }
+        else
+        {
+            lua_pushstring(L, ".name");
+            lua_rawget(L, -2);
+
+            if (!lua_isstring(L,-1))
+            {
+                lua_pop(L,1);
+                lua_pushstring(L,"[undefined]");
+            }
+        }
+    }
+    else  //is table
+    {
+        lua_pushvalue(L,lo);        
+
+        if (!lua_getmetatable(L,lo))
+        {
+            lua_pop(L,1);
+            lua_pushstring(L,"table");
+        }
+        else
+        {
+            lua_pushstring(L, ".name");
+            lua_rawget(L, -2);
+
+            lua_pushstring(L,"class ");
+            lua_insert(L,-2);
+            lua_concat(L,2);
+        }
+    }
+
+    return lua_tostring(L, -1);
+}
+
+LUALIB_API int tolua_getmetatableref(lua_State *L, int pos)
+{
+	int ref = LUA_REFNIL;	
+
+    if (lua_getmetatable(L, pos) != 0)
+    {
+        lua_pushstring(L, ".ref");
+        lua_rawget(L, -2);	
+
+        if (lua_isnumber(L, -1))
+        {
+            ref = (int)lua_tointeger(L, -1);
+        }
+
+        lua_pop(L, 2);
+    }
+
+    return ref;
+}
+
+static lua_State* getthread(lua_State *L, int *arg) 
+{
+    if (lua_isthread(L, 1)) 
+    {
+        *arg = 1;
+        return lua_tothread(L, 1);
+    }
+    else 
+    {
+        *arg = 0;
+        return L;  
+    }
+}
+
+static int traceback(lua_State *L) 
+{
+    int arg;
+    lua_State *L1 = getthread(L, &arg);
+    const char *msg = lua_tostring(L, arg + 1);
+
+    if (msg == NULL && !lua_isnoneornil(L, arg + 1))  
+    {
+        lua_pushvalue(L, arg + 1);  
+    }
+    else 
+    {
+        if (NULL != strstr(msg, "stack traceback:"))
+        {
+            lua_pushvalue(L, arg + 1);
+            return 1;
+        }
+
+        int level = (int)luaL_optinteger(L, arg + 2, (L == L1) ? 1 : 0);
+//#ifdef LUAJIT_VERSION
+        luaL_traceback(L, L1, msg, level);
+//#else
+//        lua_getref(L, LUA_RIDX_TRACEBACK);
+//        lua_pushthread(L1);
+//        lua_pushvalue(L, arg + 1);
+//        lua_pushnumber(L, level + 1);
+//        lua_call(L, 3, 1);
+//#endif
+    }     
+
+    return 1;
+}
+
+/*延迟格式化的错误处理函数. 出错时只记下每层的函数和当前行, 消息原样返回,
+  宿主真要看调用栈时再用 tolua_errortraceback 拼字符串. upvalue 1: 记录各层函数的弱值表, [0] 为消息; upvalue 2: errtrace*/
+#define TRACE_FRAMES 24
+
+typedef struct errtrace
+{
+    int n;
+    int depth;                  //记录时的总层数
+    bool truncated;
+    int lines[TRACE_FRAMES];
+} errtrace;
+
+/*已知 level 层存在, 返回最深一层的层号. lua_getstack 本身按层数线性走, 逐层探测是 O(n^2),
+  这里和 lauxlib 的 lastlevel 一样先倍增再二分*/
+static int lazy_stackdepth(lua_State *L, int level)
+{
+    lua_Debug ar;
+    int li = level + 1, le = level + 1;
+
+    while (lua_getstack(L, le, &ar))
+    {
+        li = le;
+        le *= 2;
+    }
+
+    while (li < le)
+    {
+        int m = (li + le) / 2;
+
+        if (lua_getstack(L, m, &ar))
+        {
+            li = m + 1;
+        }
+        else
+        {
+            le = m;
+        }
+    }
+
+    return le - 1;
+}
+
+/*和上次记录的是同一个值时, 判断是不是内层处理后再抛出: 抛出的函数必须在记录的栈上, 即比记录时浅,
+  且同一深度上是同一个函数. 字符串会被复用, 不同路径抛出的同样消息不算*/
+static bool lazy_isrethrow(lua_State *L, errtrace *t)
+{
+    lua_Debug ar;
+    int depth = lazy_stackdepth(L, 0);
+    int level = depth >= 2 ? 2 : 1;                     //第1层通常是 error 本身
+    int off = t->depth - depth;
+
+    if (off <= 0 || level + off > t->n || !lua_getstack(L, level, &ar))
+    {
+        return false;
+    }
+
+    lua_getinfo(L, "f", &ar);
+    lua_rawgeti(L, lua_upvalueindex(1), level + off);
+    bool flag = lua_rawequal(L, -1, -2) != 0;
+    lua_pop(L, 2);
+    return flag;
+}
+
+static int lazytraceback(lua_State *L)
+{
+    errtrace *t = (errtrace*)lua_touserdata(L, lua_upvalueindex(2));
+    lua_settop(L, 1);
+    lua_rawgeti(L, lua_upvalueindex(1), 0);
+
+    //同一个错误被内层处理后再抛出, 保留最内层的栈
+    if (lua_rawequal(L, 1, 2) && !lua_isnil(L, 1) && lazy_isrethrow(L, t))
+    {
+        lua_pop(L, 1);
+        return 1;
+    }
+
+    lua_pop(L, 1);
+    lua_Debug ar;
+    int n = 0;
+
+    while (n < TRACE_FRAMES && lua_getstack(L, n + 1, &ar))
+    {
+        lua_getinfo(L, "fl", &ar);
+        lua_rawseti(L, lua_upvalueindex(1), n + 1);
+        t->lines[n++] = ar.currentline;
+    }
+
+    t->depth = lazy_stackdepth(L, n);
+    t->truncated = t->depth > n;
+
+    for (int i = n; i < t->n; i++)
+    {
+        lua_pushnil(L);
+        lua_rawseti(L, lua_upvalueindex(1), i + 1);
+    }
+
+    t->n = n;
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, lua_upvalueindex(1), 0);
+    return 1;
+}
+
+//lazy 为 true 时 tolua_beginpcall 等使用的错误处理函数只记录栈, 不格式化
+LUALIB_API void tolua_setlazytraceback(lua_State *L, bool lazy)
+{
+    if (!lazy)
+    {
+        lua_pushcfunction(L, traceback);
+        lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_CUSTOMTRACEBACK);
+        return;
+    }
+
+    lua_getref(L, LUA_RIDX_ERRTRACE);
+
+    if (!lua_isfunction(L, -1))
+    {
+        lua_pop(L, 1);
+        lua_createtable(L, TRACE_FRAMES, 1);
+        lua_createtable(L, 0, 1);                       //弱值, 记录不延长函数的生命期
+        lua_pushstring(L, "v");
+        lua_setfield(L, -2, "__mode");
+        lua_setmetatable(L, -2);
+        errtrace *t = (errtrace*)lua_newuserdata(L, sizeof(errtrace));
+        memset(t, 0, sizeof(errtrace));
+        lua_pushcclosure(L, lazytraceback, 2);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_ERRTRACE);
+    }
+
+    lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_CUSTOMTRACEBACK);
+}
+
+/*idx 处是 lazytraceback 最近记录的错误时, 替换成和 luaL_traceback 格式一致的字符串并返回.
+  否则原样返回 lua_tostring. 记录里没有函数名, 按 <source:line> 输出*/
+LUALIB_API const char *tolua_errortraceback(lua_State *L, int idx)
+{
+    idx = abs_index(L, idx);
+    lua_getref(L, LUA_RIDX_ERRTRACE);
+
+    if (!lua_isfunction(L, -1))
+    {
+        lua_pop(L, 1);
+        return lua_tostring(L, idx);
+    }
+
+    lua_getupvalue(L, -1, 1);
+    lua_getupvalue(L, -2, 2);
+    errtrace *t = (errtrace*)lua_touserdata(L, -1);
+    int frames = lua_gettop(L) - 1;
+    lua_rawgeti(L, frames, 0);
+
+    if (!lua_rawequal(L, -1, idx) || (lua_type(L, idx) != LUA_TSTRING && !lua_isnil(L, idx)))
+    {
+        lua_pop(L, 4);
+        return lua_tostring(L, idx);
+    }
+
+    lua_pop(L, 1);
+    luaL_Buffer b;
+    lua_Debug ar;
+    luaL_buffinit(L, &b);
+
+    if (lua_isstring(L, idx))
+    {
+        lua_pushvalue(L, idx);
+        luaL_addvalue(&b);
+        luaL_addchar(&b, '\n');
+    }
+
+    luaL_addstring(&b, "stack traceback:");
+
+    for (int i = 0; i < t->n; i++)
+    {
+        lua_rawgeti(L, frames, i + 1);
+
+        if (!lua_isfunction(L, -1))                     //已被回收
+        {
+            lua_pop(L, 1);
+            luaL_addstring(&b, "\n\t?: in ?");
+            continue;
+        }
+
+        lua_getinfo(L, ">S", &ar);
+
+        if (t->lines[i] > 0)
+        {
+            lua_pushfstring(L, "\n\t%s:%d: in ", ar.short_src, t->lines[i]);
+        }
+        else
+        {
+            lua_pushfstring(L, "\n\t%s: in ", ar.short_src);
+        }
+
+        luaL_addvalue(&b);
+
+        if (*ar.what == 'm')
+        {
+            luaL_addstring(&b, "main chunk");
+        }
+        else if (*ar.what == 'C')
+        {
+            luaL_addchar(&b, '?');
+        }
+        else
+        {
+            lua_pushfstring(L, "function <%s:%d>", ar.short_src, ar.linedefined);
+            luaL_addvalue(&b);
+        }
+    }
+
+    if (t->truncated)
+    {
+        luaL_addstring(&b, "\n\t...");
+    }
+
+    luaL_pushresult(&b);
+    lua_replace(L, idx);
+
+    for (int i = 0; i <= t->n; i++)                     //已经取走, 之后同样的值不再当作这次的错误
+    {
+        lua_pushnil(L);
+        lua_rawseti(L, -3, i);
+    }
+
+    t->n = 0;
+    lua_pop(L, 3);
+    return lua_tostring(L, idx);
+}
+
+static int _errortraceback(lua_State *L)
+{
+    lua_settop(L, 1);
+    tolua_errortraceback(L, 1);
+    return 1;
+}
+
+LUALIB_API int tolua_beginpcall(lua_State *L, int reference)
+{	
+    lua_getref(L, LUA_RIDX_CUSTOMTRACEBACK);
+	int top = lua_gettop(L);
+	lua_getref(L, reference);
+	return top;
+}
+
+LUALIB_API void tolua_pushtraceback(lua_State *L)
+{
+	lua_getref(L, LUA_RIDX_CUSTOMTRACEBACK);
+}
+
+/*static const int sentinel_ = 0;
+#define sentinel ((void *)&sentinel_)
+
+static int _require(lua_State *L)
+{
+    const char *name = luaL_checkstring(L, 1);    
+    lua_settop(L, 1);  
+    const char *key = luaL_gsub(L, name, "/", ".");            
+    lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+    lua_getfield(L, 3, key);
+
+    if (lua_toboolean(L, -1)) 
+    {  
+        if (lua_touserdata(L, -1) == sentinel)  
+        {
+            luaL_error(L, "loop or previous error loading module " LUA_QS, name);
+        }
+
+        return 1;  //package is already loaded
+    }
+
+    // else must load it; iterate over available loaders
+    lua_getfield(L, LUA_ENVIRONINDEX, "loaders");
+
+    if (!lua_istable(L, -1))
+    {
+        luaL_error(L, LUA_QL("package.loaders") " must be a table");
+    }
+
+    lua_pushliteral(L, "");  //error message accumulator
+
+    for(int i = 1; ; i++) 
+    {
+        lua_rawgeti(L, -2, i);  // get a loader
+
+        if (lua_isnil(L, -1))
+        {
+            luaL_error(L, "module " LUA_QS " not found:%s", name, lua_tostring(L, -2));
+        }
+
+        lua_pushstring(L, name);
+        lua_call(L, 1, 1);  
+
+        if (lua_isfunction(L, -1))  // did it find module?
+        {
+            break;  // module loaded successfully
+        }
+        else if (lua_isstring(L, -1))  // loader returned error message?
+        {
+            lua_concat(L, 2);  // accumulate it
+        }
+        else
+        {
+            lua_pop(L, 1);            
+        }    
+    }
+
+    lua_pushlightuserdata(L, sentinel);
+    lua_setfield(L, 3, key);   // _LOADED[name] = sentinel
+    lua_pushstring(L, name);    // pass name as argument to module
+    lua_call(L, 1, 1);          // run loaded module
+
+    if (!lua_isnil(L, -1))  // non-nil return? 
+    {
+        lua_setfield(L, 3, key);  // _LOADED[name] = returned value
+    }
+
+    lua_getfield(L, 3, key);
+
+    if (lua_touserdata(L, -1) == sentinel) 
+    {   // module did not set a value? 
+        lua_pushboolean(L, 1);          // use true as result
+        lua_pushvalue(L, -1);           // extra copy to be returned
+        lua_setfield(L, 3, key);        // _LOADED[name] = true 
+    }
+
+    return 1;
+}
+
+void tolua_openrequire(lua_State *L)
+{    
+    lua_getglobal(L, "require");
+    lua_pushcfunction(L, _require);
+    lua_getfenv(L, -2);
+    lua_setfenv(L, -2);
+    lua_setglobal(L, "require");
+    lua_pop(L, 1);
+}*/
+
+LUALIB_API int tolua_require(lua_State *L, const char *fileName)
+{
+    int top = lua_gettop(L);
+    lua_getref(L, LUA_RIDX_CUSTOMTRACEBACK);
+    lua_getref(L, LUA_RIDX_REQUIRE);
+    lua_pushstring(L, fileName);        
+    int ret = lua_pcall(L, 1, -1, top + 1);
+    lua_remove(L, top + 1);    
+    return ret;
+}
+
+
+/*LUALIB_API bool tolua_checkluaslot(lua_State *L, int stackPos, int *func, int *table)
+{
+    lua_pushstring(L, "__call");      
+    lua_rawget(L, stackPos);
+
+    if (lua_isfunction(L, -1))
+    {
+        *func = toluaL_ref(L);        
+    }
+    else
+    {
+        lua_pop(L, 1);
+        return false;
+    }
+
+    lua_pushvalue(L, stackPos);
+    *table = toluaL_ref(L);    
+    return true;
+}*/
+
+/*static int do_operator (lua_State *L, const char *op)
+{
+    if (lua_isuserdata(L,1))
+    {        
+        lua_pushvalue(L,1);  
+
+        while (lua_getmetatable(L,-1))
+        {   
+            lua_remove(L,-2);                      
+            lua_pushstring(L,op);               
+            lua_rawget(L,-2);    
+
+            if (lua_isfunction(L,-1))
+            {
+                lua_pushvalue(L,1);
+                lua_pushvalue(L,2);
+                lua_call(L,2,1);
+                return 1;
+            }
+
+            lua_settop(L,3);
+        }
+    }
+
+    luaL_error(L,"attempt to perform operation %s failed", op);
+    return 0;
+}
+
+static int class_add_event (lua_State *L)
+{
+    return do_operator(L,"op_Addition");
+}
+
+static int class_sub_event (lua_State *L)
+{
+    return do_operator(L,"op_Subtraction");
+}
+
+static int class_mul_event (lua_State *L)
+{
+    return do_operator(L,"op_Multiply");
+}
+
+static int class_div_event (lua_State *L)
+{
+    return do_operator(L,"op_Division");
+}
+
+static int class_equals_event (lua_State *L)
+{
+    return do_operator(L,"op_Equality");
+}*/
+
+
+#ifdef _WIN32
+double tolua_timegettime()
+{
+	FILETIME ft;
+	double t;
+	GetSystemTimeAsFileTime(&ft);
+	/* Windows file time (time since January 1, 1601 (UTC)) */
+	t = ft.dwLowDateTime / 1.0e7 + ft.dwHighDateTime*(4294967296.0 / 1.0e7);
+	/* convert to Unix Epoch time (time since January 1, 1970 (UTC)) */
+	return (t - 11644473600.0);
+}
+#else
+double tolua_timegettime()
+{
+	struct timeval v;
+	gettimeofday(&v, (struct timezone *) NULL);
+	/* Unix Epoch time (time since January 1, 1970 (UTC)) */
+	return v.tv_sec + v.tv_usec / 1.0e6;
+}
+#endif
+
+static int tolua_gettime(lua_State *L)
+{
+	lua_pushnumber(L, tolua_timegettime());
+	return 1;
+}
+
+static int tolua_bnd_setpeer(lua_State *L) 
+{
+    // stack: userdata, table
+    if (!lua_isuserdata(L, -2)) 
+    {
+        return luaL_error(L, "Invalid argument #1 to setpeer: userdata expected.");        
+    }
+
+    if (lua_isnil(L, 2)) 
+    {
+        lua_pop(L, 1);
+        lua_pushvalue(L, TOLUA_NOPEER);
+        lua_setfenv(L, -2);
+    }        
+    else
+    {
+        lua_pushvalue(L, 2);                //stack: u p p
+        lua_setfenv(L, -3);                 //stack: u p
+        lua_newtable(L);                    //stack: u p vt        
+        
+        lua_pushlightuserdata(L, &vptr);    
+        lua_pushvalue(L, 1);
+        lua_rawset(L, -3);
+        //lua_pushvalue(L, 1);
+        //lua_rawseti(L, -2, 1);
+
+        lua_getref(L, LUA_RIDX_VPTR);       //stack: u p vt mt
+        lua_setmetatable(L, -2);            //stack: u p vt
+
+        lua_pushstring(L, "base");          //stack: u p vt "base"
+        lua_pushvalue(L, -2);               //stack: u p vt "base" vt
+        lua_rawset(L, 2);                   //stack: u p vt    
+        lua_pop(L, 1);
+    }
+
+    return 0;
+};
+
+static int tolua_bnd_getpeer(lua_State *L) 
+{    
+    lua_getfenv(L, -1);
+
+    if (lua_rawequal(L, -1, TOLUA_NOPEER)) 
+    {
+        lua_pop(L, 1);
+        lua_pushnil(L);
+    };
+
+    return 1;
+};
+
+static int tolua_bnd_getfunction(lua_State *L)
+{
+    lua_pushvalue(L, 1);                            // stack: obj key obj
+
+    while (lua_getmetatable(L, -1) != 0)            // stack: obj key mt
+    {            
+        lua_remove(L, -2);                          // stack: obj key mt
+
+        lua_pushvalue(L, 2);                        // stack: obj key mt key
+        lua_rawget(L, -2);                          // stack: obj key mt value        
+
+        if (!lua_isfunction(L, -1))
+        {
+            return 1;
+        }
+        else
+        {
+            lua_pop(L, 1);
+        }
+        
+        lua_pushlightuserdata(L, &gettag);          
+        lua_rawget(L, -2);                          //stack: obj key mt tget
+
+        if (lua_istable(L, -1))
+        {
+            lua_pushvalue(L, 2);                    //stack: obj key mt tget key
+            lua_rawget(L, -2);                      //stack: obj key mt tget value 
+
+            if (lua_isfunction(L, -1))
+            {                                           
+                return 1;
+            }
+        }
+            
+        lua_settop(L, 3);                           //stack: obj key mt
+    }
+
+    lua_settop(L, 2);
+    lua_pushnil(L);
+    return 1;
+}
+
+static int tolua_bnd_type (lua_State *L)
+{
+    tolua_typename(L,lua_gettop(L));
+    return 1;
+}
+
+static int tolua_initgettable(lua_State *L)
+{
+    if (!lua_istable(L, 1))
+    {        
+        return luaL_typerror(L, 1, "table");         
+    }
+
+    lua_newtable(L);
+    setaccessormeta(L);
+    lua_pushlightuserdata(L, &gettag);
+    lua_pushvalue(L, -2);    
+    lua_rawset(L, 1);
+    invalidateclasscache(L);
+    return 1;
+}
+
+static int tolua_initsettable(lua_State *L)
+{
+    if (!lua_istable(L, 1))
+    {        
+        return luaL_typerror(L, 1, "table");         
+    }
+
+    lua_newtable(L);
+    setaccessormeta(L);
+    lua_pushlightuserdata(L, &settag);    
+    lua_pushvalue(L, -2);    
+    lua_rawset(L, 1);
+    invalidateclasscache(L);
+    return 1;
+}
+
+void tolua_openvptr(lua_State *L)
+{
+    lua_newtable(L);        
+
+    lua_pushstring(L, "__index");
+    lua_pushcfunction(L, vptr_index_event);
+    lua_rawset(L, -3);  
+
+    lua_pushstring(L, "__newindex");
+    lua_pushcfunction(L, vptr_newindex_event);
+    lua_rawset(L, -3);  
+
+    lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_VPTR); 
+}
+
+/*---------------------------timer wheel--------------------------------*/
+//分层时间轮: 近轮256格 + 4层64格. scaled/unscaled 以毫秒为刻度, frame 以帧为刻度, 每帧只处理到期的格子
+#define TIMER_NEAR_SHIFT    8
+#define TIMER_NEAR          (1 << TIMER_NEAR_SHIFT)
+#define TIMER_NEAR_MASK     (TIMER_NEAR - 1)
+#define TIMER_LEVEL_SHIFT   6
+#define TIMER_LEVEL         (1 << TIMER_LEVEL_SHIFT)
+#define TIMER_LEVEL_MASK    (TIMER_LEVEL - 1)
+
+#define TIMER_SCALED        0
+#define TIMER_UNSCALED      1
+#define TIMER_FRAME         2
+#define TIMER_NUMWHEELS     3
+
+//id = gen * 2^24 + 下标, 共 53 位, double 也能精确表示. gen 29 位, 同一节点复用 5 亿次才会重复
+#define TIMER_INDEXBITS     24
+#define TIMER_INDEXMASK     ((1 << TIMER_INDEXBITS) - 1)
+#define TIMER_GENMASK       ((1u << 29) - 1)
+
+#if LUA_VERSION_NUM == 501
+#define timer_resume(co, L, narg, nres)     lua_resume(co, narg)
+#elif LUA_VERSION_NUM == 503
+#define timer_resume(co, L, narg, nres)     lua_resume(co, L, narg)
+#else
+#define timer_resume(co, L, narg, nres)     lua_resume(co, L, narg, nres)
+#endif
+
+typedef struct timernode
+{
+    int next;                   //链表下标, 0为尾
+    uint32_t expire;
+    uint32_t gen;
+    int ref;                    //function 或 thread, LUA_NOREF 为空闲或已取消
+    uint32_t interval;
+    int loops;                  //剩余次数, <0 无限
+    uint8_t wheel;
+    uint8_t co;
+} timernode;
+
+typedef struct timerlist
+{
+    int head;
+    int tail;
+} timerlist;
+
+typedef struct timerwheel
+{
+    uint32_t time;
+    int count;                  //挂在轮上的节点, 包括已取消还没回收的
+    timerlist near[TIMER_NEAR];
+    timerlist level[4][TIMER_LEVEL];
+} timerwheel;
+
+typedef struct scheduler
+{
+    timernode *nodes;           //下标0不用
+    int size;
+    int freelist;
+    double acc[2];              //scaled/unscaled 不足1毫秒的余量
+    timerwheel wheels[TIMER_NUMWHEELS];
+} scheduler;
+
+static scheduler* getscheduler(lua_State *L)
+{
+    lua_getref(L, LUA_RIDX_SCHEDULER);
+    scheduler *s = (scheduler*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    return s;
+}
+
+static void timer_link(scheduler *s, timerlist *list, int idx)
+{
+    s->nodes[idx].next = 0;
+
+    if (list->tail != 0)
+    {
+        s->nodes[list->tail].next = idx;
+    }
+    else
+    {
+        list->head = idx;
+    }
+
+    list->tail = idx;
+}
+
+static int timer_detach(timerlist *list)
+{
+    int idx = list->head;
+    list->head = list->tail = 0;
+    return idx;
+}
+
+static void timer_addnode(scheduler *s, timerwheel *w, int idx)
+{
+    uint32_t expire = s->nodes[idx].expire;
+    uint32_t time = w->time;
+
+    if ((expire | TIMER_NEAR_MASK) == (time | TIMER_NEAR_MASK))
+    {
+        timer_link(s, &w->near[expire & TIMER_NEAR_MASK], idx);
+    }
+    else
+    {
+        uint32_t mask = TIMER_NEAR << TIMER_LEVEL_SHIFT;
+        int i = 0;
+
+        for (; i < 3; i++)
+        {
+            if ((expire | (mask - 1)) == (time | (mask - 1)))
+            {
+                break;
+            }
+
+            mask <<= TIMER_LEVEL_SHIFT;
+        }
+
+        timer_link(s, &w->level[i][(expire >> (TIMER_NEAR_SHIFT + i * TIMER_LEVEL_SHIFT)) & TIMER_LEVEL_MASK], idx);
+    }
+}
+
+static void timer_movelist(scheduler *s, timerwheel *w, int level, int slot)
+{
+    int idx = timer_detach(&w->level[level][slot]);
+
+    while (idx != 0)
+    {
+        int next = s->nodes[idx].next;
+        timer_addnode(s, w, idx);
+        idx = next;
+    }
+}
+
+static void timer_shift(scheduler *s, timerwheel *w)
+{
+    uint32_t mask = TIMER_NEAR;
+    uint32_t ct = ++w->time;
+
+    if (ct == 0)
+    {
+        timer_movelist(s, w, 3, 0);
+        return;
+    }
+
+    uint32_t time = ct >> TIMER_NEAR_SHIFT;
+    int i = 0;
+
+    while ((ct & (mask - 1)) == 0)
+    {
+        int slot = time & TIMER_LEVEL_MASK;
+
+        if (slot != 0)
+        {
+            timer_movelist(s, w, i, slot);
+            break;
+        }
+
+        mask <<= TIMER_LEVEL_SHIFT;
+        time >>= TIMER_LEVEL_SHIFT;
+        ++i;
+    }
+}
+
+static int timer_alloc(scheduler *s)
+{
+    if (s->freelist == 0)
+    {
+        int size = s->size == 0 ? 64 : s->size * 2;
+
+        if (size - 1 > TIMER_INDEXMASK)
+        {
+            return 0;
+        }
+
+        timernode *nodes = (timernode*)realloc(s->nodes, sizeof(timernode) * size);
+
+        if (nodes == NULL)
+        {
+            return 0;
+        }
+
+        memset(nodes + s->size, 0, sizeof(timernode) * (size - s->size));
+
+        for (int i = size - 1; i >= (s->size == 0 ? 1 : s->size); i--)
+        {
+            nodes[i].ref = LUA_NOREF;
+            nodes[i].next = s->freelist;
+            s->freelist = i;
+        }
+
+        s->nodes = nodes;
+        s->size = size;
+    }
+
+    int idx = s->freelist;
+    s->freelist = s->nodes[idx].next;
+    return idx;
+}
+
+static void timer_free(scheduler *s, int idx)
+{
+    timernode *n = &s->nodes[idx];
+    n->ref = LUA_NOREF;
+    ++n->gen;
+    n->next = s->freelist;
+    s->freelist = idx;
+}
+
+static void timer_error(lua_State *L, int *err)
+{
+    //只保留第一条错误, 留在栈上
+    if (*err == 0)
+    {
+        *err = lua_gettop(L);
+    }
+    else
+    {
+        lua_pop(L, 1);
+    }
+}
+
+static bool copool_finished(lua_State *co);
+static void copool_recycle(lua_State *L, lua_State *co);
+static int tolua_waitforseconds(lua_State *L);
+static int tolua_waitforframes(lua_State *L);
+
+//stack: co, 协程还停在 id 这次 wait 上: LUA_RIDX_TIMERWAIT[co] == id, 并且挂起在 wait 函数里.
+//中途被别人 resume 过又因为其它原因 yield 的协程不能由 timer 恢复
+static bool timer_waiting(lua_State *L, lua_State *co, int64_t id)
+{
+    lua_getref(L, LUA_RIDX_TIMERWAIT);
+    lua_pushvalue(L, -2);
+    lua_rawget(L, -2);
+    bool flag = lua_type(L, -1) == LUA_TNUMBER && (int64_t)lua_tonumber(L, -1) == id;
+    lua_pop(L, 1);
+
+    if (flag)
+    {
+        lua_pushvalue(L, -2);
+        lua_pushnil(L);
+        lua_rawset(L, -3);
+    }
+
+    lua_pop(L, 1);
+    lua_Debug ar;
+
+    if (!flag || lua_getstack(co, 0, &ar) == 0 || lua_getinfo(co, "f", &ar) == 0)
+    {
+        return false;
+    }
+
+    lua_CFunction f = lua_tocfunction(co, -1);
+    lua_pop(co, 1);
+    return f == tolua_waitforseconds || f == tolua_waitforframes;
+}
+
+static void timer_resumeco(lua_State *L, int ref, int64_t id, int *err)
+{
+    lua_getref(L, ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, ref);
+    lua_State *co = lua_tothread(L, -1);
+
+    if (co != NULL && lua_status(co) == LUA_YIELD && timer_waiting(L, co, id))
+    {
+        int nres = 0;
+        int status = timer_resume(co, L, 0, &nres);
+        (void)nres;
+
+        if (status == LUA_YIELD && copool_finished(co))
+        {
+            copool_recycle(L, co);
+        }
+        else if (status == 0 || status == LUA_YIELD)
+        {
+            lua_settop(co, 0);
+        }
+        else
+        {
+            luaL_traceback(L, co, lua_tostring(co, -1), 0);
+            lua_remove(L, -2);
+            timer_error(L, err);
+            return;
+        }
+    }
+
+    lua_pop(L, 1);
+}
+
+static void timer_execute(lua_State *L, scheduler *s, timerwheel *w, int traceback, int *err)
+{
+    int idx = timer_detach(&w->near[w->time & TIMER_NEAR_MASK]);
+
+    while (idx != 0)
+    {
+        //回调里可能添加timer导致nodes重新分配, 不能跨调用持有指针
+        timernode *n = &s->nodes[idx];
+        int next = n->next;
+        int ref = n->ref;
+        --w->count;
+
+        if (ref == LUA_NOREF)
+        {
+            timer_free(s, idx);
+        }
+        else if (n->co)
+        {
+            int64_t id = ((int64_t)(n->gen & TIMER_GENMASK) << TIMER_INDEXBITS) | idx;
+            timer_free(s, idx);
+            timer_resumeco(L, ref, id, err);
+        }
+        else
+        {
+            bool again = n->loops != 1;
+
+            if (again)
+            {
+                //先挂回去, 回调里 removetimer 自己也有效
+                if (n->loops > 0)
+                {
+                    --n->loops;
+                }
+
+                n->expire = w->time + n->interval;
+                timer_addnode(s, w, idx);
+                ++w->count;
+            }
+            else
+            {
+                timer_free(s, idx);
+            }
+
+            lua_getref(L, ref);
+
+            if (!again)
+            {
+                luaL_unref(L, LUA_REGISTRYINDEX, ref);
+            }
+
+            if (lua_pcall(L, 0, 0, traceback) != 0)
+            {
+                timer_error(L, err);
+            }
+        }
+
+        idx = next;
+    }
+}
+
+//按 expire - base 归并排序链表, 返回新表头
+static int timer_sort(scheduler *s, int head, uint32_t base)
+{
+    if (head == 0 || s->nodes[head].next == 0)
+    {
+        return head;
+    }
+
+    int slow = head;
+
+    for (int fast = s->nodes[head].next; fast != 0 && s->nodes[fast].next != 0; fast = s->nodes[s->nodes[fast].next].next)
+    {
+        slow = s->nodes[slow].next;
+    }
+
+    int b = timer_sort(s, s->nodes[slow].next, base);
+    s->nodes[slow].next = 0;
+    int a = timer_sort(s, head, base);
+    timerlist list = {0, 0};
+
+    while (a != 0 || b != 0)
+    {
+        int idx;
+
+        if (b == 0 || (a != 0 && s->nodes[a].expire - base <= s->nodes[b].expire - base))
+        {
+            idx = a;
+            a = s->nodes[a].next;
+        }
+        else
+        {
+            idx = b;
+            b = s->nodes[b].next;
+        }
+
+        timer_link(s, &list, idx);
+    }
+
+    return list.head;
+}
+
+//跨度超过近轮时不逐格推进: 摘下全部节点, 没到期的按新时间重新挂上, 到期的按到期先后一次执行.
+//循环 timer 错过的多次合并成一次, 从新时间重新计算下次到期
+static void timer_jump(lua_State *L, scheduler *s, timerwheel *w, uint32_t ticks, int traceback, int *err)
+{
+    timerlist all = {0, 0};
+    timerlist *lists[2] = {w->near, &w->level[0][0]};
+    int counts[2] = {TIMER_NEAR, 4 * TIMER_LEVEL};
+
+    for (int k = 0; k < 2; k++)
+    {
+        for (int i = 0; i < counts[k]; i++)
+        {
+            int idx = timer_detach(&lists[k][i]);
+
+            while (idx != 0)
+            {
+                int next = s->nodes[idx].next;
+                timer_link(s, &all, idx);
+                idx = next;
+            }
+        }
+    }
+
+    uint32_t base = w->time;
+    w->time += ticks;
+    timerlist due = {0, 0};
+    int idx = all.head;
+
+    while (idx != 0)
+    {
+        int next = s->nodes[idx].next;
+
+        if (s->nodes[idx].expire - base <= ticks)
+        {
+            timer_link(s, &due, idx);
+        }
+        else
+        {
+            timer_addnode(s, w, idx);
+        }
+
+        idx = next;
+    }
+
+    //到期时间都不晚于 w->time, 当前格子里不会有重新挂上的节点
+    timerlist *slot = &w->near[w->time & TIMER_NEAR_MASK];
+    slot->head = timer_sort(s, due.head, base);
+
+    for (idx = slot->head; idx != 0; idx = s->nodes[idx].next)
+    {
+        slot->tail = idx;
+    }
+
+    timer_execute(L, s, w, traceback, err);
+}
+
+static void timer_advance(lua_State *L, scheduler *s, int wheel, uint32_t ticks, int traceback, int *err)
+{
+    timerwheel *w = &s->wheels[wheel];
+
+    if (ticks > TIMER_NEAR && w->count > 0)
+    {
+        timer_jump(L, s, w, ticks, traceback, err);
+        return;
+    }
+
+    while (ticks > 0)
+    {
+        if (w->count == 0)
+        {
+            w->time += ticks;
+            break;
+        }
+
+        timer_shift(s, w);
+        timer_execute(L, s, w, traceback, err);
+        --ticks;
+    }
+}
+
+static uint32_t timer_ticks(scheduler *s, int wheel, float delta)
+{
+    double acc = s->acc[wheel] + (delta > 0 ? delta * 1000.0 : 0);
+    uint32_t ticks = acc < 4294967295.0 ? (uint32_t)acc : 0xffffffff;
+    s->acc[wheel] = acc - ticks;
+    return ticks;
+}
+
+//stack: ..., traceback, ... 运行到期的 timer, 有错误时返回第一条错误的栈位置
+static int tolua_updatetimer(lua_State *L, int traceback, float deltaTime, float unscaledTime)
+{
+    scheduler *s = getscheduler(L);
+    int err = 0;
+
+    if (s != NULL)
+    {
+        timer_advance(L, s, TIMER_SCALED, timer_ticks(s, TIMER_SCALED, deltaTime), traceback, &err);
+        timer_advance(L, s, TIMER_UNSCALED, timer_ticks(s, TIMER_UNSCALED, unscaledTime), traceback, &err);
+        timer_advance(L, s, TIMER_FRAME, 1, traceback, &err);
+    }
+
+    return err;
+}
+
+static uint32_t timer_mseconds(double sec)
+{
+    double ms = ceil(sec * 1000.0 - 1e-6);      //x/1000*1000 的误差不多算1毫秒
+    return ms < 1 ? 1 : (ms > 0x7fffffff ? 0x7fffffff : (uint32_t)ms);
+}
+
+//stack: ..., f or thread
+static int64_t timer_add(lua_State *L, int wheel, uint32_t delay, int loops, bool co)
+{
+    scheduler *s = getscheduler(L);
+    int idx = s != NULL ? timer_alloc(s) : 0;
+
+    if (idx == 0)
+    {
+        return luaL_error(L, "timer: out of memory");
+    }
+
+    timerwheel *w = &s->wheels[wheel];
+    timernode *n = &s->nodes[idx];
+    n->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    n->interval = delay < 1 ? 1 : delay;
+    n->expire = w->time + n->interval;
+    n->loops = loops == 0 ? 1 : loops;
+    n->wheel = (uint8_t)wheel;
+    n->co = co ? 1 : 0;
+    timer_addnode(s, w, idx);
+    ++w->count;
+    return ((int64_t)(n->gen & TIMER_GENMASK) << TIMER_INDEXBITS) | idx;
+}
+
+static int timer_pushid(lua_State *L, int64_t id)
+{
+#if LUA_VERSION_NUM >= 503
+    lua_pushinteger(L, (lua_Integer)id);
+#else
+    lua_pushnumber(L, (lua_Number)id);
+#endif
+    return 1;
+}
+
+//tolua.addtimer(func, seconds, loops = 1, unscaled = false), loops < 0 无限循环
+static int tolua_addtimer(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    uint32_t delay = timer_mseconds(luaL_checknumber(L, 2));
+    int loops = (int)luaL_optinteger(L, 3, 1);
+    int wheel = lua_toboolean(L, 4) ? TIMER_UNSCALED : TIMER_SCALED;
+    lua_pushvalue(L, 1);
+    return timer_pushid(L, timer_add(L, wheel, delay, loops, false));
+}
+
+//tolua.addframetimer(func, frames, loops = 1)
+static int tolua_addframetimer(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    int frames = (int)luaL_checkinteger(L, 2);
+    int loops = (int)luaL_optinteger(L, 3, 1);
+    lua_pushvalue(L, 1);
+    return timer_pushid(L, timer_add(L, TIMER_FRAME, frames > 0 ? (uint32_t)frames : 1, loops, false));
+}
+
+static int tolua_removetimer(lua_State *L)
+{
+    int64_t id = (int64_t)luaL_checknumber(L, 1);
+    int idx = (int)(id & TIMER_INDEXMASK);
+    scheduler *s = getscheduler(L);
+
+    if (s == NULL || idx <= 0 || idx >= s->size)
+    {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+
+    timernode *n = &s->nodes[idx];
+
+    if ((int64_t)(n->gen & TIMER_GENMASK) != (id >> TIMER_INDEXBITS) || n->ref == LUA_NOREF || n->co)
+    {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+
+    //节点留在轮上, 到期时回收
+    luaL_unref(L, LUA_REGISTRYINDEX, n->ref);
+    n->ref = LUA_NOREF;
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int timer_wait(lua_State *L, int wheel, uint32_t delay)
+{
+    if (lua_pushthread(L))
+    {
+        return luaL_error(L, "attempt to wait outside a coroutine");
+    }
+
+    int64_t id = timer_add(L, wheel, delay, 1, true);
+    lua_getref(L, LUA_RIDX_TIMERWAIT);
+    lua_pushthread(L);
+    timer_pushid(L, id);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+    return lua_yield(L, 0);
+}
+
+//在协程中调用: tolua.waitforseconds(seconds, unscaled = false)
+static int tolua_waitforseconds(lua_State *L)
+{
+    uint32_t delay = timer_mseconds(luaL_checknumber(L, 1));
+    return timer_wait(L, lua_toboolean(L, 2) ? TIMER_UNSCALED : TIMER_SCALED, delay);
+}
+
+//在协程中调用: tolua.waitforframes(frames = 1)
+static int tolua_waitforframes(lua_State *L)
+{
+    int frames = (int)luaL_optinteger(L, 1, 1);
+    return timer_wait(L, TIMER_FRAME, frames > 0 ? (uint32_t)frames : 1);
+}
+
+/*---------------------------coroutine pool--------------------------------*/
+/*tolua.startco 用的协程跑一个循环: yield 一个标记等待, 由恢复它的一方放回池里,
+  下次 resume 传进来的就是新的函数和参数, 线程和它的栈都不用重新分配. 出错的协程已经死掉, 不回收.
+  函数和参数只活在 run 的栈帧里, 空闲时已经返回, 池里的线程不会让它们无法回收. 新线程先 resume 一次停在 yield 上.
+  空闲线程栈上留着标记, 任务里保存了 coroutine.running() 的代码事后还可能 resume 它, 取出时重新确认仍停在循环里,
+  循环也忽略不是函数的参数. LUA_RIDX_COPOOL: [0] 为循环函数, [1..idle] 为空闲线程*/
+#define COPOOL_MAX      128
+
+static char copoolmark;
+
+static const char copoolsource[] =
+    "local yield, type, mark = coroutine.yield, type, ...\n"
+    "local function run(f, ...)\n"
+    "    if type(f) == 'function' then f(...) end\n"
+    "end\n"
+    "return function()\n"
+    "    while true do run(yield(mark)) end\n"
+    "end\n";
+
+static bool copool_finished(lua_State *co)
+{
+    return lua_gettop(co) > 0 && lua_touserdata(co, -1) == &copoolmark;
+}
+
+static void copool_recycle(lua_State *L, lua_State *co)
+{
+    tolua_context *ctx = getcontext(L);
+    lua_settop(co, 0);
+    lua_pushlightuserdata(co, &copoolmark);
+
+    if (ctx->coidle < COPOOL_MAX)
+    {
+        lua_getref(L, LUA_RIDX_COPOOL);
+        lua_pushthread(co);
+        lua_xmove(co, L, 1);
+        lua_rawseti(L, -2, ++ctx->coidle);
+        lua_pop(L, 1);
+    }
+}
+
+//tolua.startco(func, ...) 在池里的协程上启动 func, 直到第一次 wait 为止同步执行
+static int tolua_startco(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    tolua_context *ctx = getcontext(L);
+    int n = lua_gettop(L);
+    int nres = 0;
+    lua_State *co = NULL;
+    lua_getref(L, LUA_RIDX_COPOOL);
+
+    //放回池后又被外部 resume 过的线程可能已经死掉或停在别处, 丢掉
+    while (ctx->coidle > 0)
+    {
+        lua_rawgeti(L, -1, ctx->coidle);
+        lua_pushnil(L);
+        lua_rawseti(L, -3, ctx->coidle--);
+        co = lua_tothread(L, -1);
+
+        if (co != NULL && lua_status(co) == LUA_YIELD && copool_finished(co))
+        {
+            lua_settop(co, 0);
+            ++ctx->cohits;
+            break;
+        }
+
+        lua_pop(L, 1);
+        co = NULL;
+    }
+
+    if (co == NULL)
+    {
+        co = lua_newthread(L);
+        lua_rawgeti(L, -2, 0);
+        lua_xmove(L, co, 1);
+
+        if (timer_resume(co, L, 0, &nres) != LUA_YIELD)
+        {
+            return luaL_error(L, "startco: %s", lua_tostring(co, -1));
+        }
+
+        lua_settop(co, 0);
+        ++ctx->comisses;
+    }
+
+    luaL_checkstack(co, n, NULL);
+
+    for (int i = 1; i <= n; i++)
+    {
+        lua_pushvalue(L, i);
+    }
+
+    lua_xmove(L, co, n);
+    int status = timer_resume(co, L, n, &nres);
+    (void)nres;
+
+    if (status == LUA_YIELD)
+    {
+        if (copool_finished(co))
+        {
+            copool_recycle(L, co);
+        }
+        else
+        {
+            lua_settop(co, 0);
+        }
+    }
+    else
+    {
+        luaL_traceback(L, co, lua_tostring(co, -1), 0);
+        return lua_error(L);
+    }
+
+    return 0;
+}
+
+//tolua.copoolstats() 返回 hits, misses, idle
+static int tolua_copoolstats(lua_State *L)
+{
+    tolua_context *ctx = getcontext(L);
+    lua_pushinteger(L, ctx->cohits);
+    lua_pushinteger(L, ctx->comisses);
+    lua_pushinteger(L, ctx->coidle);
+    return 3;
+}
+
+LUALIB_API void tolua_getcopoolstats(lua_State *L, tolua_CoPoolStats *stats)
+{
+    tolua_context *ctx = getcontext(L);
+    stats->hits = ctx->cohits;
+    stats->misses = ctx->comisses;
+    stats->idle = ctx->coidle;
+}
+
+void tolua_opencopool(lua_State *L)
+{
+    lua_newtable(L);
+
+    if (luaL_loadbuffer(L, copoolsource, sizeof(copoolsource) - 1, "=copool") == 0)
+    {
+        lua_pushlightuserdata(L, &copoolmark);
+        lua_call(L, 1, 1);
+        lua_rawseti(L, -2, 0);
+    }
+    else
+    {
+        lua_pop(L, 1);
+    }
+
+    lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_COPOOL);
+}
+
+/*---------------------------event bus--------------------------------*/
+/*按事件 id 分发的多播事件. 监听者存成注册表 ref 数组, 一次分发在同一个保护边界内依次 pcall 每个监听者,
+  单个监听者出错不影响其余的, 只保留第一条错误. 分发中添加的监听者下次分发才生效, 移除的先置空, 最外层分发结束再压缩.
+  tolua.post / tolua_postevent 排队的事件在 tolua_lateupdate 末尾统一分发*/
+#define EVENT_BUCKETS       256
+
+typedef struct eventlistener
+{
+    int func;                   //LUA_NOREF 表示已移除
+    int self;                   //LUA_NOREF 表示没有 self
+} eventlistener;
+
+typedef struct eventnode
+{
+    struct eventnode *next;
+    int id;
+    int count;
+    int capacity;
+    int dispatching;            //嵌套分发层数
+    bool dirty;                 //有待压缩的空位
+    eventlistener *listeners;
+} eventnode;
+
+typedef struct eventbus
+{
+    eventnode *buckets[EVENT_BUCKETS];
+    int queues[2];              //排队事件的平铺表: id, n, arg1..argn, ...
+    int active;
+    int queuelen;
+} eventbus;
+
+static eventbus* geteventbus(lua_State *L)
+{
+    lua_getref(L, LUA_RIDX_EVENTBUS);
+    eventbus *bus = (eventbus*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    return bus;
+}
+
+static eventnode* event_find(eventbus *bus, int id, bool create)
+{
+    eventnode **p = &bus->buckets[(uint32_t)id & (EVENT_BUCKETS - 1)];
+
+    while (*p != NULL && (*p)->id != id)
+    {
+        p = &(*p)->next;
+    }
+
+    if (*p == NULL && create)
+    {
+        eventnode *node = (eventnode*)calloc(1, sizeof(eventnode));
+
+        if (node != NULL)
+        {
+            node->id = id;
+            *p = node;
+        }
+    }
+
+    return *p;
+}
+
+static void event_compact(eventnode *node)
+{
+    int n = 0;
+
+    for (int i = 0; i < node->count; i++)
+    {
+        if (node->listeners[i].func != LUA_NOREF)
+        {
+            node->listeners[n++] = node->listeners[i];
+        }
+    }
+
+    node->count = n;
+    node->dirty = false;
+}
+
+//listener 的 func 和 self 是否分别等于 func 和 self 处的值, self 为 0 表示没有 self
+static bool event_match(lua_State *L, eventlistener *l, int func, int self)
+{
+    if (l->func == LUA_NOREF || (l->self == LUA_NOREF) != (self == 0))
+    {
+        return false;
+    }
+
+    lua_getref(L, l->func);
+    bool flag = lua_rawequal(L, -1, func) != 0;
+    lua_pop(L, 1);
+
+    if (flag && self != 0)
+    {
+        lua_getref(L, l->self);
+        flag = lua_rawequal(L, -1, self) != 0;
+        lua_pop(L, 1);
+    }
+
+    return flag;
+}
+
+static void event_remove(lua_State *L, eventnode *node, int i)
+{
+    eventlistener *l = &node->listeners[i];
+    luaL_unref(L, LUA_REGISTRYINDEX, l->func);
+    luaL_unref(L, LUA_REGISTRYINDEX, l->self);
+    l->func = LUA_NOREF;
+    l->self = LUA_NOREF;
+    node->dirty = true;
+
+    if (node->dispatching == 0)
+    {
+        event_compact(node);
+    }
+}
+
+//stack: ..., args 调用 id 的所有监听者, args 从 base + 1 开始共 nargs 个. 返回出错个数, 第一条错误留在栈顶
+static int event_call(lua_State *L, eventbus *bus, int id, int base, int nargs, int traceback)
+{
+    eventnode *node = event_find(bus, id, false);
+    int errors = 0;
+
+    if (node == NULL)
+    {
+        return 0;
+    }
+
+    int count = node->count;
+    luaL_checkstack(L, nargs + 4, NULL);
+    ++node->dispatching;
+
+    for (int i = 0; i < count; i++)
+    {
+        //监听者里可能增删监听者导致数组重新分配, 不能跨调用持有指针
+        eventlistener l = node->listeners[i];
+
+        if (l.func == LUA_NOREF)
+        {
+            continue;
+        }
+
+        int n = nargs;
+        lua_getref(L, l.func);
+
+        if (l.self != LUA_NOREF)
+        {
+            lua_getref(L, l.self);
+            ++n;
+        }
+
+        for (int k = 1; k <= nargs; k++)
+        {
+            lua_pushvalue(L, base + k);
+        }
+
+        if (lua_pcall(L, n, 0, traceback) != 0 && errors++ > 0)
+        {
+            lua_pop(L, 1);
+        }
+    }
+
+    if (--node->dispatching == 0 && node->dirty)
+    {
+        event_compact(node);
+    }
+
+    return errors;
+}
+
+//stack: ..., args 把最后 nargs 个值连同 id 追加到排队表
+static void event_post(lua_State *L, eventbus *bus, int id, int nargs)
+{
+    int base = lua_gettop(L) - nargs;
+    lua_getref(L, bus->queues[bus->active]);
+    lua_pushinteger(L, id);
+    lua_rawseti(L, -2, ++bus->queuelen);
+    lua_pushinteger(L, nargs);
+    lua_rawseti(L, -2, ++bus->queuelen);
+
+    for (int k = 1; k <= nargs; k++)
+    {
+        lua_pushvalue(L, base + k);
+        lua_rawseti(L, -2, ++bus->queuelen);
+    }
+
+    lua_settop(L, base);
+}
+
+//stack: ..., traceback, ... 分发排队的事件, 期间新排队的留到下一帧. 返回出错个数, 第一条错误留在栈顶
+static int event_flush(lua_State *L, int traceback)
+{
+    eventbus *bus = geteventbus(L);
+    int errors = 0;
+
+    if (bus == NULL || bus->queuelen == 0)
+    {
+        return 0;
+    }
+
+    int len = bus->queuelen;
+    lua_pushnil(L);                                     //第一条错误的位置
+    int err = lua_gettop(L);
+    lua_getref(L, bus->queues[bus->active]);
+    int queue = err + 1;
+    bus->active ^= 1;
+    bus->queuelen = 0;
+
+    for (int i = 1; i <= len;)
+    {
+        lua_rawgeti(L, queue, i);
+        int id = (int)lua_tointeger(L, -1);
+        lua_rawgeti(L, queue, i + 1);
+        int nargs = (int)lua_tointeger(L, -1);
+        lua_pop(L, 2);
+        luaL_checkstack(L, nargs, NULL);
+
+        for (int k = 0; k < nargs; k++)
+        {
+            lua_rawgeti(L, queue, i + 2 + k);
+        }
+
+        int e = event_call(L, bus, id, queue, nargs, traceback);
+
+        if (e > 0 && errors == 0)
+        {
+            lua_replace(L, err);
+        }
+
+        errors += e;
+        lua_settop(L, queue);
+        i += 2 + nargs;
+    }
+
+    for (int i = 1; i <= len; i++)
+    {
+        lua_pushnil(L);
+        lua_rawseti(L, queue, i);
+    }
+
+    lua_pop(L, errors > 0 ? 1 : 2);
+    return errors;
+}
+
+static int event_checkid(lua_State *L)
+{
+    return (int)luaL_checkinteger(L, 1);
+}
+
+//tolua.addlistener(id, func, self = nil), 重复添加返回 false
+static int tolua_addlistener(lua_State *L)
+{
+    int id = event_checkid(L);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    int self = lua_isnoneornil(L, 3) ? 0 : 3;
+    eventbus *bus = geteventbus(L);
+    eventnode *node = bus != NULL ? event_find(bus, id, true) : NULL;
+
+    if (node == NULL)
+    {
+        return luaL_error(L, "event: out of memory");
+    }
+
+    for (int i = 0; i < node->count; i++)
+    {
+        if (event_match(L, &node->listeners[i], 2, self))
+        {
+            lua_pushboolean(L, 0);
+            return 1;
+        }
+    }
+
+    if (node->count == node->capacity)
+    {
+        int capacity = node->capacity > 0 ? node->capacity * 2 : 4;
+        eventlistener *listeners = (eventlistener*)realloc(node->listeners, sizeof(eventlistener) * capacity);
+
+        if (listeners == NULL)
+        {
+            return luaL_error(L, "event: out of memory");
+        }
+
+        node->listeners = listeners;
+        node->capacity = capacity;
+    }
+
+    eventlistener *l = &node->listeners[node->count++];
+    lua_pushvalue(L, 2);
+    l->func = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    if (self != 0)
+    {
+        lua_pushvalue(L, self);
+        l->self = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    else
+    {
+        l->self = LUA_NOREF;
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+//tolua.removelistener(id, func, self = nil)
+static int tolua_removelistener(lua_State *L)
+{
+    int id = event_checkid(L);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    int self = lua_isnoneornil(L, 3) ? 0 : 3;
+    eventbus *bus = geteventbus(L);
+    eventnode *node = bus != NULL ? event_find(bus, id, false) : NULL;
+
+    if (node != NULL)
+    {
+        for (int i = 0; i < node->count; i++)
+        {
+            if (event_match(L, &node->listeners[i], 2, self))
+            {
+                event_remove(L, node, i);
+                lua_pushboolean(L, 1);
+                return 1;
+            }
+        }
+    }
+
+    lua_pushboolean(L, 0);
+    return 1;
+}
+
+//tolua.clearlisteners(id)
+static int tolua_clearlisteners(lua_State *L)
+{
+    int id = event_checkid(L);
+    eventbus *bus = geteventbus(L);
+    eventnode *node = bus != NULL ? event_find(bus, id, false) : NULL;
+
+    if (node != NULL)
+    {
+        for (int i = node->count - 1; i >= 0; i--)
+        {
+            if (node->listeners[i].func != LUA_NOREF)
+            {
+                event_remove(L, node, i);
+            }
+        }
+    }
+
+    return 0;
+}
+
+//tolua.dispatch(id, ...) 所有监听者都执行完后, 如有出错抛出第一条错误
+static int tolua_dispatch(lua_State *L)
+{
+    int id = event_checkid(L);
+    eventbus *bus = geteventbus(L);
+    int nargs = lua_gettop(L) - 1;
+
+    if (bus == NULL)
+    {
+        return 0;
+    }
+
+    lua_getref(L, LUA_RIDX_CUSTOMTRACEBACK);
+
+    if (event_call(L, bus, id, 1, nargs, nargs + 2) > 0)
+    {
+        return lua_error(L);
+    }
+
+    return 0;
+}
+
+//tolua.post(id, ...) 延迟到本帧 LateUpdate 之后分发
+static int tolua_post(lua_State *L)
+{
+    int id = event_checkid(L);
+    eventbus *bus = geteventbus(L);
+
+    if (bus != NULL)
+    {
+        event_post(L, bus, id, lua_gettop(L) - 1);
+    }
+
+    return 0;
+}
+
+//stack: id, args, traceback
+static int event_pdispatch(lua_State *L)
+{
+    int top = lua_gettop(L);
+    int id = (int)lua_tointeger(L, 1);
+
+    if (event_call(L, geteventbus(L), id, 1, top - 2, top) > 0)
+    {
+        return 1;
+    }
+
+    return 0;
+}
+
+/*宿主分发: 栈顶 nargs 个参数作为事件参数, 调用后弹出. 返回 0 表示全部成功;
+  有监听者出错时返回 LUA_ERRRUN, 第一条错误(已经过 traceback 处理)留在栈顶*/
+LUALIB_API int tolua_dispatchevent(lua_State *L, int id, int nargs)
+{
+    int base = lua_gettop(L) - nargs;
+
+    if (geteventbus(L) == NULL)
+    {
+        lua_settop(L, base);
+        return 0;
+    }
+
+    lua_getref(L, LUA_RIDX_CUSTOMTRACEBACK);
+    lua_pushvalue(L, -1);
+    lua_insert(L, base + 1);                            //stack: traceback, args, traceback
+    lua_pushcfunction(L, event_pdispatch);
+    lua_insert(L, base + 2);
+    lua_pushinteger(L, id);
+    lua_insert(L, base + 3);                            //stack: traceback, pdispatch, id, args, traceback
+    int ret = lua_pcall(L, nargs + 2, 1, base + 1);      //stack: traceback, error or nil
+
+    if (ret == 0 && !lua_isnil(L, -1))
+    {
+        ret = LUA_ERRRUN;
+    }
+
+    if (ret != 0)
+    {
+        lua_replace(L, base + 1);
+        lua_settop(L, base + 1);
+    }
+    else
+    {
+        lua_settop(L, base);
+    }
+
+    return ret;
+}
+
+//栈顶 nargs 个参数随事件排队, 调用后弹出
+LUALIB_API void tolua_postevent(lua_State *L, int id, int nargs)
+{
+    eventbus *bus = geteventbus(L);
+
+    if (bus != NULL)
+    {
+        event_post(L, bus, id, nargs);
+    }
+    else
+    {
+        lua_pop(L, nargs);
+    }
+}
+
+static int eventbus_free(lua_State *L)
+{
+    eventbus *bus = (eventbus*)lua_touserdata(L, 1);
+
+    for (int i = 0; i < EVENT_BUCKETS; i++)
+    {
+        eventnode *node = bus->buckets[i];
+
+        while (node != NULL)
+        {
+            eventnode *next = node->next;
+            free(node->listeners);
+            free(node);
+            node = next;
+        }
+
+        bus->buckets[i] = NULL;
+    }
+
+    return 0;
+}
+
+void tolua_openeventbus(lua_State *L)
+{
+    eventbus *bus = (eventbus*)lua_newuserdata(L, sizeof(eventbus));
+    memset(bus, 0, sizeof(eventbus));
+    lua_newtable(L);
+    bus->queues[0] = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_newtable(L);
+    bus->queues[1] = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_newtable(L);
+    lua_pushstring(L, "__gc");
+    lua_pushcfunction(L, eventbus_free);
+    lua_rawset(L, -3);
+    lua_setmetatable(L, -2);
+    lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_EVENTBUS);
+}
+
+static int scheduler_free(lua_State *L)
+{
+    scheduler *s = (scheduler*)lua_touserdata(L, 1);
+    free(s->nodes);
+    memset(s, 0, sizeof(scheduler));
+    return 0;
+}
+
+void tolua_openscheduler(lua_State *L)
+{
+    scheduler *s = (scheduler*)lua_newuserdata(L, sizeof(scheduler));
+    memset(s, 0, sizeof(scheduler));
+    lua_newtable(L);
+    lua_pushstring(L, "__gc");
+    lua_pushcfunction(L, scheduler_free);
+    lua_rawset(L, -3);
+    lua_setmetatable(L, -2);
+    lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_SCHEDULER);
+
+    //thread -> 正在等的 timer id
+    lua_newtable(L);
+    lua_newtable(L);
+    lua_pushstring(L, "__mode");
+    lua_pushstring(L, "k");
+    lua_rawset(L, -3);
+    lua_setmetatable(L, -2);
+    lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_TIMERWAIT);
+}
+
+/*---------------------------bytes--------------------------------*/
+/*tolua.bytes: 不进字符串表的二进制缓冲. 自己分配的数据紧跟在头后面(多留一个 '\0'), 宿主内存只保存指针,
+  宿主释放内存前调用 tolua_releasebytes 使其失效. sub 得到的切片共享父缓冲, 通过 fenv/uservalue 引用父对象,
+  root 指向最初的缓冲, 访问时据此发现整块已经失效.
+  pb/pbc/struct/cjson 通过 tolua_checklbytes 直接读取, 不用先转成 lua 字符串. 多字节数值按小端读写*/
+#define BYTES_TAIL      1           //data[len] 在分配的内存内, 可以读取
+
+typedef struct bytesbuffer
+{
+    char *data;
+    size_t len;
+    int flags;
+    struct bytesbuffer *root;   //切片引用父对象, root 随之存活
+} bytesbuffer;
+
+enum
+{
+    BYTES_I8, BYTES_U8, BYTES_I16, BYTES_U16, BYTES_I32, BYTES_U32, BYTES_I64, BYTES_U64, BYTES_F32, BYTES_F64, BYTES_NUMTYPES
+};
+
+static const char *bytestypes[BYTES_NUMTYPES] = {"i8", "u8", "i16", "u16", "i32", "u32", "i64", "u64", "f32", "f64"};
+static const size_t bytessizes[BYTES_NUMTYPES] = {1, 1, 2, 2, 4, 4, 8, 8, 4, 8};
+
+static bytesbuffer* tobytes(lua_State *L, int idx)
+{
+    bytesbuffer *b = (bytesbuffer*)lua_touserdata(L, idx);
+
+    if (b == NULL || lua_getmetatable(L, idx) == 0)
+    {
+        return NULL;
+    }
+
+    lua_getref(L, LUA_RIDX_BYTES);
+    bool flag = lua_rawequal(L, -1, -2) != 0;
+    lua_pop(L, 2);
+
+    if (!flag)
+    {
+        return NULL;
+    }
+
+    if (b->root->data == NULL)
+    {
+        b->data = NULL;
+        b->len = 0;
+        b->flags = 0;
+    }
+
+    return b;
+}
+
+static bytesbuffer* checkbytes(lua_State *L, int idx)
+{
+    bytesbuffer *b = tobytes(L, idx);
+
+    if (b == NULL)
+    {
+        luaL_typerror(L, idx, "bytes");
+    }
+    else if (b->data == NULL)
+    {
+        luaL_argerror(L, idx, "bytes released");
+    }
+
+    return b;
+}
+
+static bytesbuffer* newbytes(lua_State *L, size_t extra)
+{
+    bytesbuffer *b = (bytesbuffer*)lua_newuserdata(L, sizeof(bytesbuffer) + extra);
+    lua_getref(L, LUA_RIDX_BYTES);
+    lua_setmetatable(L, -2);
+    return b;
+}
+
+//压入 len 字节的新缓冲, 返回数据指针供宿主直接写入
+LUALIB_API void* tolua_newbytes(lua_State *L, int len)
+{
+    size_t size = len > 0 ? (size_t)len : 0;
+    bytesbuffer *b = newbytes(L, size + 1);
+    b->data = (char*)(b + 1);
+    b->len = size;
+    b->flags = BYTES_TAIL;
+    b->root = b;
+    b->data[size] = '\0';
+    return b->data;
+}
+
+//包装宿主内存, 不复制
+LUALIB_API void tolua_pushbytes(lua_State *L, void *data, int len)
+{
+    bytesbuffer *b = newbytes(L, 0);
+    b->data = (char*)data;
+    b->len = len > 0 ? (size_t)len : 0;
+    b->flags = 0;
+    b->root = b;
+}
+
+//宿主回收 tolua_pushbytes 包装的内存前调用, idx 可以是缓冲本身或它的切片. 之后 lua 侧访问报错, C 接口返回 NULL
+LUALIB_API void tolua_releasebytes(lua_State *L, int idx)
+{
+    bytesbuffer *b = tobytes(L, idx);
+
+    if (b != NULL)
+    {
+        b = b->root;
+        b->data = NULL;
+        b->len = 0;
+        b->flags = 0;
+    }
+}
+
+LUALIB_API void* tolua_tobytes(lua_State *L, int idx, int *len)
+{
+    bytesbuffer *b = tobytes(L, idx);
+
+    if (b == NULL)
+    {
+        *len = 0;
+        return NULL;
+    }
+
+    *len = (int)b->len;
+    return b->data;
+}
+
+//字符串或 tolua.bytes 的数据, 其它类型返回 NULL. 已释放的 bytes 报错, 不能当成别的类型往下走
+const char* tolua_tolbytes(lua_State *L, int idx, size_t *len)
+{
+    if (lua_type(L, idx) == LUA_TUSERDATA)
+    {
+        bytesbuffer *b = tobytes(L, idx);
+
+        if (b != NULL)
+        {
+            luaL_argcheck(L, b->data != NULL, idx, "bytes released");
+            *len = b->len;
+            return b->data;
+        }
+    }
+
+    return lua_tolstring(L, idx, len);
+}
+
+const char* tolua_checklbytes(lua_State *L, int idx, size_t *len)
+{
+    if (lua_type(L, idx) == LUA_TUSERDATA)
+    {
+        bytesbuffer *b = tobytes(L, idx);
+
+        if (b != NULL)
+        {
+            luaL_argcheck(L, b->data != NULL, idx, "bytes released");
+            *len = b->len;
+            return b->data;
+        }
+    }
+
+    return luaL_checklstring(L, idx, len);
+}
+
+//数据后面是否紧跟 '\0', cjson 这类靠结尾 '\0' 停止的解析器据此决定要不要复制
+int tolua_bytesterminated(lua_State *L, int idx)
+{
+    if (lua_type(L, idx) == LUA_TSTRING)
+    {
+        return 1;
+    }
+
+    bytesbuffer *b = tobytes(L, idx);
+    return b != NULL && (b->flags & BYTES_TAIL) && b->data[b->len] == '\0';
+}
+
+//tolua.bytes(size or string)
+static int tolua_bytes(lua_State *L)
+{
+    if (lua_type(L, 1) == LUA_TSTRING)
+    {
+        size_t len;
+        const char *s = lua_tolstring(L, 1, &len);
+        memcpy(tolua_newbytes(L, (int)len), s, len);
+    }
+    else
+    {
+        lua_Integer len = luaL_checkinteger(L, 1);
+        luaL_argcheck(L, len >= 0 && len < INT32_MAX, 1, "invalid size");
+        memset(tolua_newbytes(L, (int)len), 0, (size_t)len);
+    }
+
+    return 1;
+}
+
+//参数 2, 3 为 string.sub 规则的下标 i, j, 返回起始偏移和长度
+static size_t bytes_range(lua_State *L, bytesbuffer *b, size_t *size)
+{
+    lua_Integer len = (lua_Integer)b->len;
+    lua_Integer i = luaL_optinteger(L, 2, 1);
+    lua_Integer j = luaL_optinteger(L, 3, -1);
+    i = i < 0 ? (len + i + 1 > 1 ? len + i + 1 : 1) : (i == 0 ? 1 : i);
+    j = j < 0 ? len + j + 1 : (j > len ? len : j);
+    *size = i <= j ? (size_t)(j - i + 1) : 0;
+    return i <= j ? (size_t)(i - 1) : 0;
+}
+
+//b:sub(i = 1, j = -1), 与 string.sub 相同的下标规则, 返回共享内存的切片
+static int bytes_sub(lua_State *L)
+{
+    bytesbuffer *b = checkbytes(L, 1);
+    size_t len;
+    size_t off = bytes_range(L, b, &len);
+
+    bytesbuffer *s = newbytes(L, 0);
+    s->data = b->data + off;
+    s->len = len;
+    s->flags = (s->data + s->len < b->data + b->len) ? BYTES_TAIL : b->flags;
+    s->root = b->root;
+
+#if LUA_VERSION_NUM == 501
+    lua_createtable(L, 1, 0);
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, -2, 1);
+#else
+    lua_pushvalue(L, 1);
+#endif
+    lua_setfenv(L, -2);
+    return 1;
+}
+
+//b:tostring(i = 1, j = -1) 复制成 lua 字符串
+static int bytes_tostring(lua_State *L)
+{
+    bytesbuffer *b = checkbytes(L, 1);
+    size_t len;
+    size_t off = bytes_range(L, b, &len);
+    lua_pushlstring(L, b->data + off, len);
+    return 1;
+}
+
+static size_t bytes_checkoffset(lua_State *L, bytesbuffer *b, size_t size)
+{
+    lua_Integer off = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, off >= 0 && (size_t)off + size <= b->len, 2, "offset out of range");
+    return (size_t)off;
+}
+
+//b:readXX(offset), offset 从 0 开始. upvalue 1 为类型
+static int bytes_read(lua_State *L)
+{
+    bytesbuffer *b = checkbytes(L, 1);
+    int type = (int)lua_tointeger(L, lua_upvalueindex(1));
+    const char *p = b->data + bytes_checkoffset(L, b, bytessizes[type]);
+
+    switch (type)
+    {
+        case BYTES_I8:  { int8_t v;   memcpy(&v, p, 1); lua_pushinteger(L, v); break; }
+        case BYTES_U8:  { uint8_t v;  memcpy(&v, p, 1); lua_pushinteger(L, v); break; }
+        case BYTES_I16: { int16_t v;  memcpy(&v, p, 2); lua_pushinteger(L, v); break; }
+        case BYTES_U16: { uint16_t v; memcpy(&v, p, 2); lua_pushinteger(L, v); break; }
+        case BYTES_I32: { int32_t v;  memcpy(&v, p, 4); lua_pushinteger(L, v); break; }
+#if LUA_VERSION_NUM >= 503
+        case BYTES_U32: { uint32_t v; memcpy(&v, p, 4); lua_pushinteger(L, (lua_Integer)v); break; }
+#else
+        case BYTES_U32: { uint32_t v; memcpy(&v, p, 4); lua_pushnumber(L, (lua_Number)v); break; }
+#endif
+        case BYTES_I64: { int64_t v;  memcpy(&v, p, 8); tolua_pushint64(L, v); break; }
+        case BYTES_U64: { uint64_t v; memcpy(&v, p, 8); tolua_pushuint64(L, v); break; }
+        case BYTES_F32: { float v;    memcpy(&v, p, 4); lua_pushnumber(L, v); break; }
+        case BYTES_F64: { double v;   memcpy(&v, p, 8); lua_pushnumber(L, v); break; }
+    }
+
+    return 1;
+}
+
+//b:writeXX(offset, value)
+static int bytes_write(lua_State *L)
+{
+    bytesbuffer *b = checkbytes(L, 1);
+    int type = (int)lua_tointeger(L, lua_upvalueindex(1));
+    char *p = b->data + bytes_checkoffset(L, b, bytessizes[type]);
+
+    switch (type)
+    {
+        case BYTES_I64: { int64_t v = tolua_toint64(L, 3);   memcpy(p, &v, 8); break; }
+        case BYTES_U64: { uint64_t v = tolua_touint64(L, 3); memcpy(p, &v, 8); break; }
+        case BYTES_F32: { float v = (float)luaL_checknumber(L, 3); memcpy(p, &v, 4); break; }
+        case BYTES_F64: { double v = (double)luaL_checknumber(L, 3); memcpy(p, &v, 8); break; }
+        default:
+        {
+            //按补码截断, 有符号和无符号写法一样
+            uint32_t v = (uint32_t)(int64_t)luaL_checknumber(L, 3);
+            memcpy(p, &v, bytessizes[type]);
+            break;
+        }
+    }
+
+    return 0;
+}
+
+//失效的缓冲长度为 0
+static int bytes_len(lua_State *L)
+{
+    bytesbuffer *b = tobytes(L, 1);
+
+    if (b == NULL)
+    {
+        luaL_typerror(L, 1, "bytes");
+    }
+
+    lua_pushinteger(L, (lua_Integer)b->len);
+    return 1;
+}
+
+void tolua_openbytes(lua_State *L)
+{
+    lua_newtable(L);
+    lua_pushstring(L, "__index");
+    lua_newtable(L);
+
+    lua_pushstring(L, "sub");
+    lua_pushcfunction(L, bytes_sub);
+    lua_rawset(L, -3);
+    lua_pushstring(L, "tostring");
+    lua_pushcfunction(L, bytes_tostring);
+    lua_rawset(L, -3);
+    lua_pushstring(L, "len");
+    lua_pushcfunction(L, bytes_len);
+    lua_rawset(L, -3);
+
+    for (int i = 0; i < BYTES_NUMTYPES; i++)
+    {
+        lua_pushfstring(L, "read%s", bytestypes[i]);
+        lua_pushinteger(L, i);
+        lua_pushcclosure(L, bytes_read, 1);
+        lua_rawset(L, -3);
+        lua_pushfstring(L, "write%s", bytestypes[i]);
+        lua_pushinteger(L, i);
+        lua_pushcclosure(L, bytes_write, 1);
+        lua_rawset(L, -3);
+    }
+
+    lua_rawset(L, -3);
+    lua_pushstring(L, "__len");
+    lua_pushcfunction(L, bytes_len);
+    lua_rawset(L, -3);
+    lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_BYTES);
+}
+
+/*---------------------------channel--------------------------------*/
+/*进程级的具名消息通道, 用于不同线程上的 lua_State 之间传数据. 环形队列按 Vyukov 的有界队列实现,
+  每个槽位带序号, push/pop 只用原子操作不持锁; 只有 pop 需要等待时才用到锁和条件变量.
+  消息在 push 时编码成紧凑的二进制块, 只支持 nil/boolean/number/string/table/int64/uint64*/
+#define CHANNEL_DEFAULTSIZE     1024
+#define CHANNEL_MAXSIZE         (1 << 20)
+#define CHANNEL_MAXDEPTH        32
+
+#define MSG_NIL                 0
+#define MSG_FALSE               1
+#define MSG_TRUE                2
+#define MSG_INT                 3       //zigzag varint
+#define MSG_NUMBER              4       //double
+#define MSG_STRING              5       //varint 长度 + 字节
+#define MSG_TABLE               6       //varint 数组长度, varint 哈希项数, 数组值, 键值对
+#define MSG_INT64               7       //5.1 下的 int64 userdata, 8 字节
+#define MSG_UINT64              8
+
+typedef struct chanslot
+{
+    uint32_t seq;
+    uint32_t len;
+    char *data;
+} chanslot;
+
+typedef struct channel
+{
+    struct channel *next;
+    char *name;
+    int refs;                       //持有句柄数, channellock 保护
+    uint32_t mask;
+    char pad0[64];
+    uint32_t tail;                  //生产者位置
+    char pad1[64];
+    uint32_t head;                  //消费者位置
+    char pad2[64];
+    uint32_t waiters;
+    tolua_mutex lock;
+    tolua_cond ready;
+    chanslot slots[1];
+} channel;
+
+static tolua_mutex channellock = TOLUA_MUTEX_INIT;
+static channel *channellist = NULL;
+
+static bool chan_push(channel *ch, char *data, uint32_t len)
+{
+    uint32_t pos = atomic_load32(&ch->tail);
+    chanslot *slot;
+
+    for (;;)
+    {
+        slot = &ch->slots[pos & ch->mask];
+        int32_t dif = (int32_t)(atomic_load32(&slot->seq) - pos);
+
+        if (dif == 0)
+        {
+            if (atomic_cas32(&ch->tail, pos, pos + 1))
+            {
+                break;
+            }
+        }
+        else if (dif < 0)
+        {
+            return false;
+        }
+
+        pos = atomic_load32(&ch->tail);
+    }
+
+    slot->data = data;
+    slot->len = len;
+    atomic_store32(&slot->seq, pos + 1);
+    //和 chan_wait 里 waiters 递增之后的检查配对, 保证不会漏掉唤醒
+    atomic_fence();
+
+    if (atomic_load32(&ch->waiters) > 0)
+    {
+        tolua_lock(&ch->lock);
+        tolua_broadcast(&ch->ready);
+        tolua_unlock(&ch->lock);
+    }
+
+    return true;
+}
+
+static char* chan_pop(channel *ch, uint32_t *len)
+{
+    uint32_t pos = atomic_load32(&ch->head);
+    chanslot *slot;
+
+    for (;;)
+    {
+        slot = &ch->slots[pos & ch->mask];
+        int32_t dif = (int32_t)(atomic_load32(&slot->seq) - (pos + 1));
+
+        if (dif == 0)
+        {
+            if (atomic_cas32(&ch->head, pos, pos + 1))
+            {
+                break;
+            }
+        }
+        else if (dif < 0)
+        {
+            return NULL;
+        }
+
+        pos = atomic_load32(&ch->head);
+    }
+
+    char *data = slot->data;
+    *len = slot->len;
+    atomic_store32(&slot->seq, pos + ch->mask + 1);
+    return data;
+}
+
+static bool chan_empty(channel *ch)
+{
+    uint32_t pos = atomic_load32(&ch->head);
+    return (int32_t)(atomic_load32(&ch->slots[pos & ch->mask].seq) - (pos + 1)) < 0;
+}
+
+#ifndef _WIN32
+static void chan_timedwait(channel *ch, double seconds)
+{
+    struct timeval now;
+    struct timespec ts;
+    gettimeofday(&now, NULL);
+    double t = now.tv_sec + now.tv_usec * 1e-6 + seconds;
+    ts.tv_sec = (time_t)t;
+    ts.tv_nsec = (long)((t - (double)ts.tv_sec) * 1e9);
+    pthread_cond_timedwait(&ch->ready, &ch->lock, &ts);
+}
+#else
+#define chan_timedwait(ch, seconds) SleepConditionVariableSRW(&(ch)->ready, &(ch)->lock, (DWORD)((seconds) * 1000 + 1), 0)
+#endif
+
+//等到队列非空或者超时, 返回队列是否非空
+static bool chan_wait(channel *ch, double timeout)
+{
+    if (!chan_empty(ch))
+    {
+        return true;
+    }
+
+    if (timeout <= 0)
+    {
+        return false;
+    }
+
+    double deadline = bind_seconds() + timeout;
+    bool ready;
+    tolua_lock(&ch->lock);
+    atomic_add32(&ch->waiters, 1);
+
+    while (!(ready = !chan_empty(ch)))
+    {
+        double left = deadline - bind_seconds();
+
+        if (left <= 0)
+        {
+            break;
+        }
+
+        chan_timedwait(ch, left);
+    }
+
+    atomic_add32(&ch->waiters, -1);
+    tolua_unlock(&ch->lock);
+    return ready;
+}
+
+static channel* chan_acquire(const char *name, uint32_t capacity)
+{
+    tolua_lock(&channellock);
+    channel *ch = channellist;
+
+    while (ch != NULL && strcmp(ch->name, name) != 0)
+    {
+        ch = ch->next;
+    }
+
+    if (ch == NULL)
+    {
+        uint32_t size = 2;
+
+        while (size < capacity && size < CHANNEL_MAXSIZE)
+        {
+            size <<= 1;
+        }
+
+        ch = (channel*)malloc(sizeof(channel) + sizeof(chanslot) * (size - 1));
+
+        if (ch != NULL)
+        {
+            memset(ch, 0, sizeof(channel));
+            ch->name = chunk_strdup(name);
+
+            if (ch->name == NULL)
+            {
+                free(ch);
+                tolua_unlock(&channellock);
+                return NULL;
+            }
+
+            ch->mask = size - 1;
+
+            for (uint32_t i = 0; i < size; i++)
+            {
+                ch->slots[i].seq = i;
+                ch->slots[i].data = NULL;
+            }
+
+            tolua_mutexinit(&ch->lock);
+            tolua_condinit(&ch->ready);
+            ch->next = channellist;
+            channellist = ch;
+        }
+    }
+
+    if (ch != NULL)
+    {
+        ++ch->refs;
+    }
+
+    tolua_unlock(&channellock);
+    return ch;
+}
+
+//最后一个句柄释放时通道连同未取走的消息一起销毁
+static void chan_release(channel *ch)
+{
+    tolua_lock(&channellock);
+
+    if (--ch->refs > 0)
+    {
+        tolua_unlock(&channellock);
+        return;
+    }
+
+    channel **p = &channellist;
+
+    while (*p != ch)
+    {
+        p = &(*p)->next;
+    }
+
+    *p = ch->next;
+    tolua_unlock(&channellock);
+
+    uint32_t len;
+    char *data;
+
+    while ((data = chan_pop(ch, &len)) != NULL)
+    {
+        free(data);
+    }
+
+    tolua_mutexfree(&ch->lock);
+    tolua_condfree(&ch->ready);
+    free(ch->name);
+    free(ch);
+}
+
+static bool msg_write(blobwriter *w, const void *p, size_t sz)
+{
+    return precompile_writer(NULL, p, sz, w) == 0;
+}
+
+static bool msg_writebyte(blobwriter *w, int b)
+{
+    unsigned char c = (unsigned char)b;
+    return msg_write(w, &c, 1);
+}
+
+static bool msg_writevarint(blobwriter *w, uint64_t v)
+{
+    unsigned char buf[10];
+    int n = 0;
+
+    while (v >= 0x80)
+    {
+        buf[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+
+    buf[n++] = (unsigned char)v;
+    return msg_write(w, buf, n);
+}
+
+static bool msg_isarraykey(lua_State *L, int idx, size_t n)
+{
+    if (lua_type(L, idx) != LUA_TNUMBER)
+    {
+        return false;
+    }
+
+    lua_Number k = lua_tonumber(L, idx);
+    return k >= 1 && k <= (lua_Number)n && k == (lua_Number)(size_t)k;
+}
+
+static bool msg_isudata(lua_State *L, int idx, int ref)
+{
+    if (!lua_getmetatable(L, idx))
+    {
+        return false;
+    }
+
+    lua_getref(L, ref);
+    bool equal = lua_rawequal(L, -1, -2) != 0;
+    lua_pop(L, 2);
+    return equal;
+}
+
+//编码 idx 处的值, 失败时返回错误信息
+static const char* msg_encode(lua_State *L, int idx, blobwriter *w, int depth)
+{
+    bool ok = true;
+
+    switch (lua_type(L, idx))
+    {
+        case LUA_TNIL:
+            ok = msg_writebyte(w, MSG_NIL);
+            break;
+        case LUA_TBOOLEAN:
+            ok = msg_writebyte(w, lua_toboolean(L, idx) ? MSG_TRUE : MSG_FALSE);
+            break;
+        case LUA_TNUMBER:
+        {
+#if LUA_VERSION_NUM >= 503
+            if (lua_isinteger(L, idx))
+            {
+                int64_t n = (int64_t)lua_tointeger(L, idx);
+                ok = msg_writebyte(w, MSG_INT) && msg_writevarint(w, ((uint64_t)n << 1) ^ (uint64_t)(n >> 63));
+                break;
+            }
+#endif
+            double d = (double)lua_tonumber(L, idx);
+            ok = msg_writebyte(w, MSG_NUMBER) && msg_write(w, &d, sizeof(double));
+            break;
+        }
+        case LUA_TSTRING:
+        {
+            size_t len;
+            const char *str = lua_tolstring(L, idx, &len);
+            ok = msg_writebyte(w, MSG_STRING) && msg_writevarint(w, len) && msg_write(w, str, len);
+            break;
+        }
+        case LUA_TTABLE:
+        {
+            if (depth >= CHANNEL_MAXDEPTH)
+            {
+                return "table nesting too deep or cyclic";
+            }
+
+            idx = abs_index(L, idx);
+            size_t n = lua_objlen(L, idx);
+            size_t nhash = 0;
+            lua_pushnil(L);
+
+            while (lua_next(L, idx))
+            {
+                nhash += msg_isarraykey(L, -2, n) ? 0 : 1;
+                lua_pop(L, 1);
+            }
+
+            if (!(msg_writebyte(w, MSG_TABLE) && msg_writevarint(w, n) && msg_writevarint(w, nhash)))
+            {
+                return "not enough memory";
+            }
+
+            for (size_t i = 1; i <= n; i++)
+            {
+                lua_rawgeti(L, idx, (int)i);
+                const char *err = msg_encode(L, -1, w, depth + 1);
+                lua_pop(L, 1);
+
+                if (err != NULL)
+                {
+                    return err;
+                }
+            }
+
+            lua_pushnil(L);
+
+            while (lua_next(L, idx))
+            {
+                if (!msg_isarraykey(L, -2, n))
+                {
+                    const char *err = msg_encode(L, -2, w, depth + 1);
+
+                    if (err == NULL)
+                    {
+                        err = msg_encode(L, -1, w, depth + 1);
+                    }
+
+                    if (err != NULL)
+                    {
+                        lua_pop(L, 2);
+                        return err;
+                    }
+                }
+
+                lua_pop(L, 1);
+            }
+
+            break;
+        }
+        case LUA_TUSERDATA:
+        {
+            int tag;
+
+            if (msg_isudata(L, idx, LUA_RIDX_INT64))
+            {
+                tag = MSG_INT64;
+            }
+            else if (msg_isudata(L, idx, LUA_RIDX_UINT64))
+            {
+                tag = MSG_UINT64;
+            }
+            else
+            {
+                return "cannot send userdata";
+            }
+
+            ok = msg_writebyte(w, tag) && msg_write(w, lua_touserdata(L, idx), 8);
+            break;
+        }
+        case LUA_TFUNCTION:
+            return "cannot send function";
+        case LUA_TTHREAD:
+            return "cannot send thread";
+        default:
+            return "cannot send userdata";
+    }
+
+    return ok ? NULL : "not enough memory";
+}
+
+static uint64_t msg_readvarint(const unsigned char **p)
+{
+    uint64_t v = 0;
+    int shift = 0;
+    unsigned char c;
+
+    do
+    {
+        c = *(*p)++;
+        v |= (uint64_t)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+
+    return v;
+}
+
+//消息只来自 msg_encode, 不再校验格式
+static void msg_decode(lua_State *L, const unsigned char **p)
+{
+    int tag = *(*p)++;
+
+    switch (tag)
+    {
+        case MSG_NIL:
+            lua_pushnil(L);
+            break;
+        case MSG_FALSE:
+        case MSG_TRUE:
+            lua_pushboolean(L, tag == MSG_TRUE);
+            break;
+        case MSG_INT:
+        {
+            uint64_t v = msg_readvarint(p);
+            int64_t n = (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+#if LUA_VERSION_NUM >= 503
+            lua_pushinteger(L, (lua_Integer)n);
+#else
+            lua_pushnumber(L, (lua_Number)n);
+#endif
+            break;
+        }
+        case MSG_NUMBER:
+        {
+            double d;
+            memcpy(&d, *p, sizeof(double));
+            *p += sizeof(double);
+            lua_pushnumber(L, d);
+            break;
+        }
+        case MSG_STRING:
+        {
+            size_t len = (size_t)msg_readvarint(p);
+            lua_pushlstring(L, (const char*)*p, len);
+            *p += len;
+            break;
+        }
+        case MSG_TABLE:
+        {
+            int n = (int)msg_readvarint(p);
+            int nhash = (int)msg_readvarint(p);
+            lua_createtable(L, n, nhash);
+
+            for (int i = 1; i <= n; i++)
+            {
+                msg_decode(L, p);
+                lua_rawseti(L, -2, i);
+            }
+
+            for (int i = 0; i < nhash; i++)
+            {
+                msg_decode(L, p);
+                msg_decode(L, p);
+                lua_rawset(L, -3);
+            }
+
+            break;
+        }
+        case MSG_INT64:
+        case MSG_UINT64:
+        {
+            uint64_t v;
+            memcpy(&v, *p, 8);
+            *p += 8;
+
+            if (tag == MSG_INT64)
+            {
+                tolua_pushint64(L, (int64_t)v);
+            }
+            else
+            {
+                tolua_pushuint64(L, v);
+            }
+
+            break;
+        }
+    }
+}
+
+static void msg_push(lua_State *L, char *data)
+{
+    const unsigned char *p = (const unsigned char*)data;
+    msg_decode(L, &p);
+    free(data);
+}
+
+static channel* checkchannel(lua_State *L)
+{
+    channel **ud = (channel**)luaL_checkudata(L, 1, "tolua.channel");
+
+    if (*ud == NULL)
+    {
+        luaL_error(L, "channel already closed");
+    }
+
+    return *ud;
+}
+
+//tolua.channel(name, capacity = 1024), 同名通道在进程内共享, 容量以第一次创建为准
+static int tolua_channel(lua_State *L)
+{
+    const char *name = luaL_checkstring(L, 1);
+    lua_Integer capacity = luaL_optinteger(L, 2, CHANNEL_DEFAULTSIZE);
+    channel **ud = (channel**)lua_newuserdata(L, sizeof(channel*));
+    *ud = chan_acquire(name, capacity > 0 ? (uint32_t)capacity : CHANNEL_DEFAULTSIZE);
+
+    if (*ud == NULL)
+    {
+        return luaL_error(L, "not enough memory");
+    }
+
+    lua_getref(L, LUA_RIDX_CHANNEL);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+//ch:push(value), 队列满时返回 false
+static int channel_push(lua_State *L)
+{
+    channel *ch = checkchannel(L);
+    blobwriter w = {NULL, 0, 0};
+    lua_settop(L, 2);
+    luaL_checkstack(L, CHANNEL_MAXDEPTH * 3, NULL);
+    const char *err = msg_encode(L, 2, &w, 0);
+
+    if (err != NULL)
+    {
+        free(w.data);
+        return luaL_error(L, "channel push: %s", err);
+    }
+
+    //编码缓冲按 4K 起步, 收缩到实际长度再入队
+    char *data = (char*)realloc(w.data, w.len);
+    data = data != NULL ? data : w.data;
+    bool ok = chan_push(ch, data, (uint32_t)w.len);
+
+    if (!ok)
+    {
+        free(data);
+    }
+
+    lua_pushboolean(L, ok);
+    return 1;
+}
+
+//ch:pop(timeout = 0), 返回 true, value 或者 false
+static int channel_pop(lua_State *L)
+{
+    channel *ch = checkchannel(L);
+    double timeout = luaL_optnumber(L, 2, 0);
+    luaL_checkstack(L, CHANNEL_MAXDEPTH * 3, NULL);
+    uint32_t len;
+    char *data;
+
+    while ((data = chan_pop(ch, &len)) == NULL)
+    {
+        double t0 = bind_seconds();
+
+        if (!chan_wait(ch, timeout))
+        {
+            lua_pushboolean(L, 0);
+            return 1;
+        }
+
+        timeout -= bind_seconds() - t0;
+    }
+
+    lua_pushboolean(L, 1);
+    msg_push(L, data);
+    return 2;
+}
+
+//ch:drain(t, max = capacity, timeout = 0), 取出的消息依次放进 t[1..n], 返回 n
+static int channel_drain(lua_State *L)
+{
+    channel *ch = checkchannel(L);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    int max = (int)luaL_optinteger(L, 3, (lua_Integer)ch->mask + 1);
+    double timeout = luaL_optnumber(L, 4, 0);
+    luaL_checkstack(L, CHANNEL_MAXDEPTH * 3, NULL);
+    int n = 0;
+    uint32_t len;
+    char *data;
+
+    if (max > 0 && timeout > 0)
+    {
+        chan_wait(ch, timeout);
+    }
+
+    while (n < max && (data = chan_pop(ch, &len)) != NULL)
+    {
+        msg_push(L, data);
+        lua_rawseti(L, 2, ++n);
+    }
+
+    lua_pushinteger(L, n);
+    return 1;
+}
+
+static int channel_size(lua_State *L)
+{
+    channel *ch = checkchannel(L);
+    uint32_t size = atomic_load32(&ch->tail) - atomic_load32(&ch->head);
+    lua_pushinteger(L, size > ch->mask + 1 ? 0 : size);
+    return 1;
+}
+
+static int channel_close(lua_State *L)
+{
+    channel **ud = (channel**)luaL_checkudata(L, 1, "tolua.channel");
+
+    if (*ud != NULL)
+    {
+        chan_release(*ud);
+        *ud = NULL;
+    }
+
+    return 0;
+}
+
+static int channel_tostring(lua_State *L)
+{
+    channel **ud = (channel**)luaL_checkudata(L, 1, "tolua.channel");
+    lua_pushfstring(L, "channel: %s", *ud != NULL ? (*ud)->name : "(closed)");
+    return 1;
+}
+
+static const struct luaL_Reg channel_funcs[] =
+{
+    { "push", channel_push },
+    { "pop", channel_pop },
+    { "drain", channel_drain },
+    { "size", channel_size },
+    { "close", channel_close },
+    { NULL, NULL }
+};
+
+void tolua_openchannel(lua_State *L)
+{
+    luaL_newmetatable(L, "tolua.channel");
+    lua_pushstring(L, "__index");
+    lua_newtable(L);
+
+    for (const luaL_Reg *f = channel_funcs; f->func; f++)
+    {
+        lua_pushstring(L, f->name);
+        lua_pushcfunction(L, f->func);
+        lua_rawset(L, -3);
+    }
+
+    lua_rawset(L, -3);
+    lua_pushstring(L, "__gc");
+    lua_pushcfunction(L, channel_close);
+    lua_rawset(L, -3);
+    lua_pushstring(L, "__tostring");
+    lua_pushcfunction(L, channel_tostring);
+    lua_rawset(L, -3);
+    lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_CHANNEL);
+}
+
+static const struct luaL_Reg tolua_funcs[] = 
+{
+	{ "gettime", tolua_gettime },
+	{ "typename", tolua_bnd_type },
+	{ "setpeer", tolua_bnd_setpeer},
+	{ "getpeer", tolua_bnd_getpeer},
+    { "getfunction", tolua_bnd_getfunction},
+    { "initset", tolua_initsettable},
+    { "initget", tolua_initgettable},
+    { "int64", tolua_newint64},        
+    { "uint64", tolua_newuint64},
+    { "traceback", traceback},
+    { "errortraceback", _errortraceback},
+    { "addtimer", tolua_addtimer},
+    { "addframetimer", tolua_addframetimer},
+    { "removetimer", tolua_removetimer},
+    { "waitforseconds", tolua_waitforseconds},
+    { "waitforframes", tolua_waitforframes},
+    { "startco", tolua_startco},
+    { "copoolstats", tolua_copoolstats},
+    { "channel", tolua_channel},
+    { "bytes", tolua_bytes},
+    { "addlistener", tolua_addlistener},
+    { "removelistener", tolua_removelistener},
+    { "clearlisteners", tolua_clearlisteners},
+    { "dispatch", tolua_dispatch},
+    { "post", tolua_post},
+	{ NULL, NULL }
+};
+
+void tolua_setluabaseridx(lua_State *L)
+{    
+#if LUA_VERSION_NUM == 501
+	for (int i = 1; i <= 64; i++)
+#else
+    for (int i = LUA_RIDX_LAST + 1; i <= 64; i++)
+#endif
+	{
+		lua_pushinteger(L, i);
+		lua_rawseti(L, LUA_REGISTRYINDEX, i);
+	}
+
+    //同lua5.1.5之后版本放入mainstate和_G
+#if LUA_VERSION_NUM == 501    
+	lua_pushthread(L);
+	lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+	lua_pushglobaltable(L);
+	lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+#endif
+
+    //cache require函数
+    lua_getglobal(L, "require");
+    lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_REQUIRE);      
+}
+
+//upvalue 1 为原来的 preload 表. 代理表本身保持为空, 新增, 改写和删除都经过这里
+static int preload_newindex(lua_State *L)
+{
+    ++getcontext(L)->preloadversion;
+    lua_settop(L, 3);
+    lua_rawset(L, lua_upvalueindex(1));
+    return 0;
+}
+
+#if LUA_VERSION_NUM >= 502
+static int preload_pairs(lua_State *L)
+{
+    lua_getglobal(L, "next");
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_pushnil(L);
+    return 3;
+}
+#endif
+
+void tolua_openpreload(lua_State *L)
+{
+    lua_getglobal(L, "package");
+    lua_pushstring(L, "preload");
+    lua_rawget(L, -2);
+
+    //package.preload 换成代理, require 的 preload 搜索器经过 __index 仍能找到原表里的项
+    if (lua_istable(L, -1) && !lua_getmetatable(L, -1))
+    {
+        int preload = lua_gettop(L);
+        lua_newtable(L);                                        //stack: package preload proxy
+        lua_newtable(L);
+        lua_pushstring(L, "__index");
+        lua_pushvalue(L, preload);
+        lua_rawset(L, -3);
+        lua_pushstring(L, "__newindex");
+        lua_pushvalue(L, preload);
+        lua_pushcclosure(L, preload_newindex, 1);
+        lua_rawset(L, -3);
+#if LUA_VERSION_NUM >= 502
+        lua_pushstring(L, "__pairs");
+        lua_pushvalue(L, preload);
+        lua_pushcclosure(L, preload_pairs, 1);
+        lua_rawset(L, -3);
+#endif
+        lua_setmetatable(L, -2);
+        lua_replace(L, preload);
+        lua_pushstring(L, "preload");
+        lua_pushvalue(L, preload);
+        lua_rawset(L, -4);
+#ifdef LUA_PRELOAD_TABLE
+        lua_pushvalue(L, preload);
+        lua_setfield(L, LUA_REGISTRYINDEX, LUA_PRELOAD_TABLE);
+#endif
+    }
+    else if (lua_istable(L, -1))
+    {
+        lua_pop(L, 1);
+    }
+
+    lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_PRELOAD);    
+    lua_newtable(L);
+    lua_newtable(L);
+    lua_pushstring(L, "__mode");
+    lua_pushstring(L, "k");
+    lua_rawset(L, -3);
+    lua_setmetatable(L, -2);
+    lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_PRELOADCACHE);
+    lua_pushstring(L, "loaded");
+    lua_rawget(L, -2);
+    lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_LOADED);    
+    lua_pop(L, 1);
+}
+
+void tolua_opencontext(lua_State *L)
+{
+    tolua_context *ctx = (tolua_context*)lua_newuserdata(L, sizeof(tolua_context));
+    memset(ctx, 0, sizeof(tolua_context));
+    ctx->classversion = 1;
+    ctx->preloadversion = 1;
+    lua_newtable(L);
+    lua_pushstring(L, "__gc");
+    lua_pushcfunction(L, context_gc);
+    lua_rawset(L, -3);
+    lua_setmetatable(L, -2);
+    lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_CONTEXT);
+#if LUA_VERSION_NUM == 504
+    getcontext(L) = ctx;
+#endif
+}
+
+void tolua_openintern(lua_State *L)
+{
+    lua_newtable(L);
+    lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_INTERN);
+}
+
+void tolua_opentraceback(lua_State *L)
+{
+    lua_getglobal(L, "debug");
+    lua_pushstring(L, "traceback");
+    lua_rawget(L, -2);
+    lua_pushvalue(L, -1);
+    lua_setglobal(L, "traceback"); 
+    lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_TRACEBACK);
+    lua_pop(L, 1);    
+
+    lua_pushcfunction(L, traceback);
+    lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_CUSTOMTRACEBACK);    
+}
+
+void tolua_openubox(lua_State *L)
+{
+#ifdef TOLUA_NATIVE_UBOX
+    if (ubox_selftest(L))
+    {
+        getcontext(L)->nativeobj = true;
+        ubox *box = (ubox*)lua_newuserdata(L, sizeof(ubox));
+        memset(box, 0, sizeof(ubox));
+        lua_newtable(L);
+        lua_pushstring(L, "__gc");
+        lua_pushcfunction(L, ubox_free);
+        lua_rawset(L, -3);
+        lua_setmetatable(L, -2);
+#if LUA_VERSION_NUM == 504
+        lua_newtable(L);
+        lua_newtable(L);
+        lua_pushstring(L, "__mode");
+        lua_pushstring(L, "v");
+        lua_rawset(L, -3);
+        lua_setmetatable(L, -2);
+        lua_setiuservalue(L, -2, 1);
+#endif
+        lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_UBOX);
+        return;
+    }
+#endif
+
+	lua_newtable(L);
+	lua_newtable(L);            
+	lua_pushstring(L, "__mode");
+	lua_pushstring(L, "v");
+	lua_rawset(L, -3);
+	lua_setmetatable(L, -2);            
+	lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_UBOX);	
+}
+
+void tolua_openvaluefields(lua_State *L)
+{
+    const char* fields[] = {"x", "y", "z", "w", "r", "g", "b", "a"};
+    lua_createtable(L, 8, 0);
+
+    for (int i = 0; i < 8; i++)
+    {
+        lua_pushstring(L, fields[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+
+    lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_VALUEFIELDS);
+}
+
+void tolua_openfixedmap(lua_State *L)
+{
+    refmap *map = (refmap*)lua_newuserdata(L, sizeof(refmap));
+    memset(map, 0, sizeof(refmap));
+    lua_newtable(L);
+    lua_pushstring(L, "__gc");
+    lua_pushcfunction(L, refmap_free);
+    lua_rawset(L, -3);
+    lua_setmetatable(L, -2);
+	lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_FIXEDMAP);		
+}
+
+static const char *valuetypeclasses[] = 
+{
+    "Vector3", "Quaternion", "Vector2", "Color", "Vector4", "Ray", "Bounds", "Touch", "LayerMask", "RaycastHit", NULL
+};
+
+//stack: map mt, 用一个以 mt 为元表的空表问 GetLuaValueType, 得到的类型记进 map
+static void tolua_probevaluetype(lua_State *L)
+{
+    if (!lua_istable(L, -1))
+    {
+        lua_pop(L, 1);
+        return;
+    }
+
+    lua_pushvalue(L, -1);
+    lua_rawget(L, -3);
+
+    if (!lua_isnil(L, -1))
+    {
+        lua_pop(L, 2);
+        return;
+    }
+
+    lua_pop(L, 1);
+    lua_getref(L, LUA_RIDX_CHECKVALUE);
+    lua_newtable(L);
+    lua_pushvalue(L, -3);
+    lua_setmetatable(L, -2);                                    //stack: map mt GetLuaValueType probe
+
+    if (lua_pcall(L, 1, 1, 0) == 0 && lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) != 0)
+    {
+        lua_rawset(L, -3);
+    }
+    else
+    {
+        lua_pop(L, 2);
+    }
+}
+
+//对于下列读取lua 特定文件需要判空报错
+void tolua_openvaluetype(lua_State *L)
+{
+	lua_getglobal(L, "GetLuaValueType");
+	lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_CHECKVALUE);	
+    lua_newtable(L);
+    lua_getglobal(L, "ValueType");
+
+    if (lua_istable(L, -1))
+    {
+        lua_pushnil(L);
+
+        while (lua_next(L, -2) != 0)
+        {
+            if (lua_type(L, -1) == LUA_TNUMBER && (lua_istable(L, -2) || lua_isuserdata(L, -2)))
+            {
+                lua_pushvalue(L, -2);
+                lua_insert(L, -2);
+                lua_rawset(L, -5);
+            }
+            else
+            {
+                lua_pop(L, 1);
+            }
+        }
+    }
+
+    lua_pop(L, 1);
+
+    for (const char **name = valuetypeclasses; *name != NULL; name++)
+    {
+        lua_getglobal(L, *name);
+        tolua_probevaluetype(L);
+    }
+
+    lua_getref(L, LUA_RIDX_INT64);
+    tolua_probevaluetype(L);
+    lua_getref(L, LUA_RIDX_UINT64);
+    tolua_probevaluetype(L);
+
+    //元表由 map 锚定, 地址不变, 查询时直接比较指针
+    tolua_context *ctx = getcontext(L);
+    ctx->valuetypes = 0;
+    lua_pushnil(L);
 
-void tolua_setluabaseridx(lua_State *L)
-{    
-#if LUA_VERSION_NUM == 501
-	for (int i = 1; i <= 64; i++)
-#else
-    for (int i = LUA_RIDX_LAST + 1; i <= 64; i++)
-#endif
-	{
-		lua_pushinteger(L, i);
-		lua_rawseti(L, LUA_REGISTRYINDEX, i);
-	}
+    while (lua_next(L, -2) != 0)
+    {
+        int id = (int)lua_tointeger(L, -1);
 
-    //同lua5.1.5之后版本放入mainstate和_G
-#if LUA_VERSION_NUM == 501    
-	lua_pushthread(L);
-	lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
-	lua_pushglobaltable(L);
-	lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
-#endif
+        if (id != 0 && ctx->valuetypes < TOLUA_MAXVALUETYPES)
+        {
+            ctx->valuetypemeta[ctx->valuetypes] = lua_topointer(L, -2);
+            ctx->valuetypeid[ctx->valuetypes++] = id;
+        }
 
-    //cache require函数
-    lua_getglobal(L, "require");
-    lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_REQUIRE);      
-}
+        lua_pop(L, 1);
+    }
 
-void tolua_openpreload(lua_State *L)
-{
-    lua_getglobal(L, "package");
-    lua_pushstring(L, "preload");
-    lua_rawget(L, -2);
-    lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_PRELOAD);    
-    lua_pushstring(L, "loaded");
-    lua_rawget(L, -2);
-    lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_LOADED);    
-    lua_pop(L, 1);
+	lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_VALUETYPE);
 }
 
-void tolua_opentraceback(lua_State *L)
+//lua New 生成的表是默认布局(只有这些number字段)才走native, 否则保持lua New/Get
+static void tolua_openvaluemeta(lua_State *L, int pack, int meta, int field, int n)
 {
-    lua_getglobal(L, "debug");
-    lua_pushstring(L, "traceback");
-    lua_rawget(L, -2);
-    lua_pushvalue(L, -1);
-    lua_setglobal(L, "traceback"); 
-    lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_TRACEBACK);
-    lua_pop(L, 1);    
+    int top = lua_gettop(L);
+    bool flag = false;
+    lua_getref(L, pack);
 
-    lua_pushcfunction(L, traceback);
-    lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_CUSTOMTRACEBACK);    
-}
+    for (int i = 1; i <= n; i++)
+    {
+        lua_pushnumber(L, i);
+    }
 
-void tolua_openubox(lua_State *L)
-{
-	lua_newtable(L);
-	lua_newtable(L);            
-	lua_pushstring(L, "__mode");
-	lua_pushstring(L, "v");
-	lua_rawset(L, -3);
-	lua_setmetatable(L, -2);            
-	lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_UBOX);	
-}
+    if (lua_pcall(L, n, 1, 0) == 0 && lua_istable(L, -1) && lua_getmetatable(L, -1) != 0)
+    {
+        int count = 0;
+        flag = true;
+        lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_VALUEFIELDS);    //stack: v mt fields
 
-void tolua_openfixedmap(lua_State *L)
-{
-	lua_newtable(L);
-	//lua_newtable(L);
-	//lua_pushstring(L, "__mode");
-	//lua_pushstring(L, "k");
-	//lua_rawset(L, -3);
-	//lua_setmetatable(L, -2);    	
-	lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_FIXEDMAP);		
-}
+        for (int i = 0; i < n; i++)
+        {
+            lua_rawgeti(L, -1, field + i);
+            lua_rawget(L, top + 1);
 
-//对于下列读取lua 特定文件需要判空报错
-void tolua_openvaluetype(lua_State *L)
-{
-	lua_getglobal(L, "GetLuaValueType");
-	lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_CHECKVALUE);	
+            if (lua_type(L, -1) != LUA_TNUMBER || lua_tonumber(L, -1) != i + 1)
+            {
+                flag = false;
+            }
+
+            lua_pop(L, 1);
+        }
+
+        lua_pop(L, 1);                                              //stack: v mt
+        lua_pushnil(L);
+
+        while (lua_next(L, top + 1) != 0)
+        {
+            ++count;
+            lua_pop(L, 1);
+        }
+
+        flag = flag && count == n;
+    }
+
+    if (flag)
+    {
+        lua_pushvalue(L, top + 2);
+    }
+    else
+    {
+        lua_pushnil(L);
+    }
+
+    lua_rawseti(L, LUA_REGISTRYINDEX, meta);
+    lua_settop(L, top);
 }
 
 void tolua_openluavec3(lua_State *L)
@@ -2309,6 +9155,7 @@ void tolua_openluavec3(lua_State *L)
 	lua_rawget(L, -2);
 	lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_UNPACKVEC3);	
 	lua_pop(L, 1);
+    tolua_openvaluemeta(L, LUA_RIDX_PACKVEC3, LUA_RIDX_VEC3META, VALUE_XYZW, 3);
 }
 
 void tolua_openluavec2(lua_State *L)
@@ -2328,6 +9175,7 @@ void tolua_openluavec2(lua_State *L)
 	lua_rawget(L, -2);
 	lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_UNPACKVEC2);	
 	lua_pop(L, 1);
+    tolua_openvaluemeta(L, LUA_RIDX_PACKVEC2, LUA_RIDX_VEC2META, VALUE_XYZW, 2);
 }
 
 void tolua_openluavec4(lua_State *L)
@@ -2347,6 +9195,7 @@ void tolua_openluavec4(lua_State *L)
 	lua_rawget(L, -2);
 	lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_UNPACKVEC4);	
 	lua_pop(L, 1);
+    tolua_openvaluemeta(L, LUA_RIDX_PACKVEC4, LUA_RIDX_VEC4META, VALUE_XYZW, 4);
 }
 
 void tolua_openluaclr(lua_State *L)
@@ -2366,6 +9215,7 @@ void tolua_openluaclr(lua_State *L)
 	lua_rawget(L, -2);
 	lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_UNPACKCLR);	
 	lua_pop(L, 1);
+    tolua_openvaluemeta(L, LUA_RIDX_PACKCLR, LUA_RIDX_CLRMETA, VALUE_RGBA, 4);
 }
 
 void tolua_openluaquat(lua_State *L)
@@ -2385,6 +9235,7 @@ void tolua_openluaquat(lua_State *L)
 	lua_rawget(L, -2);
 	lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_UNPACKQUAT);		
 	lua_pop(L, 1);
+    tolua_openvaluemeta(L, LUA_RIDX_PACKQUAT, LUA_RIDX_QUATMETA, VALUE_XYZW, 4);
 }
 
 void tolua_openlualayermask(lua_State *L)
@@ -2618,18 +9469,25 @@ static const luaL_Reg loadedlibs[] =
 
 LUALIB_API void tolua_openlibs(lua_State *L)
 {   
-    initmodulebuffer();
     luaL_openlibs(L);   
     int top = lua_gettop(L);        
     
     tolua_setluabaseridx(L);    
+    tolua_opencontext(L);
+    tolua_openintern(L);
     tolua_opentraceback(L);
     tolua_openpreload(L);
     tolua_openubox(L);
     tolua_openfixedmap(L);    
+    tolua_openvaluefields(L);
     tolua_openint64(L);
     tolua_openuint64(L);
     tolua_openvptr(L);    
+    tolua_openscheduler(L);
+    tolua_opencopool(L);
+    tolua_openchannel(L);
+    tolua_openbytes(L);
+    tolua_openeventbus(L);
     //tolua_openrequire(L);
      
     for (const luaL_Reg *lib = loadedlibs; lib->func; lib++) 
@@ -2682,14 +9540,39 @@ LUALIB_API bool tolua_getflag(int bit)
     return toluaflags & bit ? true : false;
 }
 
-static luaL_Buffer lua_buffer[3];
-static int _bufferIndex = 0;
+int tolua_stateflags(lua_State *L)
+{
+    tolua_context *ctx = getcontext(L);
+    return (toluaflags & ~ctx->flagmask) | (ctx->flags & ctx->flagmask);
+}
+
+//只影响这个 state, 设置过的位不再跟随 tolua_setflag
+LUALIB_API void tolua_setstateflag(lua_State *L, int bit, bool flag)
+{
+    tolua_context *ctx = getcontext(L);
+    ctx->flagmask |= bit;
+
+    if (flag)
+    {
+        ctx->flags |= bit;
+    }
+    else
+    {
+        ctx->flags &= ~bit;
+    }
+}
+
+LUALIB_API bool tolua_getstateflag(lua_State *L, int bit)
+{
+    return tolua_stateflags(L) & bit ? true : false;
+}
 
 LUALIB_API luaL_Buffer* tolua_buffinit(lua_State *L)
 {
-    luaL_Buffer* buffer = &lua_buffer[_bufferIndex & 3];
+    tolua_context *ctx = getcontext(L);
+    luaL_Buffer* buffer = &ctx->buffers[ctx->bufferindex & 3];
     luaL_buffinit(L, buffer);
-    ++_bufferIndex;
+    ++ctx->bufferindex;
     return buffer;
 }
 
@@ -2713,18 +9596,378 @@ LUALIB_API void tolua_addchar(luaL_Buffer *b, char c)
     luaL_addchar(b, c);
 }
 
+/*帧内 gc 预算. 开启后由 tolua_update / tolua_lateupdate 在预算内切片执行 LUA_GCSTEP.
+  片的大小按实测每 KB 步长耗时调整. 每帧至少推进本帧的分配量, 预算不够时宁可超时也不让内存失控.
+  自动 gc 不完全停掉, 触发点推到 estimate * GC_BACKSTOP%: 没有帧驱动的长调用或加载期间内存涨到这里由自动 gc 兜底,
+  下一帧控制器再把触发点推回去*/
+#define GC_PAUSE            200         //回收结束后内存涨到 estimate * 200% 才开始下个周期
+#define GC_BACKSTOP         400         //自动 gc 兜底的触发点
+#define GC_SLICE            100e-6      //单片最长 100 微秒
+#define GC_SWITCHDELAY      600         //5.4 切换模式后至少隔这么多帧再切
+#define GC_STEPSIZE         10          //5.4 一次 step 至少做 2^gcstepsize 字节的工作, 默认 8K 在清扫阶段太粗
+#define GC_EMA(a, v)        ((a) == 0 ? (v) : (a) * 0.875 + (v) * 0.125)
+
+/*标记和清扫每 KB 步长的耗时差一个量级, 分开估计*/
+#if defined(LUA_JITLIBNAME)
+#define GC_SWEEPING(L)      (G(L)->gc.state >= GCSsweepstring)
+#elif LUA_VERSION_NUM == 504
+#define GC_SWEEPING(L)      (G(L)->gcstate >= GCSswpallgc && G(L)->gcstate <= GCScallfin)
+#else
+#define GC_SWEEPING(L)      0
+#endif
+
+typedef struct gcctrl
+{
+    double budget;
+    double spent;               //本帧已用
+    double stepped;             //本帧已推进 KB
+    double allocated;           //本帧已分配 KB
+    double kbcost[2];           //标记/清扫每 KB 步长耗时
+    double youngcost;           //5.4 分代一次 young 回收耗时
+    double cyclecost;           //本轮增量周期累计耗时
+    double allocrate;           //每帧分配 KB
+    int lastkb;
+    int steps;
+    int estimate;               //上次回收结束时的内存
+    int streak;                 //连续满足切换条件的回收次数
+    int cooldown;
+    int backoff;                //分代试过不合适, 下次再试的间隔翻倍
+    bool incycle;
+    tolua_GCStats stats;
+} gcctrl;
+
+static gcctrl *getgcctrl(lua_State *L)
+{
+    lua_getref(L, LUA_RIDX_GCCTRL);
+    gcctrl *c = (gcctrl*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    return c;
+}
+
+//把自动 gc 的触发点设到 estimate * GC_BACKSTOP%. 没有内部头文件的版本在开启时调大 pause 代替
+static void gc_park(lua_State *L, gcctrl *c)
+{
+    double limit = (double)c->estimate * 1024 * GC_BACKSTOP / 100;
+#if defined(LUA_JITLIBNAME)
+    global_State *g = G(L);
+    g->gc.threshold = limit > (double)g->gc.total ? (GCSize)limit : g->gc.total;
+#elif LUA_VERSION_NUM == 504
+    lua_gc(L, LUA_GCRESTART, 0);
+    global_State *g = G(L);
+    l_mem tb = gettotalbytes(g);
+    l_mem debt = limit < (double)MAX_LMEM ? tb - (l_mem)limit : tb - MAX_LMEM;
+
+    if (debt < 0)
+    {
+        g->totalbytes = tb - debt;
+        g->GCdebt = debt;
+    }
+#else
+    (void)L;
+    (void)c;
+    (void)limit;
+#endif
+}
+
+#if LUA_VERSION_NUM == 504
+//LUA_GCSTEP 的步长会叠加到 gc_park 留下的负债上, 切片前先清零
+static void gc_unpark(lua_State *L)
+{
+    global_State *g = G(L);
+    g->totalbytes = gettotalbytes(g);
+    g->GCdebt = 0;
+}
+#endif
+
+static void gc_beginframe(lua_State *L, gcctrl *c)
+{
+    int kb = lua_gc(L, LUA_GCCOUNT, 0);
+    c->allocated += kb > c->lastkb ? kb - c->lastkb : 0;
+    c->lastkb = kb;
+    c->allocrate = GC_EMA(c->allocrate, c->allocated);
+    c->stats.frame = c->spent * 1e6;
+    c->stats.allocrate = c->allocrate;
+    c->stats.steps = c->steps;
+    c->spent = 0;
+    c->stepped = 0;
+    c->allocated = 0;
+    c->steps = 0;
+
+    if (c->cooldown > 0)
+    {
+        --c->cooldown;
+    }
+}
+
+static void gc_endcycle(lua_State *L, gcctrl *c)
+{
+    int kb = lua_gc(L, LUA_GCCOUNT, 0);
+
+#if LUA_VERSION_NUM == 504
+    /*进入分代要做一次完整标记, 只在整个周期一帧预算内做得完且内存平稳时尝试.
+      是否真的适合分代由 gc_young 看 young 回收的效果决定*/
+    c->streak = c->cyclecost < c->budget && kb <= c->estimate + c->estimate / 10 ? c->streak + 1 : 0;
+#endif
+
+    c->incycle = false;
+    c->estimate = kb;
+    c->cyclecost = 0;
+    c->stats.cycles++;
+
+#if LUA_VERSION_NUM == 504
+    if (c->streak >= 3 && c->cooldown == 0)
+    {
+        double t0 = bind_seconds();
+        lua_gc(L, LUA_GCGEN, 0, 0);
+        c->spent += bind_seconds() - t0;
+        c->stats.generational = 1;
+        c->streak = 0;
+        c->cooldown = GC_SWITCHDELAY;
+        c->estimate = lua_gc(L, LUA_GCCOUNT, 0);
+    }
+#endif
+}
+
+#if LUA_VERSION_NUM == 504
+//young 回收没法切片, 预计超出剩余预算时推到下一帧, 除非内存已经翻倍
+static void gc_young(lua_State *L, gcctrl *c, int kb, double limit)
+{
+    if (kb < c->estimate + c->estimate / 5 || (kb < c->estimate * 2 && c->youngcost > limit - c->spent))
+    {
+        return;
+    }
+
+    double t0 = bind_seconds();
+    lua_gc(L, LUA_GCSTEP, 0);
+    double cost = bind_seconds() - t0;
+    int after = lua_gc(L, LUA_GCCOUNT, 0);
+
+    c->spent += cost;
+    c->steps++;
+    c->stats.cycles++;
+    c->youngcost = GC_EMA(c->youngcost, cost);
+    c->estimate = after;
+    //回收不到 20% 说明存活对象多, 单次超预算也没法分帧, 都回到增量模式
+    c->streak = after * 5 > kb * 4 ? c->streak + 1 : 0;
+
+    if ((c->streak >= 3 || c->youngcost > c->budget) && c->cooldown == 0)
+    {
+        lua_gc(L, LUA_GCINC, 0, 0, GC_STEPSIZE);
+        c->backoff = c->backoff < 64 ? c->backoff * 2 + 1 : c->backoff;
+        c->stats.generational = 0;
+        c->streak = 0;
+        c->cooldown = GC_SWITCHDELAY * c->backoff;
+        c->incycle = false;
+    }
+}
+#endif
+
+static void gc_step(lua_State *L, gcctrl *c, double limit)
+{
+    int kb = lua_gc(L, LUA_GCCOUNT, 0);
+    c->allocated += kb > c->lastkb ? kb - c->lastkb : 0;
+
+#if LUA_VERSION_NUM == 504
+    if (c->stats.generational)
+    {
+        gc_young(L, c, kb, limit);
+        gc_park(L, c);
+        c->lastkb = lua_gc(L, LUA_GCCOUNT, 0);
+        return;
+    }
+#endif
+
+    if (!c->incycle)
+    {
+        if (kb < c->estimate * GC_PAUSE / 100)
+        {
+            gc_park(L, c);
+            c->lastkb = kb;
+            return;
+        }
+
+        c->incycle = true;
+    }
+
+#if LUA_VERSION_NUM == 504
+    gc_unpark(L);
+#endif
+
+    while (true)
+    {
+        double left = limit - c->spent;
+        int phase = GC_SWEEPING(L);
+        double kbcost = c->kbcost[phase];
+        int stepkb = kbcost > 0 ? (int)((left < GC_SLICE ? left : GC_SLICE) / kbcost) : 1;
+
+        if (stepkb < 1)
+        {
+            /*预算用完, 标记阶段至少推进本帧的分配量, 和自动 gc 的工作量一致.
+              清扫一步就可能扫完整个堆, 内存超过阈值两倍才追*/
+            if ((phase && kb < c->estimate * GC_PAUSE / 50) || c->stepped >= c->allocated)
+            {
+                break;
+            }
+
+            stepkb = (int)ceil(c->allocated - c->stepped);
+        }
+
+        double t0 = bind_seconds();
+        int done = lua_gc(L, LUA_GCSTEP, stepkb);
+        double cost = bind_seconds() - t0;
+
+        c->spent += cost;
+        c->cyclecost += cost;
+        c->stepped += stepkb;
+        c->steps++;
+
+        //从标记跨进清扫的一步含原子阶段, 不能当样本. 估计值涨得快跌得慢, 宁可步子小也不超预算
+        if (phase || (!done && !GC_SWEEPING(L)))
+        {
+            double v = cost / stepkb;
+            c->kbcost[phase] = v > kbcost ? v : GC_EMA(kbcost, v);
+        }
+
+        if (done)
+        {
+            gc_endcycle(L, c);
+            break;
+        }
+
+        kb = lua_gc(L, LUA_GCCOUNT, 0);
+    }
+
+    gc_park(L, c);                                      //步进后会重设阈值, 兜底的自动 gc 也可能跑过
+    c->lastkb = lua_gc(L, LUA_GCCOUNT, 0);
+}
+
+//每帧 gc 预算微秒, update 最多用一半, lateupdate 用剩下的. <= 0 关闭并恢复自动 gc
+LUALIB_API void tolua_setgcbudget(lua_State *L, int budget)
+{
+    gcctrl *c = getgcctrl(L);
+
+    if (budget <= 0)
+    {
+        if (c != NULL)
+        {
+            lua_pushnil(L);
+            lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_GCCTRL);
+#if LUA_VERSION_NUM == 504
+            lua_gc(L, LUA_GCINC, LUAI_GCPAUSE, LUAI_GCMUL, LUAI_GCSTEPSIZE);
+#elif !defined(LUA_JITLIBNAME)
+            lua_gc(L, LUA_GCSETPAUSE, GC_PAUSE);
+#endif
+            lua_gc(L, LUA_GCRESTART, 0);
+        }
+
+        return;
+    }
+
+    if (c == NULL)
+    {
+        c = (gcctrl*)lua_newuserdata(L, sizeof(gcctrl));
+        memset(c, 0, sizeof(gcctrl));
+        lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_GCCTRL);
+#if LUA_VERSION_NUM == 504
+        lua_gc(L, LUA_GCINC, 0, 0, GC_STEPSIZE);        //从增量开始, 由控制器决定要不要切分代
+#elif !defined(LUA_JITLIBNAME)
+        lua_gc(L, LUA_GCSETPAUSE, GC_BACKSTOP);
+#endif
+        c->estimate = c->lastkb = lua_gc(L, LUA_GCCOUNT, 0);
+        gc_park(L, c);
+    }
+
+    c->budget = budget * 1e-6;
+}
+
+LUALIB_API bool tolua_getgcstats(lua_State *L, tolua_GCStats *out)
+{
+    gcctrl *c = getgcctrl(L);
+
+    if (c == NULL)
+    {
+        return false;
+    }
+
+    *out = c->stats;
+    out->stepcost = c->kbcost[0] * 1e6;
+    out->sweepcost = c->kbcost[1] * 1e6;
+    return true;
+}
+
 LUALIB_API int tolua_update(lua_State *L, float deltaTime, float unscaledTime)
 {
+    gcctrl *gc = getgcctrl(L);
+
+    if (gc != NULL)
+    {
+        gc_beginframe(L, gc);
+    }
+
     int top = tolua_beginpcall(L, LUA_RIDX_UPDATE);
+    //先走到期的timer, 这帧Update里新加的等待下一帧才触发
+    int err = tolua_updatetimer(L, top, deltaTime, unscaledTime);
+
+    if (err != 0)
+    {
+        lua_insert(L, top + 1);                         //stack: traceback, err, Update
+    }
+
     lua_pushnumber(L, deltaTime);
     lua_pushnumber(L, unscaledTime);
-    return lua_pcall(L, 2, -1, top);
+    int ret = lua_pcall(L, 2, -1, top);
+
+    if (err != 0)
+    {
+        if (ret != 0)
+        {
+            lua_remove(L, top + 1);
+        }
+        else
+        {
+            lua_settop(L, top + 1);
+            ret = LUA_ERRRUN;
+        }
+    }
+
+    if (gc != NULL)
+    {
+        gc_step(L, gc, gc->budget * 0.5);
+    }
+
+    return ret;
 }
 
 LUALIB_API int tolua_lateupdate(lua_State *L)
 {
     int top = tolua_beginpcall(L, LUA_RIDX_LATEUPDATE);
-    return lua_pcall(L, 0, -1, top);
+    int ret = lua_pcall(L, 0, -1, top);
+    gcctrl *gc = getgcctrl(L);
+
+    if (ret == 0)
+    {
+        lua_settop(L, top);
+    }
+
+    //本帧 post 的事件, LateUpdate 出错时也照常分发, 只返回 LateUpdate 的错误
+    if (event_flush(L, top) > 0)
+    {
+        if (ret != 0)
+        {
+            lua_pop(L, 1);
+        }
+        else
+        {
+            ret = LUA_ERRRUN;
+        }
+    }
+
+    if (gc != NULL)
+    {
+        gc_step(L, gc, gc->budget);
+    }
+
+    return ret;
 }
 
 LUALIB_API int tolua_fixedupdate(lua_State *L, float fixedTime)
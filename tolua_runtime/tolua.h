@@ -36,24 +36,139 @@
 #define LUA_RIDX_LOADED				26
 #define LUA_RIDX_UINT64				27
 #define LUA_RIDX_CUSTOMTRACEBACK 	28
+#define LUA_RIDX_VALUEFIELDS		29
+#define LUA_RIDX_VEC3META			30
+#define LUA_RIDX_VEC2META			31
+#define LUA_RIDX_VEC4META			32
+#define LUA_RIDX_QUATMETA			33
+#define LUA_RIDX_CLRMETA			34
+#define LUA_RIDX_SCHEDULER			35
+#define LUA_RIDX_GCCTRL				36
+#define LUA_RIDX_ERRTRACE			37
+#define LUA_RIDX_CONTEXT			38
+#define LUA_RIDX_CHANNEL			39
+#define LUA_RIDX_COPOOL				40
+#define LUA_RIDX_VALUETYPE			41
+#define LUA_RIDX_BYTES				42
+#define LUA_RIDX_INTERN				43
+#define LUA_RIDX_EVENTBUS			44
+#define LUA_RIDX_ACCESSORMETA		45
+#define LUA_RIDX_TIMERWAIT			46
+#define LUA_RIDX_PRELOADCACHE		47
 
 #define LUA_NULL_USERDATA 	1
 #define TOLUA_NOPEER    	LUA_REGISTRYINDEX 		
 #define FLAG_INDEX_ERROR 	1
 #define FLAG_INT64       	2
+#define FLAG_BINDSTATS   	4
 
 #define MAX_ITEM 512
 
+/*tolua_regclass 描述表, 一次调用注册整个类. baseType < 0 时为 tolua_regclasses 同批次下标 -(i + 1)*/
+typedef struct tolua_Func
+{
+    const char *name;
+    lua_CFunction func;
+} tolua_Func;
+
+typedef struct tolua_Var
+{
+    const char *name;
+    lua_CFunction get;
+    lua_CFunction set;
+} tolua_Var;
+
+typedef struct tolua_Const
+{
+    const char *name;
+    double value;
+} tolua_Const;
+
+typedef struct tolua_Class
+{
+    const char *name;
+    int baseType;
+    int ref;
+    const tolua_Func *funcs;
+    int nfuncs;
+    const tolua_Var *vars;
+    int nvars;
+    const tolua_Const *consts;
+    int nconsts;
+} tolua_Class;
+
+/*FLAG_BINDSTATS 下每个注册函数的统计, hist[k] 为耗时在 [2^k, 2^(k+1)) ticks 的调用数*/
+#define TOLUA_BINDHIST 32
+
+typedef struct tolua_BindStat
+{
+    const char *name;
+    uint64_t calls;
+    uint64_t ticks;
+    uint32_t hist[TOLUA_BINDHIST];
+} tolua_BindStat;
+
+/*tolua_newstate 分页池的统计, classes[i] 为 (i + 1) * 16 字节一级*/
+#define TOLUA_MEMCLASSES 16
+
+typedef struct tolua_MemClass
+{
+    uint32_t size;
+    uint32_t pages;
+    uint64_t blocks;            //在用块数
+    uint64_t bytes;             //在用块的请求字节
+    uint64_t allocs;
+} tolua_MemClass;
+
+typedef struct tolua_MemStats
+{
+    uint64_t used;              //lua 当前持有的字节
+    uint64_t peak;
+    uint64_t reserved;          //向系统申请的字节, 页 + 大块
+    uint64_t large;             //大于 256 字节直接 realloc 的部分
+    uint64_t largeallocs;
+    double fragmentation;       //页内没有被请求字节占用的比例
+    tolua_MemClass classes[TOLUA_MEMCLASSES];
+} tolua_MemStats;
+
+/*tolua_setgcbudget 控制器的统计, 时间单位微秒, 内存单位 KB*/
+typedef struct tolua_GCStats
+{
+    double frame;               //上一帧 gc 用时
+    double stepcost;            //标记阶段每 KB 步长的平均耗时
+    double sweepcost;           //清扫阶段每 KB 步长的平均耗时
+    double allocrate;           //每帧分配量
+    int steps;                  //上一帧步数
+    int cycles;                 //完成的回收次数, 分代模式下为 young 回收次数
+    int generational;
+} tolua_GCStats;
+
+/*tolua.startco 协程池统计*/
+typedef struct tolua_CoPoolStats
+{
+    int hits;                   //复用了空闲线程的次数
+    int misses;                 //新建线程的次数
+    int idle;                   //池里空闲的线程数
+} tolua_CoPoolStats;
+
 #define abs_index(L, i)  ((i) > 0 || (i) <= LUA_REGISTRYINDEX ? (i) : lua_gettop(L) + (i) + 1)
 
 void tolua_openint64(lua_State* L);
 int  tolua_newint64(lua_State* L);
 void tolua_pushint64(lua_State* L, int64_t n);
+int64_t tolua_toint64(lua_State* L, int pos);
 
 void tolua_openuint64(lua_State* L);
 int  tolua_newuint64(lua_State* L);
+void tolua_pushuint64(lua_State* L, uint64_t n);
+uint64_t tolua_touint64(lua_State* L, int pos);
+
+const char* tolua_tolbytes(lua_State *L, int idx, size_t *len);
+const char* tolua_checklbytes(lua_State *L, int idx, size_t *len);
+int tolua_bytesterminated(lua_State *L, int idx);
 
 extern int toluaflags;
+int tolua_stateflags(lua_State *L);
 
 #if LUA_VERSION_NUM >= 503
 #define lua_getfenv	lua_getuservalue